@@ -0,0 +1,65 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "arith_uint256.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "pow.h"
+#include "txdb.h"
+
+// Loading a block index of 100000 headers from the block tree database
+static void BlockIndexLoad(benchmark::State& state)
+{
+    static const int nBlocks = 100000;
+    SelectParams(CBaseChainParams::REGTEST);
+    const Consensus::Params& params = Params().GetConsensus();
+
+    // A chain of headers with valid (regtest) proof of work
+    std::vector<uint256> vHashes(nBlocks);
+    std::vector<CBlockIndex> vIndex(nBlocks);
+    std::vector<const CBlockIndex*> vWrite;
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.nTime = 1296688602;
+    header.nBits = UintToArith256(params.powLimit).GetCompact();
+    for (int i = 0; i < nBlocks; i++) {
+        header.hashPrevBlock = i ? vHashes[i - 1] : uint256();
+        header.nTime += 30;
+        while (!CheckProofOfWork(header.GetHash(), header.nBits, params))
+            header.nNonce++;
+        vHashes[i] = header.GetHash();
+        vIndex[i] = CBlockIndex(header);
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nHeight = i;
+        vIndex[i].nStatus = BLOCK_VALID_TREE;
+        vWrite.push_back(&vIndex[i]);
+    }
+
+    CCoinsView viewDummy;
+    pcoinsTip = new CCoinsViewCache(&viewDummy);
+    pblocktree = new CBlockTreeDB(1 << 24, true, true);
+    pblocktree->WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, vWrite);
+
+    while (state.KeepRunning()) {
+        LOCK(cs_main);
+        UnloadBlockIndex();
+        assert(LoadBlockIndex());
+        assert(mapBlockIndex.size() == (size_t)nBlocks);
+    }
+
+    {
+        LOCK(cs_main);
+        UnloadBlockIndex();
+    }
+    delete pblocktree;
+    pblocktree = NULL;
+    delete pcoinsTip;
+    pcoinsTip = NULL;
+}
+
+BENCHMARK(BlockIndexLoad);
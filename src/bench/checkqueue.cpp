@@ -0,0 +1,81 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "checkqueue.h"
+#include "crypto/sha256.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+/* Number of checks pushed through the queue per iteration, as in a large block */
+static const int CHECKS_PER_ITERATION = 4000;
+/* Number of checks added at once, roughly the inputs of one transaction */
+static const int CHECKS_PER_ADD = 2;
+
+/** A check doing a fixed amount of hashing, as a stand-in for a signature verification */
+struct HashCheck
+{
+    unsigned int nRounds;
+
+    HashCheck() : nRounds(0) {}
+    explicit HashCheck(unsigned int nRoundsIn) : nRounds(nRoundsIn) {}
+
+    bool operator()()
+    {
+        unsigned char buf[CSHA256::OUTPUT_SIZE] = {};
+        for (unsigned int i = 0; i < nRounds; i++)
+            CSHA256().Write(buf, sizeof(buf)).Finalize(buf);
+        return true;
+    }
+
+    void swap(HashCheck& check) { std::swap(nRounds, check.nRounds); }
+};
+
+// Time to verify CHECKS_PER_ITERATION checks with the master and nThreads - 1
+// workers; checks per second is CHECKS_PER_ITERATION divided by the result.
+static void CheckQueue(benchmark::State& state, int nThreads, unsigned int nRounds)
+{
+    CCheckQueue<HashCheck> queue(128);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads - 1; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<HashCheck>::Thread, boost::ref(queue)));
+
+    while (state.KeepRunning()) {
+        CCheckQueueControl<HashCheck> control(&queue);
+        for (int i = 0; i < CHECKS_PER_ITERATION; i += CHECKS_PER_ADD) {
+            std::vector<HashCheck> vChecks(CHECKS_PER_ADD, HashCheck(nRounds));
+            control.Add(vChecks);
+        }
+        control.Wait();
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+// Nearly free checks, so the cost is dominated by queue overhead and contention
+static void CheckQueueEmpty1(benchmark::State& state) { CheckQueue(state, 1, 0); }
+static void CheckQueueEmpty2(benchmark::State& state) { CheckQueue(state, 2, 0); }
+static void CheckQueueEmpty4(benchmark::State& state) { CheckQueue(state, 4, 0); }
+static void CheckQueueEmpty8(benchmark::State& state) { CheckQueue(state, 8, 0); }
+static void CheckQueueEmpty16(benchmark::State& state) { CheckQueue(state, 16, 0); }
+
+// Checks doing a few microseconds of hashing each
+static void CheckQueueHash1(benchmark::State& state) { CheckQueue(state, 1, 20); }
+static void CheckQueueHash2(benchmark::State& state) { CheckQueue(state, 2, 20); }
+static void CheckQueueHash4(benchmark::State& state) { CheckQueue(state, 4, 20); }
+static void CheckQueueHash8(benchmark::State& state) { CheckQueue(state, 8, 20); }
+static void CheckQueueHash16(benchmark::State& state) { CheckQueue(state, 16, 20); }
+
+BENCHMARK(CheckQueueEmpty1);
+BENCHMARK(CheckQueueEmpty2);
+BENCHMARK(CheckQueueEmpty4);
+BENCHMARK(CheckQueueEmpty8);
+BENCHMARK(CheckQueueEmpty16);
+BENCHMARK(CheckQueueHash1);
+BENCHMARK(CheckQueueHash2);
+BENCHMARK(CheckQueueHash4);
+BENCHMARK(CheckQueueHash8);
+BENCHMARK(CheckQueueHash16);
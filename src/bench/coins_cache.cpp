@@ -0,0 +1,61 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "random.h"
+
+static std::vector<uint256> RandomTxids(size_t n)
+{
+    std::vector<uint256> v(n);
+    for (size_t i = 0; i < n; i++) {
+        for (unsigned int* p = (unsigned int*)v[i].begin(); p < (unsigned int*)v[i].end(); p++)
+            *p = insecure_rand();
+    }
+    return v;
+}
+
+static void AddCoins(CCoinsViewCache& cache, const std::vector<uint256>& txids)
+{
+    for (size_t i = 0; i < txids.size(); i++) {
+        CCoinsModifier coins = cache.ModifyNewCoins(txids[i], false);
+        coins->vout.resize(1);
+        coins->vout[0].nValue = i;
+    }
+}
+
+// Lookups of 1000 cached and 1000 missing txids in a cache of 100000 entries
+static void CoinsCacheLookup(benchmark::State& state)
+{
+    seed_insecure_rand(true);
+    CCoinsView viewDummy;
+    CCoinsViewCache cache(&viewDummy);
+    std::vector<uint256> txids = RandomTxids(100000);
+    std::vector<uint256> missing = RandomTxids(1000);
+    AddCoins(cache, txids);
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < 1000; i++) {
+            assert(cache.AccessCoins(txids[insecure_rand() % txids.size()]));
+            assert(!cache.HaveCoins(missing[i]));
+        }
+    }
+}
+
+// Creating 1000 entries in a child cache and flushing them into its parent
+static void CoinsCacheFlush(benchmark::State& state)
+{
+    seed_insecure_rand(true);
+    CCoinsView viewDummy;
+    std::vector<uint256> txids = RandomTxids(1000);
+    while (state.KeepRunning()) {
+        CCoinsViewCache base(&viewDummy);
+        CCoinsViewCache cache(&base);
+        AddCoins(cache, txids);
+        cache.Flush();
+    }
+}
+
+BENCHMARK(CoinsCacheLookup);
+BENCHMARK(CoinsCacheFlush);
@@ -0,0 +1,69 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "blockencodings.h"
+#include "main.h"
+#include "txmempool.h"
+
+#include <vector>
+
+// Reconstructing a compact block of 2500 transactions against a mempool of
+// 100000, with 2400 of the block's transactions in the mempool and 50 more in
+// the extra transactions of 100
+static void CompactBlockReconstruction(benchmark::State& state)
+{
+    static const int nMempoolTxs = 100000;
+    static const int nBlockTxs = 2500;
+
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<CTransaction> vTxs;
+    vTxs.reserve(nMempoolTxs + nBlockTxs);
+    for (int i = 0; i < nMempoolTxs + nBlockTxs; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_1;
+        tx.vout[0].nValue = 10 * COIN;
+        vTxs.push_back(CTransaction(tx));
+    }
+    {
+        LOCK(pool.cs);
+        for (int i = 0; i < nMempoolTxs; i++)
+            pool.addUnchecked(vTxs[i].GetHash(), CTxMemPoolEntry(vTxs[i], 1000, 0, 0.0, 1, true, 0, false, 4, LockPoints()), false);
+    }
+
+    // The block takes every 40th mempool transaction, then ones the mempool
+    // never saw, half of which are among the extra transactions
+    CBlock block;
+    block.nBits = 0x207fffff;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    block.vtx.push_back(CTransaction(coinbase));
+    for (int i = 0; i < nMempoolTxs && (int)block.vtx.size() <= 2400; i += 40)
+        block.vtx.push_back(vTxs[i]);
+    std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > extra_txn;
+    for (int i = nMempoolTxs; (int)block.vtx.size() < nBlockTxs; i++) {
+        block.vtx.push_back(vTxs[i]);
+        if (i % 2 == 0)
+            extra_txn.push_back(std::make_pair(vTxs[i].GetWitnessHash(), std::make_shared<const CTransaction>(vTxs[i])));
+    }
+    for (int i = nMempoolTxs + nBlockTxs; extra_txn.size() < 100; i++) {
+        CMutableTransaction tx(vTxs[i % vTxs.size()]);
+        tx.nLockTime = i;
+        extra_txn.push_back(std::make_pair(tx.GetHash(), std::make_shared<const CTransaction>(tx)));
+    }
+    CBlockHeaderAndShortTxIDs cmpctblock(block, true);
+
+    while (state.KeepRunning()) {
+        PartiallyDownloadedBlock partialBlock(&pool);
+        ReadStatus status = partialBlock.InitData(cmpctblock, extra_txn);
+        assert(status == READ_STATUS_OK);
+    }
+}
+
+BENCHMARK(CompactBlockReconstruction);
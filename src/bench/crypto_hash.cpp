@@ -51,6 +51,48 @@ static void SHA256_32b(benchmark::State& state)
     }
 }
 
+static void SHA256D64_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024, 0);
+    while (state.KeepRunning()) {
+        SHA256D64(begin_ptr(in), begin_ptr(in), 1024);
+    }
+}
+
+// 1024 block headers, as in a headers message
+static void SHA256D80_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(80 * 1024, 0);
+    std::vector<uint8_t> out(32 * 1024);
+    while (state.KeepRunning()) {
+        SHA256D80(begin_ptr(out), begin_ptr(in), 1024);
+    }
+}
+
+// 1024 nonces of one block header, as the internal miner scans them
+static void SHA256D80Nonces_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(80, 0);
+    std::vector<uint8_t> out(32 * 1024);
+    CSHA256D80Nonces hasher(begin_ptr(in));
+    uint32_t nonce = 0;
+    while (state.KeepRunning()) {
+        hasher.Hash(begin_ptr(out), nonce, 1024);
+        nonce += 1024;
+    }
+}
+
+// The same 1024 hashes one at a time through the generic double-SHA256 hasher
+static void DoubleSHA256_64b_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024, 0);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1024; i++) {
+            CHash256().Write(&in[64 * i], 64).Finalize(&in[32 * i]);
+        }
+    }
+}
+
 static void SHA512(benchmark::State& state)
 {
     uint8_t hash[CSHA512::OUTPUT_SIZE];
@@ -75,4 +117,8 @@ BENCHMARK(SHA256);
 BENCHMARK(SHA512);
 
 BENCHMARK(SHA256_32b);
+BENCHMARK(SHA256D64_1024);
+BENCHMARK(SHA256D80_1024);
+BENCHMARK(SHA256D80Nonces_1024);
+BENCHMARK(DoubleSHA256_64b_1024);
 BENCHMARK(SipHash_32b);
@@ -0,0 +1,50 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "pow.h"
+
+// The contextual checks of accepting 10000 new (mainnet) headers, which
+// retarget every block
+static void HeaderDifficultyChecks(benchmark::State& state)
+{
+    static const int nBlocks = 10000;
+    SelectParams(CBaseChainParams::MAIN);
+    const Consensus::Params& params = Params().GetConsensus();
+
+    std::vector<CBlockIndex> vIndex(nBlocks);
+    std::vector<CBlockHeader> vHeaders(nBlocks);
+    for (int i = 0; i < nBlocks; i++) {
+        CBlockHeader& header = vHeaders[i];
+        header.nVersion = 4;
+        // Blocks come a bit faster than the target spacing, so the difficulty keeps moving
+        header.nTime = 1487000003 + i * (params.nPowTargetSpacing - 3) + (i * 7) % 11;
+        header.nBits = GetNextWorkRequired(i ? &vIndex[i - 1] : NULL, &header, params);
+        vIndex[i] = CBlockIndex(header);
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nHeight = i;
+        vIndex[i].BuildSkip();
+    }
+    int64_t nAdjustedTime = vHeaders.back().GetBlockTime();
+
+    while (state.KeepRunning()) {
+        // Every header is new to the index
+        for (int i = 0; i < nBlocks; i++) {
+            vIndex[i].nTimeMedianPast = 0;
+            vIndex[i].nBitsNext = 0;
+        }
+        for (int i = 1; i < nBlocks; i++) {
+            CValidationState stateCheck;
+            bool fValid = ContextualCheckBlockHeader(vHeaders[i], stateCheck, params, &vIndex[i - 1], nAdjustedTime);
+            assert(fValid);
+        }
+    }
+}
+
+BENCHMARK(HeaderDifficultyChecks);
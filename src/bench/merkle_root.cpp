@@ -0,0 +1,28 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "uint256.h"
+#include "random.h"
+#include "consensus/merkle.h"
+
+// Merkle root of a synthetic block with 10000 transactions
+static void MerkleRoot(benchmark::State& state)
+{
+    std::vector<uint256> leaves;
+    leaves.resize(10000);
+    seed_insecure_rand(true);
+    for (size_t s = 0; s < leaves.size(); s++) {
+        for (unsigned int *p = (unsigned int*)leaves[s].begin(); p < (unsigned int*)leaves[s].end(); p++)
+            *p = insecure_rand();
+    }
+    while (state.KeepRunning()) {
+        bool mutation = false;
+        uint256 hash = ComputeMerkleRoot(leaves, &mutation);
+        leaves[mutation] = hash;
+    }
+}
+
+BENCHMARK(MerkleRoot);
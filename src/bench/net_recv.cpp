@@ -0,0 +1,92 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <iostream>
+
+#include "bench.h"
+#include "chainparams.h"
+#include "hash.h"
+#include "net.h"
+#include "netbase.h"
+#include "protocol.h"
+#include "streams.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+
+static void AppendMessage(std::vector<char>& vStream, const char* pszCommand, const std::vector<char>& vPayload)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    hdr.nChecksum = ReadLE32(hash.begin());
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << hdr;
+    vStream.insert(vStream.end(), ssHeader.begin(), ssHeader.end());
+    vStream.insert(vStream.end(), vPayload.begin(), vPayload.end());
+}
+
+// Feed a peer's socket a 1 MB block, a 300 KB block and 200
+// transaction-sized messages per iteration, received the way
+// ThreadSocketHandler does, and report how many buffers were allocated and
+// how many bytes were copied per MB. The messages are kept until the end of
+// the iteration, so the pool ends up with a buffer for each block, and the
+// 1 MB block should take the one that fits it.
+static void NetReceive(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+
+    std::vector<char> vStream;
+    AppendMessage(vStream, NetMsgType::BLOCK, std::vector<char>(1000000, 1));
+    AppendMessage(vStream, NetMsgType::BLOCK, std::vector<char>(300000, 1));
+    for (int i = 0; i < 200; i++)
+        AppendMessage(vStream, NetMsgType::TX, std::vector<char>(250, 2));
+
+    CNode* pnode = new CNode(fds[0], CAddress(CService("10.0.0.1", 8333), NODE_NETWORK), "", true);
+    CNetRecvStats statsBegin = GetNetRecvStats();
+    while (state.KeepRunning()) {
+        size_t nSent = 0;
+        size_t nMessages = 0;
+        while (nMessages < 202) {
+            if (nSent < vStream.size()) {
+                ssize_t nBytes = send(fds[1], &vStream[nSent], vStream.size() - nSent, MSG_NOSIGNAL);
+                if (nBytes > 0)
+                    nSent += nBytes;
+            }
+            LOCK(pnode->cs_vRecvMsg);
+            int nBytes;
+            if (!pnode->ReceiveFromSocket(nBytes))
+                break;
+            nMessages = pnode->vRecvMsg.size();
+            if (nMessages > 0 && !pnode->vRecvMsg.back().complete())
+                nMessages--;
+        }
+        // Hand the messages back only now, as a busy handler would, so that
+        // both blocks hold a buffer at the same time
+        LOCK(pnode->cs_vRecvMsg);
+        pnode->vRecvMsg.clear();
+    }
+    CNetRecvStats statsEnd = GetNetRecvStats();
+
+    double dMB = (statsEnd.nBytes - statsBegin.nBytes) / 1000000.0;
+    if (dMB > 0) {
+        std::cout << "NetReceive-allocs-per-MB,1," << (statsEnd.nBufferAllocs - statsBegin.nBufferAllocs) / dMB << ",,\n";
+        std::cout << "NetReceive-reuses-per-MB,1," << (statsEnd.nBufferReuses - statsBegin.nBufferReuses) / dMB << ",,\n";
+        std::cout << "NetReceive-bytes-copied-per-MB,1," << (statsEnd.nBytesCopied - statsBegin.nBytesCopied) / dMB << ",,\n";
+    }
+
+    pnode->CloseSocketDisconnect();
+    delete pnode;
+    SOCKET hRemote = fds[1];
+    CloseSocket(hRemote);
+}
+
+BENCHMARK(NetReceive);
+#endif
@@ -0,0 +1,70 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "cuckoocache.h"
+#include "random.h"
+#include "script/sigcache.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+typedef CCuckooCache<uint256, CSignatureCacheHasher> CBenchCache;
+
+/* Lookups per thread per iteration */
+static const int OPS_PER_THREAD = 16384;
+
+static std::vector<uint256> RandomHashes(size_t n)
+{
+    std::vector<uint256> v(n);
+    for (size_t i = 0; i < n; i++) {
+        for (unsigned int* p = (unsigned int*)v[i].begin(); p < (unsigned int*)v[i].end(); p++)
+            *p = insecure_rand();
+    }
+    return v;
+}
+
+// Mimic script check threads: mostly lookups (half of them hits, erased on
+// hit as during block validation), with one insert in 16 serialized on a
+// writer lock as CSignatureCache does.
+static void SigCacheWorker(CBenchCache* cache, boost::mutex* csWrite, const std::vector<uint256>* vPresent, const std::vector<uint256>* vNew, size_t nOffset)
+{
+    for (int i = 0; i < OPS_PER_THREAD; i++) {
+        size_t n = (nOffset + i * 7919) % vPresent->size();
+        if ((i & 15) == 15) {
+            boost::unique_lock<boost::mutex> lock(*csWrite);
+            cache->Insert((*vNew)[n % vNew->size()]);
+        } else if (i & 1) {
+            cache->Contains((*vPresent)[n], true);
+        } else {
+            cache->Contains((*vNew)[n % vNew->size()], false);
+        }
+    }
+}
+
+static void SigCache(benchmark::State& state, int nThreads)
+{
+    seed_insecure_rand(true);
+    CBenchCache cache;
+    uint32_t nSize = cache.SetupBytes(DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+    std::vector<uint256> vPresent = RandomHashes(nSize / 2);
+    std::vector<uint256> vNew = RandomHashes(1 << 16);
+    for (size_t i = 0; i < vPresent.size(); i++)
+        cache.Insert(vPresent[i]);
+    boost::mutex csWrite;
+
+    size_t nRound = 0;
+    while (state.KeepRunning()) {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&SigCacheWorker, &cache, &csWrite, &vPresent, &vNew, (nRound++) * OPS_PER_THREAD));
+        threadGroup.join_all();
+    }
+}
+
+static void SigCache1Thread(benchmark::State& state) { SigCache(state, 1); }
+static void SigCache8Threads(benchmark::State& state) { SigCache(state, 8); }
+
+BENCHMARK(SigCache1Thread);
+BENCHMARK(SigCache8Threads);
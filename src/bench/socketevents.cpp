@@ -0,0 +1,75 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "netbase.h"
+#include "random.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+
+// Drive nPairs connected loopback socket pairs the way ThreadSocketHandler
+// does: all sockets are registered once, then every round one random peer
+// writes a byte and the waiting side has to find and drain it.
+static void SocketEvents(benchmark::State& state, SocketEventsMode mode, int nPairs)
+{
+    if (RaiseFileDescriptorLimit(2 * nPairs + 64) < 2 * nPairs + 64)
+        return;
+
+    std::vector<SOCKET> vLocal, vRemote;
+    for (int i = 0; i < nPairs; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+            break;
+        vLocal.push_back(fds[0]);
+        vRemote.push_back(fds[1]);
+    }
+
+    CSocketEvents events(mode);
+    for (size_t i = 0; i < vLocal.size(); i++)
+        events.Add(vLocal[i], SOCKET_EVENT_RECV | SOCKET_EVENT_ERR);
+    seed_insecure_rand(true);
+    std::vector<std::pair<SOCKET, int> > vReady;
+    char ch = 0;
+    while (state.KeepRunning()) {
+        size_t nWriter = insecure_rand() % vRemote.size();
+        if (send(vRemote[nWriter], &ch, 1, 0) != 1)
+            break;
+        events.Wait(50, vReady);
+        for (size_t i = 0; i < vReady.size(); i++) {
+            if (vReady[i].second & SOCKET_EVENT_RECV)
+                recv(vReady[i].first, &ch, 1, 0);
+        }
+    }
+
+    for (size_t i = 0; i < vLocal.size(); i++) {
+        events.Remove(vLocal[i]);
+        CloseSocket(vLocal[i]);
+        CloseSocket(vRemote[i]);
+    }
+}
+
+static void SocketEventsSelect400(benchmark::State& state)
+{
+    SocketEvents(state, SOCKETEVENTS_SELECT, 400);
+}
+
+BENCHMARK(SocketEventsSelect400);
+
+#if HAVE_SYS_EPOLL_H
+static void SocketEventsEpoll400(benchmark::State& state)
+{
+    SocketEvents(state, SOCKETEVENTS_EPOLL, 400);
+}
+
+static void SocketEventsEpoll4000(benchmark::State& state)
+{
+    SocketEvents(state, SOCKETEVENTS_EPOLL, 4000);
+}
+
+BENCHMARK(SocketEventsEpoll400);
+BENCHMARK(SocketEventsEpoll4000);
+#endif
+#endif
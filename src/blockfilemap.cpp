@@ -0,0 +1,132 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "util.h"
+
+#include <algorithm>
+#include <vector>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/** A whole file mapped into memory, or on WIN32 just the range asked for. */
+struct CBlockFileMapper::CMapping
+{
+    const char* pdata;
+    //! Offset in the file of pdata[0]
+    uint64_t nOffset;
+    size_t nLength;
+#ifdef WIN32
+    std::vector<char> vData;
+#endif
+
+    CMapping() : pdata(NULL), nOffset(0), nLength(0) {}
+
+    ~CMapping()
+    {
+#ifndef WIN32
+        if (pdata)
+            munmap((void*)pdata, nLength);
+#endif
+    }
+
+    bool Contains(uint64_t nPos, uint32_t nSize) const
+    {
+        return pdata && nPos >= nOffset && nPos + nSize <= nOffset + nLength;
+    }
+};
+
+CBlockFileMapper::CBlockFileMapper(size_t nMaxMappedIn) : nUseCounter(0), nMaxMapped(std::max((size_t)1, nMaxMappedIn))
+{
+}
+
+CBlockFileMapper::~CBlockFileMapper()
+{
+}
+
+bool CBlockFileMapper::Read(int nFile, const boost::filesystem::path& path, uint64_t nPos, uint32_t nSize, CBlockFileSpan& span)
+{
+    std::shared_ptr<const CMapping> mapping;
+    {
+        LOCK(cs);
+        std::map<int, CEntry>::iterator it = mapFiles.find(nFile);
+        if (it != mapFiles.end() && it->second.mapping->Contains(nPos, nSize)) {
+            it->second.nLastUsed = ++nUseCounter;
+            mapping = it->second.mapping;
+        }
+    }
+
+    if (!mapping) {
+        std::shared_ptr<CMapping> mappingNew = std::make_shared<CMapping>();
+#ifndef WIN32
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < nPos + nSize) {
+            close(fd);
+            return false;
+        }
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            LogPrintf("%s: cannot map %s\n", __func__, path.string());
+            return false;
+        }
+        mappingNew->pdata = (const char*)p;
+        mappingNew->nLength = st.st_size;
+#else
+        FILE* file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return false;
+        mappingNew->vData.resize(nSize);
+        bool fOk = fseek(file, nPos, SEEK_SET) == 0 && fread(mappingNew->vData.data(), 1, nSize, file) == nSize;
+        fclose(file);
+        if (!fOk)
+            return false;
+        mappingNew->pdata = mappingNew->vData.data();
+        mappingNew->nOffset = nPos;
+        mappingNew->nLength = nSize;
+#endif
+        mapping = mappingNew;
+
+#ifndef WIN32
+        // Only whole-file mappings are worth keeping around
+        LOCK(cs);
+        CEntry& entry = mapFiles[nFile];
+        if (!entry.mapping || entry.mapping->nLength < mapping->nLength)
+            entry.mapping = mapping;
+        entry.nLastUsed = ++nUseCounter;
+        while (mapFiles.size() > nMaxMapped) {
+            std::map<int, CEntry>::iterator itOldest = mapFiles.begin();
+            for (std::map<int, CEntry>::iterator it = mapFiles.begin(); it != mapFiles.end(); ++it) {
+                if (it->second.nLastUsed < itOldest->second.nLastUsed)
+                    itOldest = it;
+            }
+            mapFiles.erase(itOldest);
+        }
+#endif
+    }
+
+    span = CBlockFileSpan(mapping, mapping->pdata + (nPos - mapping->nOffset), nSize);
+    return true;
+}
+
+void CBlockFileMapper::Forget(int nFile)
+{
+    LOCK(cs);
+    mapFiles.erase(nFile);
+}
+
+size_t CBlockFileMapper::MappedCount()
+{
+    LOCK(cs);
+    return mapFiles.size();
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEMAP_H
+#define BITCOIN_BLOCKFILEMAP_H
+
+#include "sync.h"
+
+#include <map>
+#include <memory>
+#include <stdint.h>
+
+#include <boost/filesystem/path.hpp>
+
+/** Number of block files kept mapped at once. Block files are at most
+ *  128 MiB, so stay modest where address space is scarce. */
+static const size_t DEFAULT_MAX_MAPPED_BLOCKFILES = sizeof(void*) >= 8 ? 64 : 4;
+
+/**
+ * Read-only range of bytes from a block file. Holds a reference to the
+ * memory it points into, so it stays valid after the file is unmapped by the
+ * CBlockFileMapper, or even deleted. Serializes as the raw bytes.
+ */
+class CBlockFileSpan
+{
+private:
+    std::shared_ptr<const void> owner;
+    const char* pbegin;
+    const char* pend;
+
+public:
+    CBlockFileSpan() : pbegin(NULL), pend(NULL) {}
+    CBlockFileSpan(const std::shared_ptr<const void>& ownerIn, const char* pbeginIn, size_t nSize) : owner(ownerIn), pbegin(pbeginIn), pend(pbeginIn + nSize) {}
+
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pend; }
+    size_t size() const { return pend - pbegin; }
+    bool IsNull() const { return !owner; }
+
+    unsigned int GetSerializeSize(int, int=0) const
+    {
+        return size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int, int=0) const
+    {
+        s.write(pbegin, size());
+    }
+};
+
+/**
+ * Hands out byte ranges of block files without copying, by keeping the most
+ * recently used files memory-mapped. A file that has grown past its mapping
+ * is mapped again; spans into the old mapping keep it alive until they are
+ * gone. On platforms without mmap the range is read into memory instead.
+ *
+ * Only data that is already written and flushed to the file may be read.
+ * Thread safe.
+ */
+class CBlockFileMapper
+{
+private:
+    struct CMapping;
+
+    struct CEntry
+    {
+        std::shared_ptr<const CMapping> mapping;
+        uint64_t nLastUsed;
+    };
+
+    CCriticalSection cs;
+    std::map<int, CEntry> mapFiles;
+    uint64_t nUseCounter;
+    size_t nMaxMapped;
+
+    // Disallow copies
+    CBlockFileMapper(const CBlockFileMapper&);
+    CBlockFileMapper& operator=(const CBlockFileMapper&);
+
+public:
+    explicit CBlockFileMapper(size_t nMaxMappedIn = DEFAULT_MAX_MAPPED_BLOCKFILES);
+    ~CBlockFileMapper();
+
+    /** Get bytes [nPos, nPos + nSize) of block file nFile, which lives at
+     *  path. Returns false if the file is missing or too short. */
+    bool Read(int nFile, const boost::filesystem::path& path, uint64_t nPos, uint32_t nSize, CBlockFileSpan& span);
+
+    /** Drop the mapping of nFile, e.g. because the file was deleted. */
+    void Forget(int nFile);
+
+    /** Number of files currently mapped. */
+    size_t MappedCount();
+};
+
+#endif // BITCOIN_BLOCKFILEMAP_H
@@ -0,0 +1,114 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockrelaycache.h"
+
+#include "core_memusage.h"
+#include "primitives/block.h"
+
+#include <algorithm>
+
+CBlockRelayCache::CBlockRelayCache(size_t nMaxBlocksIn, size_t nMaxBytesIn) : nUseCounter(0), nMaxBlocks(std::max((size_t)1, nMaxBlocksIn)), nBytes(0), nMaxBytes(nMaxBytesIn), nHits(0), nMisses(0)
+{
+}
+
+void CBlockRelayCache::Trim()
+{
+    // Only a handful of blocks are kept, so finding the least recently used
+    // one by scanning is cheap
+    while (mapBlocks.size() > nMaxBlocks || (mapBlocks.size() > 1 && nBytes > nMaxBytes)) {
+        std::map<uint256, CEntry>::iterator itOldest = mapBlocks.begin();
+        for (std::map<uint256, CEntry>::iterator it = mapBlocks.begin(); it != mapBlocks.end(); ++it) {
+            if (it->second.nLastUsed < itOldest->second.nLastUsed)
+                itOldest = it;
+        }
+        nBytes -= itOldest->second.nBytes;
+        mapBlocks.erase(itOldest);
+    }
+}
+
+CBlockRelayCache::CEntry& CBlockRelayCache::Touch(const uint256& hash)
+{
+    std::map<uint256, CEntry>::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end())
+        it = mapBlocks.insert(std::make_pair(hash, CEntry())).first;
+    it->second.nLastUsed = ++nUseCounter;
+    return it->second;
+}
+
+CNetPayloadRef CBlockRelayCache::GetPayload(const uint256& hash, Form form)
+{
+    LOCK(cs);
+    std::map<uint256, CEntry>::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end() || !it->second.payloads[form]) {
+        nMisses++;
+        return CNetPayloadRef();
+    }
+    nHits++;
+    it->second.nLastUsed = ++nUseCounter;
+    return it->second.payloads[form];
+}
+
+std::shared_ptr<const CBlock> CBlockRelayCache::GetBlock(const uint256& hash)
+{
+    LOCK(cs);
+    std::map<uint256, CEntry>::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end())
+        return std::shared_ptr<const CBlock>();
+    it->second.nLastUsed = ++nUseCounter;
+    return it->second.block;
+}
+
+void CBlockRelayCache::AddPayload(const uint256& hash, Form form, const CNetPayloadRef& payload)
+{
+    LOCK(cs);
+    CEntry& entry = Touch(hash);
+    size_t nOld = entry.payloads[form] ? entry.payloads[form]->size() : 0;
+    size_t nNew = payload ? payload->size() : 0;
+    entry.payloads[form] = payload;
+    entry.nBytes += nNew - nOld;
+    nBytes += nNew - nOld;
+    Trim();
+}
+
+void CBlockRelayCache::AddBlock(const uint256& hash, const std::shared_ptr<const CBlock>& block)
+{
+    LOCK(cs);
+    CEntry& entry = Touch(hash);
+    size_t nOld = entry.block ? RecursiveDynamicUsage(*entry.block) : 0;
+    size_t nNew = block ? RecursiveDynamicUsage(*block) : 0;
+    entry.block = block;
+    entry.nBytes += nNew - nOld;
+    nBytes += nNew - nOld;
+    Trim();
+}
+
+void CBlockRelayCache::SetMaxBlocks(size_t nMaxBlocksIn)
+{
+    LOCK(cs);
+    nMaxBlocks = std::max((size_t)1, nMaxBlocksIn);
+    Trim();
+}
+
+void CBlockRelayCache::Clear()
+{
+    LOCK(cs);
+    mapBlocks.clear();
+    nBytes = 0;
+    nHits = 0;
+    nMisses = 0;
+}
+
+CBlockRelayCache::Stats CBlockRelayCache::GetStats()
+{
+    LOCK(cs);
+    Stats stats;
+    stats.nBlocks = mapBlocks.size();
+    stats.nMaxBlocks = nMaxBlocks;
+    stats.nBytes = nBytes;
+    stats.nMaxBytes = nMaxBytes;
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    return stats;
+}
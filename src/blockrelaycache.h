@@ -0,0 +1,105 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKRELAYCACHE_H
+#define BITCOIN_BLOCKRELAYCACHE_H
+
+#include "net.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <map>
+#include <memory>
+#include <stdint.h>
+
+class CBlock;
+
+/** Number of recent blocks kept ready to relay */
+static const unsigned int DEFAULT_BLOCK_RELAY_CACHE = 2;
+/** Memory the cached blocks may use; the most recent one is kept regardless */
+static const size_t MAX_BLOCK_RELAY_CACHE_BYTES = 16 * 1000 * 1000;
+
+/**
+ * The most recently used blocks, as the payloads sent to peers asking for
+ * them, so that a new block is read and serialized once per form instead of
+ * once per peer. Each peer queues a reference to the same payload.
+ *
+ * The deserialized block is kept as well, for the forms that have to be
+ * built from it and for replies that differ per peer (merkle blocks). With
+ * all its forms a block can take several times its size, so the cache is
+ * bounded in bytes as well as in blocks.
+ *
+ * Thread safe. Two threads missing the same entry at once both build it;
+ * the last one stored is kept.
+ */
+class CBlockRelayCache
+{
+public:
+    enum Form
+    {
+        FULL_WITNESS = 0,
+        FULL_NO_WITNESS,
+        CMPCT_WITNESS,
+        CMPCT_NO_WITNESS,
+        FORM_COUNT
+    };
+
+    struct Stats
+    {
+        size_t nBlocks;
+        size_t nMaxBlocks;
+        size_t nBytes;
+        size_t nMaxBytes;
+        uint64_t nHits;
+        uint64_t nMisses;
+    };
+
+private:
+    struct CEntry
+    {
+        std::shared_ptr<const CBlock> block;
+        CNetPayloadRef payloads[FORM_COUNT];
+        uint64_t nLastUsed;
+        size_t nBytes;
+
+        CEntry() : nLastUsed(0), nBytes(0) {}
+    };
+
+    CCriticalSection cs;
+    std::map<uint256, CEntry> mapBlocks;
+    uint64_t nUseCounter;
+    size_t nMaxBlocks;
+    size_t nBytes;
+    size_t nMaxBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    //! Drop the least recently used entries until the cache is within its
+    //! limits, keeping at least the most recently used one
+    void Trim();
+    //! Find or create the entry for hash and mark it used
+    CEntry& Touch(const uint256& hash);
+
+    // Disallow copies
+    CBlockRelayCache(const CBlockRelayCache&);
+    CBlockRelayCache& operator=(const CBlockRelayCache&);
+
+public:
+    explicit CBlockRelayCache(size_t nMaxBlocksIn = DEFAULT_BLOCK_RELAY_CACHE, size_t nMaxBytesIn = MAX_BLOCK_RELAY_CACHE_BYTES);
+
+    /** Get block hash serialized in form. Counts a hit or a miss. */
+    CNetPayloadRef GetPayload(const uint256& hash, Form form);
+    /** Get block hash deserialized, if it is cached */
+    std::shared_ptr<const CBlock> GetBlock(const uint256& hash);
+
+    void AddPayload(const uint256& hash, Form form, const CNetPayloadRef& payload);
+    void AddBlock(const uint256& hash, const std::shared_ptr<const CBlock>& block);
+
+    /** Keep at most nMaxBlocksIn blocks, at least one */
+    void SetMaxBlocks(size_t nMaxBlocksIn);
+    void Clear();
+    Stats GetStats();
+};
+
+#endif // BITCOIN_BLOCKRELAYCACHE_H
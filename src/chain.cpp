@@ -131,10 +131,10 @@ int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& fr
 {
     arith_uint256 r;
     int sign = 1;
-    if (to.nChainWork > from.nChainWork) {
-        r = to.nChainWork - from.nChainWork;
+    if (to.GetChainWork() > from.GetChainWork()) {
+        r = to.GetChainWork() - from.GetChainWork();
     } else {
-        r = from.nChainWork - to.nChainWork;
+        r = from.GetChainWork() - to.GetChainWork();
         sign = -1;
     }
     r = r * arith_uint256(params.nPowTargetSpacing) / GetBlockProof(tip);
@@ -177,8 +177,10 @@ public:
     //! Byte offset within rev?????.dat where this block's undo data is stored
     unsigned int nUndoPos;
 
-    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
-    arith_uint256 nChainWork;
+    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block,
+    //! in 128 bits; see GetChainWork()
+    uint64_t nChainWorkLow;
+    uint64_t nChainWorkHigh;
 
     //! Number of transactions in this block.
     //! Note: in a potential headers-first mode, this number cannot be relied upon
@@ -202,6 +204,15 @@ public:
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
+    //! (memory only) Memo of GetMedianTimePast(), 0 until first asked for.
+    //! Like the next field it only depends on the ancestors of this block,
+    //! so it never goes stale; it is filled in under cs_main.
+    mutable unsigned int nTimeMedianPast;
+
+    //! (memory only) Memo of the nBits CalculateNextWorkRequired requires
+    //! of a successor of this block, 0 until first asked for.
+    mutable unsigned int nBitsNext;
+
     void SetNull()
     {
         phashBlock = NULL;
@@ -211,11 +222,14 @@ public:
         nFile = 0;
         nDataPos = 0;
         nUndoPos = 0;
-        nChainWork = arith_uint256();
+        nChainWorkLow = 0;
+        nChainWorkHigh = 0;
         nTx = 0;
         nChainTx = 0;
         nStatus = 0;
         nSequenceId = 0;
+        nTimeMedianPast = 0;
+        nBitsNext = 0;
 
         nVersion       = 0;
         hashMerkleRoot = uint256();
@@ -281,10 +295,27 @@ public:
         return (int64_t)nTime;
     }
 
+    arith_uint256 GetChainWork() const
+    {
+        return (arith_uint256(nChainWorkHigh) << 64) | arith_uint256(nChainWorkLow);
+    }
+
+    //! No chain that can be mined comes near 2^128 hashes of work, so 128
+    //! bits lose nothing.
+    void SetChainWork(const arith_uint256& work)
+    {
+        assert((work >> 128) == 0);
+        nChainWorkLow = work.GetLow64();
+        nChainWorkHigh = (work >> 64).GetLow64();
+    }
+
     enum { nMedianTimeSpan=11 };
 
     int64_t GetMedianTimePast() const
     {
+        if (nTimeMedianPast)
+            return nTimeMedianPast;
+
         int64_t pmedian[nMedianTimeSpan];
         int64_t* pbegin = &pmedian[nMedianTimeSpan];
         int64_t* pend = &pmedian[nMedianTimeSpan];
@@ -294,7 +325,8 @@ public:
             *(--pbegin) = pindex->GetBlockTime();
 
         std::sort(pbegin, pend);
-        return pbegin[(pend - pbegin)/2];
+        nTimeMedianPast = pbegin[(pend - pbegin)/2];
+        return nTimeMedianPast;
     }
 
     std::string ToString() const
@@ -340,6 +372,48 @@ arith_uint256 GetBlockProof(const CBlockIndex& block);
 /** Return the time it would take to redo the work difference between from and to, assuming the current hashrate corresponds to the difficulty at tip, in seconds. */
 int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& from, const CBlockIndex& tip, const Consensus::Params&);
 
+/**
+ * Storage for CBlockIndex objects: they are created in slabs of contiguous
+ * memory, and only freed all together. This avoids a heap allocation (and
+ * its overhead) per block, and keeps the index compact in memory. Objects
+ * never move, and can be visited in the order they were created.
+ */
+class CBlockIndexArena
+{
+private:
+    static const size_t SLAB_SIZE = 4096;
+
+    //! Each slab has capacity SLAB_SIZE, so its elements never move
+    std::vector<std::vector<CBlockIndex> > vSlabs;
+
+    // Disallow copies
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+
+public:
+    CBlockIndexArena() {}
+
+    CBlockIndex* Create(const CBlockIndex& index = CBlockIndex())
+    {
+        if (vSlabs.empty() || vSlabs.back().size() == SLAB_SIZE) {
+            vSlabs.push_back(std::vector<CBlockIndex>());
+            vSlabs.back().reserve(SLAB_SIZE);
+        }
+        vSlabs.back().push_back(index);
+        return &vSlabs.back().back();
+    }
+
+    //! Destroy all objects
+    void Clear() { std::vector<std::vector<CBlockIndex> >().swap(vSlabs); }
+
+    size_t size() const { return vSlabs.empty() ? 0 : (vSlabs.size() - 1) * SLAB_SIZE + vSlabs.back().size(); }
+
+    //! The n'th object created
+    CBlockIndex* operator[](size_t n) { return &vSlabs[n / SLAB_SIZE][n % SLAB_SIZE]; }
+
+    size_t DynamicMemoryUsage() const { return vSlabs.capacity() * sizeof(vSlabs[0]) + vSlabs.size() * SLAB_SIZE * sizeof(CBlockIndex); }
+};
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
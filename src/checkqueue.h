@@ -6,9 +6,12 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -25,12 +28,30 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Queued verifications are spread over per-thread slots. Every thread takes
+  * batches from its own slot and steals from the other slots once that runs
+  * dry, so the master and the workers only meet on a shared lock when a
+  * thread has to go to sleep or wake up.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    //! A share of the queued verifications, see Take()
+    struct Slot
+    {
+        boost::mutex mutex;
+        std::deque<T> queue;
+        //! Size of queue, readable without taking the lock
+        std::atomic<unsigned int> nSize;
+        //! Whether a worker thread owns this slot (protected by CCheckQueue::mutex)
+        bool fClaimed;
+
+        Slot() : nSize(0), fClaimed(false) {}
+    };
+
+    //! Mutex to protect sleeping and waking up, and slot ownership
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,122 +60,214 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! Slot 0 belongs to the master, the others are claimed by worker threads.
+    boost::scoped_array<Slot> slots;
+    unsigned int nSlots;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! Slots at or above this index have never been used, so thieves need not look there.
+    std::atomic<unsigned int> nSlotsUsed;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The slot the next batch passed to Add() goes to. Only used by the master.
+    unsigned int nNextSlot;
 
-    //! The temporary evaluation result.
-    bool fAllOk;
+    //! The number of worker threads (excluding the master).
+    std::atomic<int> nWorkers;
+
+    //! The number of workers that are waiting on condWorker.
+    std::atomic<int> nIdle;
+
+    //! Number of verifications sitting in the slots.
+    std::atomic<int64_t> nQueued;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<int64_t> nTodo;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! The temporary evaluation result.
+    std::atomic<bool> fAllOk;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    /**
+     * Move a batch of verifications from slot nSlot into vChecks. Owners
+     * take from the back of their slot and thieves from the front, and
+     * either takes at most half of what is there, so batches get smaller
+     * as a slot drains and all threads finish approximately simultaneously.
+     */
+    bool Take(unsigned int nSlot, std::vector<T>& vChecks, bool fSteal)
+    {
+        Slot& slot = slots[nSlot];
+        if (slot.nSize == 0)
+            return false;
+        boost::unique_lock<boost::mutex> lock(slot.mutex);
+        if (slot.queue.empty())
+            return false;
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)(slot.queue.size() + 1) / 2));
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            // We want the lock on the slot to be as short as possible, so swap jobs from the
+            // slot to the local batch vector instead of copying.
+            if (fSteal) {
+                vChecks[i].swap(slot.queue.front());
+                slot.queue.pop_front();
+            } else {
+                vChecks[i].swap(slot.queue.back());
+                slot.queue.pop_back();
+            }
+        }
+        slot.nSize = slot.queue.size();
+        nQueued -= nNow;
+        return true;
+    }
+
+    //! Take a batch from our own slot, or failing that, steal one from another.
+    bool TakeAny(unsigned int nSlot, std::vector<T>& vChecks)
+    {
+        if (Take(nSlot, vChecks, false))
+            return true;
+        unsigned int nUsed = nSlotsUsed;
+        for (unsigned int i = 1; i < nUsed && nQueued > 0; i++) {
+            if (Take((nSlot + i) % nUsed, vChecks, true))
+                return true;
+        }
+        return false;
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(unsigned int nSlot, bool fMaster = false)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
+            if (!TakeAny(nSlot, vChecks)) {
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
+                if (nQueued > 0)
+                    // Somebody is in the middle of taking a batch; look again.
+                    continue;
+                if (fMaster) {
+                    // Nothing left to steal; wait for the workers to finish their batches
+                    while (nTodo > 0)
+                        condMaster.wait(lock);
+                    // return the current status, and reset it for new work later
+                    return fAllOk.exchange(true);
                 }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
+                // Going idle before looking at nQueued, and Add() doing the
+                // reverse, guarantees that one of us notices the other.
+                nIdle++;
+                try {
+                    while (nQueued <= 0)
+                        condWorker.wait(lock);
+                } catch (...) {
+                    // interrupted
                     nIdle--;
+                    throw;
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                nIdle--;
+                continue;
             }
+            // Check whether we need to do work at all
+            bool fOk = fAllOk;
             // execute work
             BOOST_FOREACH (T& check, vChecks)
                 if (fOk)
                     fOk = check();
+            if (!fOk)
+                fAllOk = false;
+            int64_t nNow = vChecks.size();
             vChecks.clear();
+            if ((nTodo -= nNow) == 0) {
+                // We processed the last element; inform the master it can exit and return the result
+                boost::unique_lock<boost::mutex> lock(mutex);
+                condMaster.notify_one();
+            }
         } while (true);
     }
 
+    /**
+     * Registers a worker thread for its lifetime and claims a slot for it.
+     * Slots are shared once there are more workers than slots.
+     */
+    class WorkerRegistration
+    {
+        CCheckQueue& queue;
+        bool fOwner;
+    public:
+        unsigned int nSlot;
+
+        WorkerRegistration(CCheckQueue& queueIn) : queue(queueIn), fOwner(false)
+        {
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            nSlot = 1 + queue.nWorkers % (queue.nSlots - 1);
+            for (unsigned int i = 1; i < queue.nSlots; i++) {
+                if (!queue.slots[i].fClaimed) {
+                    queue.slots[i].fClaimed = fOwner = true;
+                    nSlot = i;
+                    break;
+                }
+            }
+            if (queue.nSlotsUsed <= nSlot)
+                queue.nSlotsUsed = nSlot + 1;
+            // Only now let Add() deal batches to the new slot
+            queue.nWorkers++;
+        }
+
+        ~WorkerRegistration()
+        {
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            queue.nWorkers--;
+            if (fOwner)
+                queue.slots[nSlot].fClaimed = false;
+        }
+    };
+
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkersIn = 64) :
+        slots(new Slot[nMaxWorkersIn + 1]), nSlots(nMaxWorkersIn + 1), nSlotsUsed(1), nNextSlot(0),
+        nWorkers(0), nIdle(0), nQueued(0), nTodo(0), fAllOk(true), nBatchSize(nBatchSizeIn) {}
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        WorkerRegistration registration(*this);
+        Loop(registration.nSlot);
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        {
+            Slot& slot = slots[nNextSlot];
+            boost::unique_lock<boost::mutex> lock(slot.mutex);
+            BOOST_FOREACH (T& check, vChecks) {
+                slot.queue.push_back(T());
+                check.swap(slot.queue.back());
+            }
+            slot.nSize = slot.queue.size();
+        }
+        // Deal batches out round-robin over the master and the running workers
+        nNextSlot = (nNextSlot + 1) % std::min<unsigned int>(nSlots, nWorkers + 1);
+        nQueued += vChecks.size();
+        if (nIdle > 0) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
     }
 
     ~CCheckQueue()
@@ -163,8 +276,7 @@ public:
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
     }
 
 };
@@ -8,6 +8,7 @@
 
 #include "compressor.h"
 #include "core_memusage.h"
+#include "flathashmap.h"
 #include "hash.h"
 #include "memusage.h"
 #include "serialize.h"
@@ -17,7 +18,6 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
-#include <boost/unordered_map.hpp>
 
 /** 
  * Pruned version of CTransaction: only retains metadata and unspent transaction outputs
@@ -77,6 +77,15 @@ public:
     //! whether transaction is a coinbase
     bool fCoinBase;
 
+    //! whether outputs were restored or replaced since the coins were read
+    //! from the coin database, so that it must rewrite all unspent ones
+    //! (not serialized; kept by Clear())
+    bool fOutputsChanged;
+
+    //! size of vout when the coins were read from the coin database, which
+    //! has no records for outputs past it (not serialized; kept by Clear())
+    uint32_t nStoredOutputs;
+
     //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
     std::vector<CTxOut> vout;
 
@@ -96,7 +105,7 @@ public:
     }
 
     //! construct a CCoins from a CTransaction, at a given height
-    CCoins(const CTransaction &tx, int nHeightIn) {
+    CCoins(const CTransaction &tx, int nHeightIn) : fOutputsChanged(false), nStoredOutputs(0) {
         FromTx(tx, nHeightIn);
     }
 
@@ -108,7 +117,7 @@ public:
     }
 
     //! empty constructor
-    CCoins() : fCoinBase(false), vout(0), nHeight(0), nVersion(0) { }
+    CCoins() : fCoinBase(false), fOutputsChanged(false), nStoredOutputs(0), vout(0), nHeight(0), nVersion(0) { }
 
     //!remove spent outputs at the end of vout
     void Cleanup() {
@@ -128,6 +137,8 @@ public:
 
     void swap(CCoins &to) {
         std::swap(to.fCoinBase, fCoinBase);
+        std::swap(to.fOutputsChanged, fOutputsChanged);
+        std::swap(to.nStoredOutputs, nStoredOutputs);
         to.vout.swap(vout);
         std::swap(to.nHeight, nHeight);
         std::swap(to.nVersion, nVersion);
@@ -268,8 +279,8 @@ public:
 class SaltedTxidHasher
 {
 private:
-    /** Salt */
-    const uint64_t k0, k1;
+    /** Salt (not const, so that maps using this hasher can be swapped) */
+    uint64_t k0, k1;
 
 public:
     SaltedTxidHasher();
@@ -297,7 +308,7 @@ struct CCoinsCacheEntry
     CCoinsCacheEntry() : coins(), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher> CCoinsMap;
+typedef flathashmap<uint256, CCoinsCacheEntry, SaltedTxidHasher> CCoinsMap;
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -421,6 +432,13 @@ public:
      */
     bool HaveCoinsInCache(const uint256 &txid) const;
 
+    /**
+     * Add coins that were read from the backing CCoinsView by other means
+     * (for example by another thread), as if they had been fetched. Does
+     * nothing if txid is already in the cache. The coins are swapped in.
+     */
+    void AddFetchedCoins(const uint256 &txid, CCoins &coins);
+
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
      * more efficient than GetCoins. Modifications to other cache entries are
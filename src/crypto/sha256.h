@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,42 @@ public:
     CSHA256& Reset();
 };
 
+/** Autodetect the best available SHA256 implementation.
+ *  Returns the name of the implementation.
+ */
+std::string SHA256AutoDetect();
+
+/** Compute multiple double-SHA256's of 64-byte blobs.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*64 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/** Compute multiple double-SHA256's of 80-byte blobs, such as block headers.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*80 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA256D80(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/** Double-SHA256's of an 80-byte block header over runs of its nonce, the
+ *  last 4 bytes. The state after the first 64 bytes, which the nonce does not
+ *  touch, is computed once, so each hash costs two compressions instead of three.
+ */
+class CSHA256D80Nonces
+{
+private:
+    uint32_t midstate[8];
+    unsigned char tail[12];
+
+public:
+    /** header: pointer to the 80-byte header; its nonce is ignored. */
+    explicit CSHA256D80Nonces(const unsigned char* header);
+
+    /** Compute the hashes of the header with nonces nonce .. nonce+count-1
+     *  (wrapping around) into the count*32 byte buffer output. */
+    void Hash(unsigned char* output, uint32_t nonce, size_t count) const;
+};
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -0,0 +1,254 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/scoped_array.hpp>
+
+/**
+ * Fixed-size set of elements for use as a cache, without any locking on the
+ * read side.
+ *
+ * Every element has 8 candidate slots, chosen by 8 independent hash
+ * functions. Insertion tries the candidates in turn and, when all are taken
+ * by live elements, evicts one and moves it to one of its own candidates
+ * (cuckoo hashing), giving up after a bounded number of moves. Because memory
+ * is allocated once by setup(), the cache never uses more than it was given.
+ *
+ * Instead of deleting, slots are flagged as erasable; an erasable slot keeps
+ * answering lookups until an insert reuses it. Flags are set when a caller
+ * asks for erase-on-hit, and by an aging scheme: slots are grouped into two
+ * generations, and once the newer generation holds enough live elements the
+ * whole older one is flagged, so entries that were never looked up expire.
+ *
+ * Thread safety: contains() may be called from any number of threads at
+ * once, concurrently with a single insert(). Callers must serialize insert()
+ * calls among themselves, and setup() with everything. Each slot carries a
+ * sequence number which is odd while a writer is replacing its element, so
+ * a reader copies the element and only trusts the copy if the sequence was
+ * even and did not change meanwhile. A concurrent insert can therefore cause
+ * a spurious miss but never a false hit. Element must be trivially copyable
+ * and comparable with ==.
+ *
+ * Hash must provide operator()<N>(const Element&) for N in [0, 8), returning
+ * uniformly distributed uint32_t values.
+ */
+template <typename Element, typename Hash>
+class CCuckooCache
+{
+private:
+    struct Slot
+    {
+        //! 0 if never written, odd while being written, otherwise even
+        std::atomic<uint32_t> nSequence;
+        Element element;
+
+        Slot() : nSequence(0) {}
+    };
+
+    boost::scoped_array<Slot> slots;
+    uint32_t nSize;
+
+    //! One bit per slot, set when the slot may be reused. Readers set these
+    //! for erase-on-hit, so they are atomic.
+    boost::scoped_array<std::atomic<uint8_t> > vErasable;
+
+    //! One bit per slot, set if its element was inserted in the current
+    //! generation. Only touched by the writer.
+    std::vector<bool> vNewGeneration;
+
+    //! Number of live elements of the newer generation that triggers aging
+    uint32_t nGenerationSize;
+    //! Inserts left until the generation sizes are checked again
+    uint32_t nGenerationCheckCountdown;
+    //! Number of cuckoo moves an insert may make before dropping an element
+    uint8_t nDepthLimit;
+
+    const Hash hasher;
+
+    void SetErasable(uint32_t n) const
+    {
+        vErasable[n >> 3].fetch_or((uint8_t)(1 << (n & 7)), std::memory_order_relaxed);
+    }
+
+    void SetKeep(uint32_t n) const
+    {
+        vErasable[n >> 3].fetch_and((uint8_t)~(1 << (n & 7)), std::memory_order_relaxed);
+    }
+
+    bool IsErasable(uint32_t n) const
+    {
+        return vErasable[n >> 3].load(std::memory_order_relaxed) & (1 << (n & 7));
+    }
+
+    /** Map a 32-bit hash uniformly onto [0, nSize) without a division. */
+    uint32_t Reduce(uint32_t h) const
+    {
+        return (uint32_t)(((uint64_t)h * (uint64_t)nSize) >> 32);
+    }
+
+    void ComputeLocations(const Element& e, uint32_t* locs) const
+    {
+        locs[0] = Reduce(hasher.template operator()<0>(e));
+        locs[1] = Reduce(hasher.template operator()<1>(e));
+        locs[2] = Reduce(hasher.template operator()<2>(e));
+        locs[3] = Reduce(hasher.template operator()<3>(e));
+        locs[4] = Reduce(hasher.template operator()<4>(e));
+        locs[5] = Reduce(hasher.template operator()<5>(e));
+        locs[6] = Reduce(hasher.template operator()<6>(e));
+        locs[7] = Reduce(hasher.template operator()<7>(e));
+    }
+
+    /** Replace the element in slot n. Writer only. */
+    void Store(uint32_t n, const Element& e)
+    {
+        Slot& slot = slots[n];
+        uint32_t nSeq = slot.nSequence.load(std::memory_order_relaxed);
+        slot.nSequence.store(nSeq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.element = e;
+        slot.nSequence.store(nSeq + 2, std::memory_order_release);
+    }
+
+    /** Flag the older generation once the newer one is full. Writer only. */
+    void CheckGenerations()
+    {
+        if (nGenerationCheckCountdown != 0) {
+            --nGenerationCheckCountdown;
+            return;
+        }
+        uint32_t nNewLive = 0;
+        for (uint32_t i = 0; i < nSize; ++i)
+            nNewLive += vNewGeneration[i] && !IsErasable(i);
+        if (nNewLive >= nGenerationSize) {
+            // Everything in the older generation becomes reusable, and the
+            // newer generation becomes the older one.
+            for (uint32_t i = 0; i < nSize; ++i) {
+                if (vNewGeneration[i])
+                    vNewGeneration[i] = false;
+                else
+                    SetErasable(i);
+            }
+            nGenerationCheckCountdown = nGenerationSize;
+        } else {
+            // At worst every insert from now on adds a live element, so the
+            // next check is not needed before the difference has been made up.
+            nGenerationCheckCountdown = std::max(1u, std::max(nGenerationSize / 16, nGenerationSize - nNewLive));
+        }
+    }
+
+    // Disallow copies
+    CCuckooCache(const CCuckooCache&);
+    CCuckooCache& operator=(const CCuckooCache&);
+
+public:
+    CCuckooCache() : nSize(0), nGenerationSize(0), nGenerationCheckCountdown(0), nDepthLimit(0), hasher() {}
+
+    /** Allocate room for nElements elements, dropping all current ones.
+     *  Returns the number of elements the cache can hold. */
+    uint32_t Setup(uint32_t nElements)
+    {
+        nSize = nElements;
+        slots.reset(nSize ? new Slot[nSize] : NULL);
+        vErasable.reset(new std::atomic<uint8_t>[(nSize + 7) / 8]);
+        // Empty slots are free for reuse
+        for (uint32_t i = 0; i < (nSize + 7) / 8; ++i)
+            vErasable[i].store(0xFF, std::memory_order_relaxed);
+        vNewGeneration.assign(nSize, false);
+        nGenerationSize = std::max((uint32_t)1, (uint32_t)((45 * (uint64_t)nSize) / 100));
+        nGenerationCheckCountdown = nGenerationSize;
+        nDepthLimit = (uint8_t)std::log2((float)std::max((uint32_t)2, nSize));
+        return nSize;
+    }
+
+    /** Allocate as many elements as fit in nBytes, counting all per-slot
+     *  overhead. Returns the number of elements the cache can hold. */
+    uint32_t SetupBytes(size_t nBytes)
+    {
+        // Two flag bits per slot on top of the slot itself
+        uint64_t nElements = (uint64_t)nBytes * 8 / (sizeof(Slot) * 8 + 2);
+        return Setup((uint32_t)std::min(nElements, (uint64_t)UINT32_MAX));
+    }
+
+    /** Add an element. If every move available to it is blocked by live
+     *  elements, some element (possibly e itself) is dropped. Writer only. */
+    void Insert(Element e)
+    {
+        if (nSize == 0)
+            return;
+        CheckGenerations();
+        uint32_t locs[8];
+        ComputeLocations(e, locs);
+        // Refresh an element that is already present
+        for (int i = 0; i < 8; ++i) {
+            if (slots[locs[i]].nSequence.load(std::memory_order_relaxed) != 0 && slots[locs[i]].element == e) {
+                SetKeep(locs[i]);
+                vNewGeneration[locs[i]] = true;
+                return;
+            }
+        }
+        uint32_t nLastLoc = UINT32_MAX;
+        bool fNewGeneration = true;
+        for (uint8_t nDepth = 0; nDepth < nDepthLimit; ++nDepth) {
+            for (int i = 0; i < 8; ++i) {
+                if (!IsErasable(locs[i]))
+                    continue;
+                Store(locs[i], e);
+                SetKeep(locs[i]);
+                vNewGeneration[locs[i]] = fNewGeneration;
+                return;
+            }
+            // All candidates are live: displace the one after the slot we
+            // came from, so that we do not just move the same element back.
+            int nNext = (std::find(locs, locs + 8, nLastLoc) - locs + 1) & 7;
+            nLastLoc = locs[nNext];
+            Element displaced = slots[nLastLoc].element;
+            Store(nLastLoc, e);
+            e = displaced;
+            bool fDisplacedGeneration = vNewGeneration[nLastLoc];
+            vNewGeneration[nLastLoc] = fNewGeneration;
+            fNewGeneration = fDisplacedGeneration;
+            ComputeLocations(e, locs);
+        }
+        // Out of moves: the element still in hand is dropped.
+    }
+
+    /** Check whether e is present, optionally flagging its slot as reusable.
+     *  Never blocks, and may run concurrently with Insert(). */
+    bool Contains(const Element& e, bool fErase) const
+    {
+        if (nSize == 0)
+            return false;
+        uint32_t locs[8];
+        ComputeLocations(e, locs);
+        for (int i = 0; i < 8; ++i) {
+            const Slot& slot = slots[locs[i]];
+            uint32_t nSeq = slot.nSequence.load(std::memory_order_acquire);
+            if (nSeq == 0 || (nSeq & 1))
+                continue;
+            Element copy = slot.element;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.nSequence.load(std::memory_order_relaxed) != nSeq)
+                continue;
+            if (copy == e) {
+                if (fErase)
+                    SetErasable(locs[i]);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Number of elements the cache can hold. */
+    uint32_t Size() const { return nSize; }
+};
+
+#endif // BITCOIN_CUCKOOCACHE_H
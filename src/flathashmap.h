@@ -0,0 +1,352 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATHASHMAP_H
+#define BITCOIN_FLATHASHMAP_H
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* Hash map with an open-addressing index and pooled element storage.
+ *
+ * Elements live in fixed-size chunks of nodes, allocated on demand and
+ * recycled through a free list, so there is no per-element heap allocation.
+ * A node is just the element; which nodes are live is kept in a bitmap at
+ * the head of each chunk, and a free node holds the next free node number.
+ * The index is linear probing over two flat arrays: a node number and a tag
+ * byte (7 bits of the hash) per slot, 5 bytes in all. A lookup compares tags
+ * and only touches the node whose tag matches. Hashes are not stored, so
+ * rehashing and erasing hash the keys they move again.
+ *
+ * Differences from boost::unordered_map:
+ * - References, pointers and iterators to elements stay valid until the
+ *   element is erased, also across insertions and rehashing.
+ * - Iteration walks the node chunks in memory order rather than the index.
+ *   Erasing the current element while iterating (erase(it++)) is fine.
+ * - Memory held by erased elements is only returned to the system by clear()
+ *   or destruction; it is reused by later insertions.
+ * - Only the interface needed by its users is provided.
+ */
+template <typename K, typename T, typename Hash>
+class flathashmap
+{
+public:
+    typedef K key_type;
+    typedef T mapped_type;
+    typedef std::pair<const K, T> value_type;
+    typedef size_t size_type;
+
+private:
+    //! Nodes per chunk, one per bit of Chunk::nLive; small enough that
+    //! short-lived maps stay cheap
+    static const uint32_t CHUNK_BITS = 6;
+    static const uint32_t CHUNK_NODES = 1 << CHUNK_BITS;
+    //! The end of the free list, and no node
+    static const uint32_t NONE = 0xFFFFFFFF;
+    //! Tag of an empty index slot; those of used slots have the top bit set
+    static const uint8_t EMPTY = 0;
+
+    struct Node
+    {
+        typename std::aligned_storage<sizeof(value_type), std::alignment_of<value_type>::value>::type storage;
+
+        value_type* get() { return reinterpret_cast<value_type*>(&storage); }
+        const value_type* get() const { return reinterpret_cast<const value_type*>(&storage); }
+        //! The next free node, while this one is free
+        uint32_t& next() { return *reinterpret_cast<uint32_t*>(&storage); }
+    };
+    static_assert(sizeof(value_type) >= sizeof(uint32_t), "a free node must hold a node number");
+
+    struct Chunk
+    {
+        //! Which nodes hold an element
+        uint64_t nLive;
+        Node nodes[CHUNK_NODES];
+    };
+
+    std::vector<Chunk*> vChunks;
+    //! The index: per slot a tag and a node number
+    std::vector<uint8_t> vTags;
+    std::vector<uint32_t> vSlotNodes;
+    //! Nodes handed out so far, live or free
+    uint32_t nNodesUsed;
+    //! Head of the free node list
+    uint32_t nFree;
+    size_type nSize;
+    Hash hasher;
+
+    Node& GetNode(uint32_t n) { return vChunks[n >> CHUNK_BITS]->nodes[n & (CHUNK_NODES - 1)]; }
+    const Node& GetNode(uint32_t n) const { return vChunks[n >> CHUNK_BITS]->nodes[n & (CHUNK_NODES - 1)]; }
+
+    bool IsLive(uint32_t n) const { return (vChunks[n >> CHUNK_BITS]->nLive >> (n & (CHUNK_NODES - 1))) & 1; }
+    void SetLive(uint32_t n, bool fLive)
+    {
+        uint64_t bit = uint64_t(1) << (n & (CHUNK_NODES - 1));
+        if (fLive)
+            vChunks[n >> CHUNK_BITS]->nLive |= bit;
+        else
+            vChunks[n >> CHUNK_BITS]->nLive &= ~bit;
+    }
+
+    uint32_t Mask() const { return vTags.size() - 1; }
+    uint32_t HashOf(const K& key) const { return (uint32_t)hasher(key); }
+    static uint8_t Tag(uint32_t nHash) { return 0x80 | (nHash >> 25); }
+
+    /** Index slot holding key, or the empty slot ending its probe sequence.
+     *  The index must not be empty. */
+    uint32_t FindSlot(const K& key, uint32_t nHash) const
+    {
+        uint32_t mask = Mask();
+        uint8_t tag = Tag(nHash);
+        for (uint32_t i = nHash & mask; ; i = (i + 1) & mask) {
+            if (vTags[i] == EMPTY || (vTags[i] == tag && GetNode(vSlotNodes[i]).get()->first == key))
+                return i;
+        }
+    }
+
+    /** The empty slot ending the probe sequence of nHash. */
+    uint32_t FindEmptySlot(uint32_t nHash) const
+    {
+        uint32_t mask = Mask();
+        uint32_t i = nHash & mask;
+        while (vTags[i] != EMPTY)
+            i = (i + 1) & mask;
+        return i;
+    }
+
+    /** Grow the index so that one more element keeps the load at most 3/4.
+     *  Returns whether it was rebuilt. */
+    bool Reserve()
+    {
+        if (!vTags.empty() && (nSize + 1) * 4 <= vTags.size() * 3)
+            return false;
+        size_t nSlots = vTags.empty() ? 16 : vTags.size() * 2;
+        vTags.assign(nSlots, (uint8_t)EMPTY);
+        vSlotNodes.resize(nSlots);
+        // Walk the nodes rather than the old index, in memory order
+        for (uint32_t n = NextLive(0); n != NONE; n = NextLive(n + 1)) {
+            uint32_t nHash = HashOf(GetNode(n).get()->first);
+            uint32_t i = FindEmptySlot(nHash);
+            vTags[i] = Tag(nHash);
+            vSlotNodes[i] = n;
+        }
+        return true;
+    }
+
+    uint32_t AllocateNode()
+    {
+        if (nFree != NONE) {
+            uint32_t n = nFree;
+            nFree = GetNode(n).next();
+            return n;
+        }
+        if ((nNodesUsed >> CHUNK_BITS) == vChunks.size()) {
+            vChunks.push_back(static_cast<Chunk*>(::operator new(sizeof(Chunk))));
+            vChunks.back()->nLive = 0;
+        }
+        return nNodesUsed++;
+    }
+
+    void Destroy()
+    {
+        for (uint32_t n = NextLive(0); n != NONE; n = NextLive(n + 1))
+            GetNode(n).get()->~value_type();
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+    }
+
+    /** The first live node at or after n, or NONE. */
+    uint32_t NextLive(uint32_t n) const
+    {
+        for (uint32_t c = n >> CHUNK_BITS; c < vChunks.size(); c++) {
+            uint64_t nLive = vChunks[c]->nLive;
+            if (c == n >> CHUNK_BITS)
+                nLive &= ~uint64_t(0) << (n & (CHUNK_NODES - 1));
+            if (nLive)
+                return (c << CHUNK_BITS) + CountTrailingZeros(nLive);
+        }
+        return NONE;
+    }
+
+    static uint32_t CountTrailingZeros(uint64_t n)
+    {
+#if defined(__GNUC__)
+        return __builtin_ctzll(n);
+#else
+        uint32_t nZeros = 0;
+        while (!(n & 1)) {
+            n >>= 1;
+            nZeros++;
+        }
+        return nZeros;
+#endif
+    }
+
+    template <bool fConst>
+    class base_iterator
+    {
+        friend class flathashmap;
+        template <bool> friend class base_iterator;
+        typedef typename std::conditional<fConst, const flathashmap, flathashmap>::type map_type;
+        map_type* map;
+        uint32_t n;
+
+        base_iterator(map_type* mapIn, uint32_t nIn) : map(mapIn), n(nIn) {}
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename flathashmap::value_type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef typename std::conditional<fConst, const value_type&, value_type&>::type reference;
+        typedef typename std::conditional<fConst, const value_type*, value_type*>::type pointer;
+
+        base_iterator() : map(NULL), n(NONE) {}
+        // Allow iterator -> const_iterator
+        base_iterator(const base_iterator<false>& it) : map(it.map), n(it.n) {}
+
+        reference operator*() const { return *map->GetNode(n).get(); }
+        pointer operator->() const { return map->GetNode(n).get(); }
+        base_iterator& operator++() { n = map->NextLive(n + 1); return *this; }
+        base_iterator operator++(int) { base_iterator copy(*this); ++(*this); return copy; }
+        bool operator==(const base_iterator& it) const { return n == it.n; }
+        bool operator!=(const base_iterator& it) const { return !(*this == it); }
+    };
+
+    // Disallow copies
+    flathashmap(const flathashmap&);
+    flathashmap& operator=(const flathashmap&);
+
+public:
+    typedef base_iterator<false> iterator;
+    typedef base_iterator<true> const_iterator;
+
+    flathashmap() : nNodesUsed(0), nFree(NONE), nSize(0) {}
+    ~flathashmap() { Destroy(); }
+
+    iterator begin() { return iterator(this, NextLive(0)); }
+    iterator end() { return iterator(this, NONE); }
+    const_iterator begin() const { return const_iterator(this, NextLive(0)); }
+    const_iterator end() const { return const_iterator(this, NONE); }
+
+    bool empty() const { return nSize == 0; }
+    size_type size() const { return nSize; }
+
+    iterator find(const K& key)
+    {
+        if (nSize == 0)
+            return end();
+        uint32_t i = FindSlot(key, HashOf(key));
+        return vTags[i] == EMPTY ? end() : iterator(this, vSlotNodes[i]);
+    }
+
+    const_iterator find(const K& key) const
+    {
+        if (nSize == 0)
+            return end();
+        uint32_t i = FindSlot(key, HashOf(key));
+        return vTags[i] == EMPTY ? end() : const_iterator(this, vSlotNodes[i]);
+    }
+
+    size_type count(const K& key) const { return find(key) != end(); }
+
+    std::pair<iterator, bool> insert(const value_type& value)
+    {
+        uint32_t nHash = HashOf(value.first);
+        uint32_t i = NONE;
+        if (!vTags.empty()) {
+            i = FindSlot(value.first, nHash);
+            if (vTags[i] != EMPTY)
+                return std::make_pair(iterator(this, vSlotNodes[i]), false);
+        }
+        // Only now that the key turned out to be new may the index grow
+        if (Reserve())
+            i = FindEmptySlot(nHash);
+        uint32_t n = AllocateNode();
+        new (&GetNode(n).storage) value_type(value);
+        SetLive(n, true);
+        vTags[i] = Tag(nHash);
+        vSlotNodes[i] = n;
+        nSize++;
+        return std::make_pair(iterator(this, n), true);
+    }
+
+    T& operator[](const K& key)
+    {
+        return insert(value_type(key, T())).first->second;
+    }
+
+    void erase(iterator it)
+    {
+        Node& node = GetNode(it.n);
+        uint32_t mask = Mask();
+        uint32_t i = HashOf(node.get()->first) & mask;
+        while (vSlotNodes[i] != it.n || vTags[i] == EMPTY)
+            i = (i + 1) & mask;
+        // Backward shift deletion: pull later members of the probe
+        // sequence into the hole, so no tombstones are needed.
+        for (uint32_t j = (i + 1) & mask; vTags[j] != EMPTY; j = (j + 1) & mask) {
+            uint32_t nHome = HashOf(GetNode(vSlotNodes[j]).get()->first) & mask;
+            // Move slot j into the hole at i unless its home lies
+            // cyclically in (i, j].
+            if ((j > i && (nHome <= i || nHome > j)) || (j < i && nHome <= i && nHome > j)) {
+                vTags[i] = vTags[j];
+                vSlotNodes[i] = vSlotNodes[j];
+                i = j;
+            }
+        }
+        vTags[i] = EMPTY;
+        node.get()->~value_type();
+        SetLive(it.n, false);
+        node.next() = nFree;
+        nFree = it.n;
+        nSize--;
+    }
+
+    size_type erase(const K& key)
+    {
+        iterator it = find(key);
+        if (it == end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    void clear()
+    {
+        Destroy();
+        std::vector<Chunk*>().swap(vChunks);
+        std::vector<uint8_t>().swap(vTags);
+        std::vector<uint32_t>().swap(vSlotNodes);
+        nNodesUsed = 0;
+        nFree = NONE;
+        nSize = 0;
+    }
+
+    /** Exchange contents, including the hashers. Unlike with standard
+     *  containers, iterators are invalidated; references are not. */
+    void swap(flathashmap& other)
+    {
+        vChunks.swap(other.vChunks);
+        vTags.swap(other.vTags);
+        vSlotNodes.swap(other.vSlotNodes);
+        std::swap(nNodesUsed, other.nNodesUsed);
+        std::swap(nFree, other.nFree);
+        std::swap(nSize, other.nSize);
+        std::swap(hasher, other.hasher);
+    }
+
+    //! Memory layout, for memusage::DynamicUsage
+    size_t chunk_count() const { return vChunks.size(); }
+    static size_t chunk_bytes() { return sizeof(Chunk); }
+    size_t slot_count() const { return vTags.size(); }
+};
+
+#endif // BITCOIN_FLATHASHMAP_H
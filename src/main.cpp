@@ -14,6 +14,7 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
 #include "hash.h"
 #include "init.h"
 #include "merkleblock.h"
@@ -43,6 +44,7 @@
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/join.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/math/distributions/poisson.hpp>
@@ -61,12 +63,15 @@ using namespace std;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+/** Owns the CBlockIndex objects in mapBlockIndex. */
+static CBlockIndexArena blockIndexArena;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nPrefetchThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
@@ -86,12 +91,13 @@ CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 CAmount maxTxFee = DEFAULT_TRANSACTION_MAXFEE;
 
 CTxMemPool mempool(::minRelayTxFee);
+CBlockRelayCache blockRelayCache;
 FeeFilterRounder filterRounder(::minRelayTxFee);
 
 struct IteratorComparator
 {
     template<typename I>
-    bool operator()(const I& a, const I& b)
+    bool operator()(const I& a, const I& b) const
     {
         return &(*a) < &(*b);
     }
@@ -106,6 +112,12 @@ map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
 map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
+/** Transactions seen outside the mempool (orphans, policy rejects, replaced
+ *  and evicted ones) that may still show up in a compact block, as a ring
+ *  buffer of <witness hash, transaction> like mempool.vTxHashes */
+static std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > vExtraTxnForCompact GUARDED_BY(cs_main);
+static size_t vExtraTxnForCompactIt GUARDED_BY(cs_main) = 0;
+
 /**
  * Returns true if there are nRequired or more blocks of minVersion or above
  * in the last Consensus::Params::nMajorityWindow blocks, starting at pstart and going backwards.
@@ -125,8 +137,8 @@ namespace {
     {
         bool operator()(CBlockIndex *pa, CBlockIndex *pb) const {
             // First sort by most total work, ...
-            if (pa->nChainWork > pb->nChainWork) return false;
-            if (pa->nChainWork < pb->nChainWork) return true;
+            if (pa->GetChainWork() > pb->GetChainWork()) return false;
+            if (pa->GetChainWork() < pb->GetChainWork()) return true;
 
             // ... then by earliest time received, ...
             if (pa->nSequenceId < pb->nSequenceId) return false;
@@ -463,8 +475,8 @@ void ProcessBlockAvailability(NodeId nodeid) {
 
     if (!state->hashLastUnknownBlock.IsNull()) {
         BlockMap::iterator itOld = mapBlockIndex.find(state->hashLastUnknownBlock);
-        if (itOld != mapBlockIndex.end() && itOld->second->nChainWork > 0) {
-            if (state->pindexBestKnownBlock == NULL || itOld->second->nChainWork >= state->pindexBestKnownBlock->nChainWork)
+        if (itOld != mapBlockIndex.end() && itOld->second->GetChainWork() > 0) {
+            if (state->pindexBestKnownBlock == NULL || itOld->second->GetChainWork() >= state->pindexBestKnownBlock->GetChainWork())
                 state->pindexBestKnownBlock = itOld->second;
             state->hashLastUnknownBlock.SetNull();
         }
@@ -479,9 +491,9 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     ProcessBlockAvailability(nodeid);
 
     BlockMap::iterator it = mapBlockIndex.find(hash);
-    if (it != mapBlockIndex.end() && it->second->nChainWork > 0) {
+    if (it != mapBlockIndex.end() && it->second->GetChainWork() > 0) {
         // An actually better block was announced.
-        if (state->pindexBestKnownBlock == NULL || it->second->nChainWork >= state->pindexBestKnownBlock->nChainWork)
+        if (state->pindexBestKnownBlock == NULL || it->second->GetChainWork() >= state->pindexBestKnownBlock->GetChainWork())
             state->pindexBestKnownBlock = it->second;
     } else {
         // An unknown block was announced; just assume that the latest one is the best one.
@@ -567,7 +579,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     // Make sure pindexBestKnownBlock is up to date, we'll need it.
     ProcessBlockAvailability(nodeid);
 
-    if (state->pindexBestKnownBlock == NULL || state->pindexBestKnownBlock->nChainWork < chainActive.Tip()->nChainWork) {
+    if (state->pindexBestKnownBlock == NULL || state->pindexBestKnownBlock->GetChainWork() < chainActive.Tip()->GetChainWork()) {
         // This peer has nothing interesting.
         return;
     }
@@ -696,6 +708,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -703,6 +716,17 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
+static void AddToCompactExtraTransactions(const std::shared_ptr<const CTransaction>& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    size_t nMaxExtraTxn = GetArg("-blockreconstructionextratxn", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN);
+    if (nMaxExtraTxn == 0 || GetTransactionWeight(*tx) >= MAX_STANDARD_TX_WEIGHT)
+        return;
+    if (vExtraTxnForCompact.empty())
+        vExtraTxnForCompact.resize(nMaxExtraTxn);
+    vExtraTxnForCompact[vExtraTxnForCompactIt] = std::make_pair(tx->GetWitnessHash(), tx);
+    vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % vExtraTxnForCompact.size();
+}
+
 bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     uint256 hash = tx.GetHash();
@@ -725,6 +749,7 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
 
     auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME});
     assert(ret.second);
+    AddToCompactExtraTransactions(std::make_shared<const CTransaction>(tx));
     BOOST_FOREACH(const CTxIn& txin, tx.vin) {
         mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
     }
@@ -1127,9 +1152,12 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
     std::vector<uint256> vNoSpendsRemaining;
-    pool.TrimToSize(limit, &vNoSpendsRemaining);
+    std::vector<std::shared_ptr<const CTransaction> > vEvicted;
+    pool.TrimToSize(limit, &vNoSpendsRemaining, &vEvicted);
     BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
+    BOOST_FOREACH(const std::shared_ptr<const CTransaction>& ptx, vEvicted)
+        AddToCompactExtraTransactions(ptx);
 }
 
 /** Convert CValidationState to a human-readable message for logging */
@@ -1142,7 +1170,7 @@ std::string FormatStateMessage(const CValidationState &state)
 }
 
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
-                              bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
+                              bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
                               std::vector<uint256>& vHashTxnToUncache)
 {
     const uint256 hash = tx.GetHash();
@@ -1315,7 +1343,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
             }
         }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCost, lp);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCost, lp);
         unsigned int nSize = entry.GetTxSize();
 
         // Check that the transaction doesn't have an excessive number of
@@ -1555,6 +1583,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // Remove conflicting transactions from the mempool
         BOOST_FOREACH(const CTxMemPool::txiter it, allConflicting)
         {
+            AddToCompactExtraTransactions(it->GetSharedTx());
             LogPrint("mempool", "replacing tx %s with %s for %s PDG additional fees, %d delta bytes\n",
                     it->GetTx().GetHash().ToString(),
                     hash.ToString(),
@@ -1579,11 +1608,11 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
     return true;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
     std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
     if (!res) {
         BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
             pcoinsTip->Uncache(hashTx);
@@ -1591,6 +1620,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return res;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fOverrideMempoolLimit, nAbsurdFee);
+}
+
 /** Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1719,6 +1754,37 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+static CBlockFileMapper blockFileMapper;
+
+bool ReadRawBlockFromDisk(CBlockFileSpan& span, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    return ReadRawBlockFromDisk(span, pindex->GetBlockPos(), pindex->GetBlockHash(), messageStart);
+}
+
+bool ReadRawBlockFromDisk(CBlockFileSpan& span, const CDiskBlockPos& pos, const uint256& hash, const CMessageHeader::MessageStartChars& messageStart)
+{
+    if (pos.IsNull() || pos.nPos < 8)
+        return error("%s: no block data for %s", __func__, hash.ToString());
+    boost::filesystem::path path = GetBlockPosFilename(pos, "blk");
+
+    // Each block is preceded by the network magic and its size, see WriteBlockToDisk
+    CBlockFileSpan header;
+    if (!blockFileMapper.Read(pos.nFile, path, pos.nPos - 8, 8, header))
+        return error("%s: cannot read block header at %s", __func__, pos.ToString());
+    if (memcmp(header.begin(), messageStart, MESSAGE_START_SIZE))
+        return error("%s: bad magic at %s", __func__, pos.ToString());
+    uint32_t nSize = ReadLE32((const unsigned char*)header.begin() + 4);
+    if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+        return error("%s: bad block size %u at %s", __func__, nSize, pos.ToString());
+    if (!blockFileMapper.Read(pos.nFile, path, pos.nPos, nSize, span))
+        return error("%s: cannot read block at %s", __func__, pos.ToString());
+
+    // The header hash covers everything else through the merkle root
+    if (Hash(span.begin(), span.begin() + 80) != hash)
+        return error("%s: hash doesn't match index for %s at %s", __func__, hash.ToString(), pos.ToString());
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     // 0       - 100       1
@@ -1762,7 +1828,7 @@ bool IsInitialBlockDownload()
         return true;
     if (chainActive.Tip() == NULL)
         return true;
-    if (chainActive.Tip()->nChainWork < UintToArith256(chainParams.GetConsensus().nMinimumChainWork))
+    if (chainActive.Tip()->GetChainWork() < UintToArith256(chainParams.GetConsensus().nMinimumChainWork))
         return true;
     if (chainActive.Tip()->GetBlockTime() < (GetTime() - nMaxTipAge))
         return true;
@@ -1804,7 +1870,7 @@ void CheckForkWarningConditions()
     if (pindexBestForkTip && chainActive.Height() - pindexBestForkTip->nHeight >= 72)
         pindexBestForkTip = NULL;
 
-    if (pindexBestForkTip || (pindexBestInvalid && pindexBestInvalid->nChainWork > chainActive.Tip()->nChainWork + (GetBlockProof(*chainActive.Tip()) * 6)))
+    if (pindexBestForkTip || (pindexBestInvalid && pindexBestInvalid->GetChainWork() > chainActive.Tip()->GetChainWork() + (GetBlockProof(*chainActive.Tip()) * 6)))
     {
         if (!fLargeWorkForkFound && pindexBestForkBase)
         {
@@ -1855,7 +1921,7 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     // We define it this way because it allows us to only store the highest fork tip (+ base) which meets
     // the 7-block condition and from this always have the most-likely-to-cause-warning fork
     if (pfork && (!pindexBestForkTip || (pindexBestForkTip && pindexNewForkTip->nHeight > pindexBestForkTip->nHeight)) &&
-            pindexNewForkTip->nChainWork - pfork->nChainWork > (GetBlockProof(*pfork) * 7) &&
+            pindexNewForkTip->GetChainWork() - pfork->GetChainWork() > (GetBlockProof(*pfork) * 7) &&
             chainActive.Height() - pindexNewForkTip->nHeight < 72)
     {
         pindexBestForkTip = pindexNewForkTip;
@@ -1887,17 +1953,17 @@ void Misbehaving(NodeId pnode, int howmuch)
 
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
-    if (!pindexBestInvalid || pindexNew->nChainWork > pindexBestInvalid->nChainWork)
+    if (!pindexBestInvalid || pindexNew->GetChainWork() > pindexBestInvalid->GetChainWork())
         pindexBestInvalid = pindexNew;
 
     LogPrintf("%s: invalid block=%s  height=%d  log2_work=%.8g  date=%s\n", __func__,
       pindexNew->GetBlockHash().ToString(), pindexNew->nHeight,
-      log(pindexNew->nChainWork.getdouble())/log(2.0), DateTimeStrFormat("%Y-%m-%d %H:%M:%S",
+      log(pindexNew->GetChainWork().getdouble())/log(2.0), DateTimeStrFormat("%Y-%m-%d %H:%M:%S",
       pindexNew->GetBlockTime()));
     CBlockIndex *tip = chainActive.Tip();
     assert (tip);
     LogPrintf("%s:  current best=%s  height=%d  log2_work=%.8g  date=%s\n", __func__,
-      tip->GetBlockHash().ToString(), chainActive.Height(), log(tip->nChainWork.getdouble())/log(2.0),
+      tip->GetBlockHash().ToString(), chainActive.Height(), log(tip->GetChainWork().getdouble())/log(2.0),
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", tip->GetBlockTime()));
     CheckForkWarningConditions();
 }
@@ -2181,6 +2247,7 @@ static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const CO
     if (coins->vout.size() < out.n+1)
         coins->vout.resize(out.n+1);
     coins->vout[out.n] = undo.txout;
+    coins->fOutputsChanged = true;
 
     return fClean;
 }
@@ -2285,6 +2352,42 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+/** Reads the coins of one transaction from the coin database, see PrefetchInputs(). */
+class CCoinsPrefetch
+{
+private:
+    uint256 txid;
+    CCoins *pcoins;
+    char *pfFound;
+
+public:
+    CCoinsPrefetch() : pcoins(NULL), pfFound(NULL) {}
+    CCoinsPrefetch(const uint256 &txidIn, CCoins *pcoinsIn, char *pfFoundIn) : txid(txidIn), pcoins(pcoinsIn), pfFound(pfFoundIn) {}
+
+    bool operator()() {
+        try {
+            *pfFound = pcoinsdbview->GetCoins(txid, *pcoins);
+        } catch (const std::runtime_error& e) {
+            // Leave it to the validation thread, which reports read errors
+            *pfFound = false;
+        }
+        return true;
+    }
+
+    void swap(CCoinsPrefetch &check) {
+        std::swap(txid, check.txid);
+        std::swap(pcoins, check.pcoins);
+        std::swap(pfFound, check.pfFound);
+    }
+};
+
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(8);
+
+void ThreadPrefetchCoins() {
+    RenameThread("bitcoin-prefetch");
+    prefetchqueue.Thread();
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -2672,9 +2775,13 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 return AbortNode(state, "Files to write to block index database");
             }
         }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
+        // Finally remove any pruned files. Blocks after the chainstate on
+        // disk must stay, so wait for any background write first.
+        if (fFlushForPrune) {
+            if (!pcoinsdbview->WaitForFlush())
+                return AbortNode(state, "Failed to write to coin database");
             UnlinkPrunedFiles(setFilesToPrune);
+        }
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
@@ -2687,8 +2794,12 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        // With -backgroundflush this only hands the entries over, unless the
+        // caller needs them on disk.
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsdbview->WaitForFlush())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -2702,9 +2813,9 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     return true;
 }
 
-void FlushStateToDisk() {
+bool FlushStateToDisk() {
     CValidationState state;
-    FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+    return FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
 void PruneAndFlush() {
@@ -2766,7 +2877,7 @@ void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
     }
     LogPrintf("%s: new best=%s height=%d version=0x%08x log2_work=%.8g tx=%lu date='%s' progress=%f cache=%.1fMiB(%utx)", __func__,
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), chainActive.Tip()->nVersion,
-      log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
+      log(chainActive.Tip()->GetChainWork().getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
       Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), pcoinsTip->GetCacheSize());
     if (!warningMessages.empty())
@@ -2829,11 +2940,70 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
+static uint64_t nPrefetchInputs = 0;
+static uint64_t nPrefetchCached = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
 
+/**
+ * Read the coins spent by a block from the coin database on the prefetch
+ * threads, and add them to pcoinsTip, so that ConnectBlock() finds them in
+ * memory instead of waiting for one disk read after another.
+ */
+static void PrefetchInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    int64_t nTimeStart = GetTimeMicros();
+    std::set<uint256> setSeen;
+    std::vector<uint256> vTxids;
+    unsigned int nInputs = 0;
+    unsigned int nCached = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                // Also skips transactions created earlier in this block
+                if (!setSeen.insert(txin.prevout.hash).second)
+                    continue;
+                nInputs++;
+                if (pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
+                    nCached++;
+                else
+                    vTxids.push_back(txin.prevout.hash);
+            }
+        }
+        setSeen.insert(tx.GetHash());
+    }
+
+    std::vector<CCoins> vCoins(vTxids.size());
+    std::vector<char> vFound(vTxids.size(), false);
+    {
+        CCheckQueueControl<CCoinsPrefetch> control(&prefetchqueue);
+        std::vector<CCoinsPrefetch> vPrefetch;
+        vPrefetch.reserve(vTxids.size());
+        for (size_t i = 0; i < vTxids.size(); i++)
+            vPrefetch.push_back(CCoinsPrefetch(vTxids[i], &vCoins[i], &vFound[i]));
+        control.Add(vPrefetch);
+        control.Wait();
+    }
+    unsigned int nFetched = 0;
+    for (size_t i = 0; i < vTxids.size(); i++) {
+        if (vFound[i]) {
+            pcoinsTip->AddFetchedCoins(vTxids[i], vCoins[i]);
+            nFetched++;
+        }
+    }
+
+    int64_t nTime = GetTimeMicros() - nTimeStart; nTimePrefetch += nTime;
+    nPrefetchInputs += nInputs;
+    nPrefetchCached += nCached;
+    LogPrint("bench", "  - Prefetch: %u input txids, %u cached, %u read by %d threads: %.2fms [%.2fs, %.1f%% cached]\n",
+        nInputs, nCached, nFetched, nPrefetchThreads, nTime * 0.001, nTimePrefetch * 0.000001,
+        nPrefetchInputs ? 100.0 * nPrefetchCached / nPrefetchInputs : 0.0);
+}
+
 /**
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
@@ -2853,6 +3023,10 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    if (nPrefetchThreads) {
+        PrefetchInputs(*pblock);
+        nTime2 = GetTimeMicros();
+    }
     {
         CCoinsViewCache view(pcoinsTip);
         bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams);
@@ -2926,7 +3100,7 @@ static CBlockIndex* FindMostWorkChain() {
             bool fMissingData = !(pindexTest->nStatus & BLOCK_HAVE_DATA);
             if (fFailedChain || fMissingData) {
                 // Candidate chain is not usable (either invalid or missing data)
-                if (fFailedChain && (pindexBestInvalid == NULL || pindexNew->nChainWork > pindexBestInvalid->nChainWork))
+                if (fFailedChain && (pindexBestInvalid == NULL || pindexNew->GetChainWork() > pindexBestInvalid->GetChainWork()))
                     pindexBestInvalid = pindexNew;
                 CBlockIndex *pindexFailed = pindexNew;
                 // Remove the entire chain from the set.
@@ -3017,7 +3191,7 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
                 }
             } else {
                 PruneBlockIndexCandidates();
-                if (!pindexOldTip || chainActive.Tip()->nChainWork > pindexOldTip->nChainWork) {
+                if (!pindexOldTip || chainActive.Tip()->GetChainWork() > pindexOldTip->GetChainWork()) {
                     // We're in a better position than we were. Return temporarily to release the lock.
                     fContinue = false;
                     break;
@@ -3224,17 +3398,15 @@ bool ResetBlockFailureFlags(CBlockIndex *pindex) {
     return true;
 }
 
-CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block, const uint256& hash)
 {
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator it = mapBlockIndex.find(hash);
     if (it != mapBlockIndex.end())
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Create(CBlockIndex(block));
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -3248,9 +3420,9 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
         pindexNew->BuildSkip();
     }
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
+    pindexNew->SetChainWork((pindexNew->pprev ? pindexNew->pprev->GetChainWork() : 0) + GetBlockProof(*pindexNew));
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
-    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
+    if (pindexBestHeader == NULL || pindexBestHeader->GetChainWork() < pindexNew->GetChainWork())
         pindexBestHeader = pindexNew;
 
     setDirtyBlockIndex.insert(pindexNew);
@@ -3258,6 +3430,11 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     return pindexNew;
 }
 
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+{
+    return AddToBlockIndex(block, block.GetHash());
+}
+
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
 {
@@ -3645,11 +3822,12 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+/** Add a header with the given hash to the block index. If fCheckedHeader,
+ *  CheckBlockHeader has already succeeded for it. */
+static bool AcceptBlockHeader(const CBlockHeader& block, const uint256& hash, bool fCheckedHeader, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = NULL;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
@@ -3664,7 +3842,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!fCheckedHeader && !CheckBlockHeader(block, state, chainparams.GetConsensus()))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3684,7 +3862,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
     }
     if (pindex == NULL)
-        pindex = AddToBlockIndex(block);
+        pindex = AddToBlockIndex(block, hash);
 
     if (ppindex)
         *ppindex = pindex;
@@ -3692,6 +3870,76 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
     return true;
 }
 
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+{
+    return AcceptBlockHeader(block, block.GetHash(), false, state, chainparams, ppindex);
+}
+
+/**
+ * The lock-free half of accepting a run of headers: hash them all at once,
+ * and run CheckBlockHeader and the check that each builds on the previous
+ * one. nChecked is set to the number of leading headers that passed, and if
+ * that is not all of them, stateCheck to the reason the next one failed.
+ */
+static void CheckBlockHeaders(const std::vector<CBlockHeader>& headers, std::vector<uint256>& vHashes, size_t& nChecked, CValidationState& stateCheck, const Consensus::Params& consensusParams)
+{
+    static_assert(sizeof(uint256) == 32, "SHA256D80 writes hashes back to back");
+    vHashes.resize(headers.size());
+    nChecked = 0;
+    if (headers.empty())
+        return;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(80 * headers.size());
+    BOOST_FOREACH(const CBlockHeader& header, headers)
+        ss << header;
+    assert(ss.size() == 80 * headers.size());
+    SHA256D80(vHashes[0].begin(), (const unsigned char*)&ss[0], headers.size());
+
+    for (; nChecked < headers.size(); nChecked++) {
+        const CBlockHeader& header = headers[nChecked];
+        if (nChecked > 0 && header.hashPrevBlock != vHashes[nChecked - 1]) {
+            stateCheck.DoS(20, error("non-continuous headers sequence"), REJECT_INVALID, "bad-prevblk");
+            break;
+        }
+        if (!CheckProofOfWork(vHashes[nChecked], header.nBits, consensusParams)) {
+            stateCheck.DoS(50, error("%s: Consensus::CheckBlockHeader: %s, proof of work failed", __func__, vHashes[nChecked].ToString()), REJECT_INVALID, "high-hash");
+            break;
+        }
+    }
+}
+
+/** The locked half of accepting a run of headers, see CheckBlockHeaders. */
+static bool AcceptBlockHeaders(const std::vector<CBlockHeader>& headers, const std::vector<uint256>& vHashes, size_t nChecked, const CValidationState& stateCheck, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+{
+    AssertLockHeld(cs_main);
+    for (size_t i = 0; i < nChecked; i++) {
+        if (!AcceptBlockHeader(headers[i], vHashes[i], true, state, chainparams, ppindex))
+            return false;
+    }
+    if (nChecked < headers.size()) {
+        state = stateCheck;
+        return false;
+    }
+    return true;
+}
+
+bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+{
+    std::vector<uint256> vHashes;
+    size_t nChecked;
+    CValidationState stateCheck;
+    CheckBlockHeaders(headers, vHashes, nChecked, stateCheck, chainparams.GetConsensus());
+
+    bool fAccepted;
+    {
+        LOCK(cs_main);
+        fAccepted = AcceptBlockHeaders(headers, vHashes, nChecked, stateCheck, state, chainparams, ppindex);
+    }
+    NotifyHeaderTip();
+    return fAccepted;
+}
+
 /** Store block on disk. If dbp is non-NULL, the file is known to already reside on disk */
 static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
 {
@@ -3708,7 +3956,7 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
     // process an unrequested block if it's new and has enough work to
     // advance our tip, and isn't too many blocks ahead.
     bool fAlreadyHave = pindex->nStatus & BLOCK_HAVE_DATA;
-    bool fHasMoreWork = (chainActive.Tip() ? pindex->nChainWork > chainActive.Tip()->nChainWork : true);
+    bool fHasMoreWork = (chainActive.Tip() ? pindex->GetChainWork() > chainActive.Tip()->GetChainWork() : true);
     // Blocks that are too out-of-order needlessly limit the effectiveness of
     // pruning, because pruning will not delete block files that contain any
     // blocks which are too close in height to the tip.  Apply this test
@@ -3877,6 +4125,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        blockFileMapper.Forget(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -3989,36 +4238,212 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error(std::string(__func__) + ": new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Create();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+namespace {
+
+const char BLOCK_INDEX_SNAPSHOT_FILENAME[] = "blockindex.dat";
+const unsigned char BLOCK_INDEX_SNAPSHOT_MAGIC[4] = {'b', 'i', 'd', 'x'};
+const uint32_t BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+//! Magic, version, tag and entry count
+const size_t BLOCK_INDEX_SNAPSHOT_HEADER_SIZE = 4 + 4 + 32 + 4;
+//! Hash, prev and skip positions, 11 integer fields, merkle root and chain work
+const size_t BLOCK_INDEX_SNAPSHOT_RECORD_SIZE = 32 + 4 + 4 + 11 * 4 + 32 + 32;
+
+/** Fixed-size, little-endian image of one CBlockIndex. Links are stored as
+ *  positions in the snapshot, plus one, with 0 meaning none. */
+void WriteSnapshotRecord(unsigned char* p, const CBlockIndex* pindex, uint32_t nPrev, uint32_t nSkip)
+{
+    memcpy(p, pindex->GetBlockHash().begin(), 32); p += 32;
+    WriteLE32(p, nPrev); p += 4;
+    WriteLE32(p, nSkip); p += 4;
+    WriteLE32(p, pindex->nHeight); p += 4;
+    WriteLE32(p, pindex->nFile); p += 4;
+    WriteLE32(p, pindex->nDataPos); p += 4;
+    WriteLE32(p, pindex->nUndoPos); p += 4;
+    WriteLE32(p, pindex->nTx); p += 4;
+    WriteLE32(p, pindex->nChainTx); p += 4;
+    WriteLE32(p, pindex->nStatus); p += 4;
+    WriteLE32(p, pindex->nVersion); p += 4;
+    WriteLE32(p, pindex->nTime); p += 4;
+    WriteLE32(p, pindex->nBits); p += 4;
+    WriteLE32(p, pindex->nNonce); p += 4;
+    memcpy(p, pindex->hashMerkleRoot.begin(), 32); p += 32;
+    uint256 work = ArithToUint256(pindex->GetChainWork());
+    memcpy(p, work.begin(), 32);
+}
+
+} // anon namespace
+
+bool WriteBlockIndexSnapshot()
+{
+    AssertLockHeld(cs_main);
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / BLOCK_INDEX_SNAPSHOT_FILENAME;
+    boost::filesystem::path pathTmp = GetDataDir() / (std::string(BLOCK_INDEX_SNAPSHOT_FILENAME) + ".new");
+
+    // Parents must come before their children
+    std::vector<std::pair<int, const CBlockIndex*> > vSorted;
+    vSorted.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSorted.push_back(std::make_pair(item.second->nHeight, item.second));
+    std::sort(vSorted.begin(), vSorted.end());
+    boost::unordered_map<const CBlockIndex*, uint32_t> mapPos;
+    mapPos.rehash(vSorted.size());
+
+    uint256 tag = GetRandHash();
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("%s: cannot open %s", __func__, pathTmp.string());
+    CSHA256 hasher;
+    std::vector<unsigned char> vBuf(BLOCK_INDEX_SNAPSHOT_HEADER_SIZE);
+    memcpy(&vBuf[0], BLOCK_INDEX_SNAPSHOT_MAGIC, 4);
+    WriteLE32(&vBuf[4], BLOCK_INDEX_SNAPSHOT_VERSION);
+    memcpy(&vBuf[8], tag.begin(), 32);
+    WriteLE32(&vBuf[40], vSorted.size());
+    bool fOk = fwrite(&vBuf[0], 1, vBuf.size(), file) == vBuf.size();
+    hasher.Write(&vBuf[0], vBuf.size());
+
+    // Write in batches of records
+    static const size_t nBatch = 4096;
+    vBuf.resize(nBatch * BLOCK_INDEX_SNAPSHOT_RECORD_SIZE);
+    for (size_t i = 0; fOk && i < vSorted.size(); i += nBatch) {
+        size_t nCount = std::min(nBatch, vSorted.size() - i);
+        for (size_t j = 0; j < nCount; j++) {
+            const CBlockIndex* pindex = vSorted[i + j].second;
+            mapPos[pindex] = i + j + 1;
+            WriteSnapshotRecord(&vBuf[j * BLOCK_INDEX_SNAPSHOT_RECORD_SIZE], pindex,
+                pindex->pprev ? mapPos[pindex->pprev] : 0, pindex->pskip ? mapPos[pindex->pskip] : 0);
+        }
+        size_t nBytes = nCount * BLOCK_INDEX_SNAPSHOT_RECORD_SIZE;
+        fOk = fwrite(&vBuf[0], 1, nBytes, file) == nBytes;
+        hasher.Write(&vBuf[0], nBytes);
+    }
+    unsigned char checksum[CSHA256::OUTPUT_SIZE];
+    hasher.Finalize(checksum);
+    fOk = fOk && fwrite(checksum, 1, sizeof(checksum), file) == sizeof(checksum);
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+
+    // Only a file carrying the tag that is in the database will be loaded
+    if (!fOk || !RenameOver(pathTmp, path) || !pblocktree->WriteSnapshotTag(tag)) {
+        boost::filesystem::remove(pathTmp);
+        return error("%s: failed to write %s", __func__, path.string());
+    }
+    LogPrintf("Wrote block index snapshot of %u entries in %dms\n", (unsigned int)vSorted.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+/**
+ * Fill mapBlockIndex from the snapshot written at the last clean shutdown,
+ * if the database says it is still current. The snapshot is used once: its
+ * tag is removed from the database, so that if this run ends without writing
+ * a new one, the next start reads the database instead.
+ */
+bool static LoadBlockIndexSnapshot()
+{
+    uint256 tag;
+    if (!GetBoolArg("-blockindexsnapshot", DEFAULT_BLOCK_INDEX_SNAPSHOT) || !mapBlockIndex.empty() || !pblocktree->ReadSnapshotTag(tag))
+        return false;
+    if (!pblocktree->EraseSnapshotTag())
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / BLOCK_INDEX_SNAPSHOT_FILENAME;
+    boost::system::error_code ec;
+    uint64_t nFileSize = boost::filesystem::file_size(path, ec);
+    if (ec || nFileSize < BLOCK_INDEX_SNAPSHOT_HEADER_SIZE + CSHA256::OUTPUT_SIZE) {
+        LogPrintf("%s: no block index snapshot\n", __func__);
+        return false;
+    }
+    CBlockFileMapper mapper(1);
+    CBlockFileSpan span;
+    if (!mapper.Read(0, path, 0, nFileSize, span))
+        return false;
+    const unsigned char* p = (const unsigned char*)span.begin();
+    uint32_t nEntries = ReadLE32(p + 40);
+    if (memcmp(p, BLOCK_INDEX_SNAPSHOT_MAGIC, 4) || ReadLE32(p + 4) != BLOCK_INDEX_SNAPSHOT_VERSION || memcmp(p + 8, tag.begin(), 32) ||
+        nFileSize != BLOCK_INDEX_SNAPSHOT_HEADER_SIZE + (uint64_t)nEntries * BLOCK_INDEX_SNAPSHOT_RECORD_SIZE + CSHA256::OUTPUT_SIZE) {
+        LogPrintf("%s: block index snapshot is stale\n", __func__);
+        return false;
+    }
+    unsigned char checksum[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(p, nFileSize - sizeof(checksum)).Finalize(checksum);
+    if (memcmp(checksum, p + nFileSize - sizeof(checksum), sizeof(checksum))) {
+        LogPrintf("%s: block index snapshot is corrupted\n", __func__);
+        return false;
+    }
+
+    std::vector<CBlockIndex*> vIndex(nEntries);
+    p += BLOCK_INDEX_SNAPSHOT_HEADER_SIZE;
+    for (uint32_t i = 0; i < nEntries; i++, p += BLOCK_INDEX_SNAPSHOT_RECORD_SIZE) {
+        uint32_t nPrev = ReadLE32(p + 32);
+        uint32_t nSkip = ReadLE32(p + 36);
+        if (nPrev > i || nSkip > i) {
+            // Cannot happen with an intact file, but never link forward
+            mapBlockIndex.clear();
+            blockIndexArena.Clear();
+            return error("%s: bad link in block index snapshot", __func__);
+        }
+        uint256 hash;
+        memcpy(hash.begin(), p, 32);
+        CBlockIndex* pindex = vIndex[i] = InsertBlockIndex(hash);
+        pindex->pprev = nPrev ? vIndex[nPrev - 1] : NULL;
+        pindex->pskip = nSkip ? vIndex[nSkip - 1] : NULL;
+        pindex->nHeight = ReadLE32(p + 40);
+        pindex->nFile = ReadLE32(p + 44);
+        pindex->nDataPos = ReadLE32(p + 48);
+        pindex->nUndoPos = ReadLE32(p + 52);
+        pindex->nTx = ReadLE32(p + 56);
+        pindex->nChainTx = ReadLE32(p + 60);
+        pindex->nStatus = ReadLE32(p + 64);
+        pindex->nVersion = ReadLE32(p + 68);
+        pindex->nTime = ReadLE32(p + 72);
+        pindex->nBits = ReadLE32(p + 76);
+        pindex->nNonce = ReadLE32(p + 80);
+        memcpy(pindex->hashMerkleRoot.begin(), p + 84, 32);
+        uint256 work;
+        memcpy(work.begin(), p + 116, 32);
+        pindex->SetChainWork(UintToArith256(work));
+    }
+    LogPrintf("Loaded block index snapshot of %u entries in %dms\n", nEntries, GetTimeMillis() - nStart);
+    return true;
+}
+
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+    // The snapshot has chain work and skip pointers filled in already
+    bool fSnapshot = LoadBlockIndexSnapshot();
+    if (!fSnapshot && !pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
         return false;
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
+    // Calculate chain work. The database is read in height order, so the
+    // entries were created in that order too; only if some entry's parent
+    // was missing from the database is sorting needed.
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
+    vSortedByHeight.reserve(blockIndexArena.size());
+    bool fSorted = true;
+    for (size_t i = 0; i < blockIndexArena.size(); i++) {
+        CBlockIndex* pindex = blockIndexArena[i];
+        fSorted &= vSortedByHeight.empty() || vSortedByHeight.back().first <= pindex->nHeight;
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    if (!fSorted)
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+        if (!fSnapshot)
+            pindex->SetChainWork((pindex->pprev ? pindex->pprev->GetChainWork() : 0) + GetBlockProof(*pindex));
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
         if (pindex->nTx > 0) {
@@ -4035,9 +4460,9 @@ bool static LoadBlockIndexDB()
         }
         if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
             setBlockIndexCandidates.insert(pindex);
-        if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
+        if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->GetChainWork() > pindexBestInvalid->GetChainWork()))
             pindexBestInvalid = pindex;
-        if (pindex->pprev)
+        if (pindex->pprev && !fSnapshot)
             pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
@@ -4322,10 +4747,8 @@ void UnloadBlockIndex()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     fHavePruned = false;
 }
 
@@ -4378,118 +4801,308 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
-{
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+namespace {
 
-    int nLoaded = 0;
-    try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+//! Map of disk positions for blocks with unknown parent (only used for reindex)
+std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
+/**
+ * Call fn for every block found in fileIn, with its position in the file as
+ * dbp if that is not NULL. Stops early when fn returns false.
+ */
+void ScanBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos* dbp, boost::function<bool (CBlock&)> fn)
+{
+    // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+    CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
+    uint64_t nRewind = blkdat.GetPos();
+    while (!blkdat.eof()) {
+        boost::this_thread::interruption_point();
+
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(chainparams.MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            break;
+        }
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            if (dbp)
+                dbp->nPos = nBlockPos;
+            blkdat.SetLimit(nBlockPos + nSize);
+            blkdat.SetPos(nBlockPos);
+            CBlock block;
+            blkdat >> block;
+            nRewind = blkdat.GetPos();
+            if (!fn(block))
                 break;
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+    }
+}
+
+/**
+ * Add a block read by ScanBlockFile to the block index, along with any
+ * earlier encountered successors. Returns false on a fatal error.
+ */
+bool ImportBlock(const CChainParams& chainparams, const CBlock& blockIn, CDiskBlockPos* dbp, int& nLoaded)
+{
+    // detect out of order blocks, and store them for later
+    uint256 hash = blockIn.GetHash();
+    if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(blockIn.hashPrevBlock) == mapBlockIndex.end()) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                blockIn.hashPrevBlock.ToString());
+        if (dbp)
+            mapBlocksUnknownParent.insert(std::make_pair(blockIn.hashPrevBlock, *dbp));
+        return true;
+    }
+
+    // process in case the block isn't known yet
+    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        LOCK(cs_main);
+        CValidationState state;
+        if (AcceptBlock(blockIn, state, chainparams, NULL, true, dbp, NULL))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+        LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    }
+
+    // Activate the genesis block so normal node progress can continue
+    if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+        CValidationState state;
+        if (!ActivateBestChain(state, chainparams)) {
+            return false;
+        }
+    }
+
+    NotifyHeaderTip();
+
+    // Recursively process earlier encountered successors of this block
+    CBlock block;
+    deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+            if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
+            {
+                LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                        head.ToString());
+                LOCK(cs_main);
+                CValidationState dummy;
+                if (AcceptBlock(block, dummy, chainparams, NULL, true, &it->second, NULL))
+                {
+                    nLoaded++;
+                    queue.push_back(block.GetHash());
+                }
             }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+            NotifyHeaderTip();
+        }
+    }
+    return true;
+}
+
+/** Blocks read from one file, in file order, and checked with CheckBlock
+ *  where that succeeded. */
+struct CImportBatch
+{
+    std::vector<std::pair<std::shared_ptr<CBlock>, CDiskBlockPos> > vBlocks;
+    size_t nBytes;
+
+    CImportBatch() : nBytes(0) {}
+};
+
+/**
+ * Hands batches of blocks from the reader threads, which each work on a
+ * different file, to the importing thread, which takes them file by file.
+ */
+class CImportQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::vector<std::deque<CImportBatch> > vBatches;
+    std::vector<bool> vDone;
+    //! Next file for a reader to start on
+    size_t nNextFile;
+    //! File the importing thread is taking batches from
+    size_t nImportFile;
+    size_t nBytesQueued;
+    bool fStop;
+
+public:
+    explicit CImportQueue(size_t nFiles) : vBatches(nFiles), vDone(nFiles, false), nNextFile(0), nImportFile(0), nBytesQueued(0), fStop(false) {}
+
+    /** Claim a file to read; false if there are none left. */
+    bool NextFile(size_t& nFile)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fStop || nNextFile == vBatches.size())
+            return false;
+        nFile = nNextFile++;
+        return true;
+    }
+
+    /** Queue a batch, waiting while too much is queued already, unless the
+     *  importing thread is waiting for this very file. */
+    void Push(size_t nFile, CImportBatch& batch, bool fLast)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && nFile != nImportFile && nBytesQueued > MAX_IMPORT_QUEUE_BYTES)
+            cond.wait(lock);
+        nBytesQueued += batch.nBytes;
+        vBatches[nFile].push_back(CImportBatch());
+        vBatches[nFile].back().vBlocks.swap(batch.vBlocks);
+        vBatches[nFile].back().nBytes = batch.nBytes;
+        batch.nBytes = 0;
+        vDone[nFile] = fLast;
+        cond.notify_all();
+    }
+
+    /** Take the next batch of nFile; false once it has been read completely. */
+    bool Pop(size_t nFile, CImportBatch& batch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nImportFile != nFile) {
+            nImportFile = nFile;
+            cond.notify_all();
+        }
+        while (vBatches[nFile].empty() && !vDone[nFile])
+            cond.wait(lock);
+        if (vBatches[nFile].empty())
+            return false;
+        batch.vBlocks.swap(vBatches[nFile].front().vBlocks);
+        batch.nBytes = vBatches[nFile].front().nBytes;
+        vBatches[nFile].pop_front();
+        nBytesQueued -= batch.nBytes;
+        cond.notify_all();
+        return true;
+    }
+
+    void Stop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        cond.notify_all();
+    }
+
+    bool IsStopped()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fStop;
+    }
+};
+
+/** Check a block found by a reader and queue it. Returns false, which ends
+ *  the scan of the file, once the import has stopped. */
+bool ReadImportBlock(const CChainParams& chainparams, CImportQueue& queue, size_t nFile, CImportBatch& batch, const CDiskBlockPos* dbp, CBlock& block)
+{
+    if (queue.IsStopped())
+        return false;
+    // Context-free checks are the expensive part of accepting a block, and
+    // need no lock. Failures are left to AcceptBlock to report.
+    CValidationState state;
+    CheckBlock(block, state, chainparams.GetConsensus());
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>(std::move(block));
+    batch.vBlocks.push_back(std::make_pair(pblock, dbp ? *dbp : CDiskBlockPos()));
+    batch.nBytes += ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
+    if (batch.nBytes >= IMPORT_BATCH_BYTES)
+        queue.Push(nFile, batch, false);
+    return true;
+}
+
+void ThreadReadImportFiles(const CChainParams& chainparams, CImportQueue& queue, const std::vector<boost::filesystem::path>& vFiles, bool fBlockFiles)
+{
+    RenameThread("bitcoin-loadblkrd");
+    size_t nFile;
+    while (queue.NextFile(nFile)) {
+        CImportBatch batch;
+        FILE* file = fopen(vFiles[nFile].string().c_str(), "rb");
+        if (file) {
+            CDiskBlockPos pos(nFile, 0);
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+                ScanBlockFile(chainparams, file, fBlockFiles ? &pos : NULL,
+                    boost::bind(&ReadImportBlock, boost::cref(chainparams), boost::ref(queue), nFile, boost::ref(batch), fBlockFiles ? &pos : NULL, _1));
+            } catch (const std::runtime_error& e) {
+                AbortNode(std::string("System error: ") + e.what());
+            }
+        } else {
+            LogPrintf("Warning: Could not open blocks file %s\n", vFiles[nFile].string());
+        }
+        queue.Push(nFile, batch, true);
+    }
+}
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    LOCK(cs_main);
-                    CValidationState state;
-                    if (AcceptBlock(block, state, chainparams, NULL, true, dbp, NULL))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+} // anon namespace
 
-                // Activate the genesis block so normal node progress can continue
-                if (hash == chainparams.GetConsensus().hashGenesisBlock) {
-                    CValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
-                        break;
-                    }
-                }
+bool LoadExternalBlockFiles(const CChainParams& chainparams, const std::vector<boost::filesystem::path>& vFiles, bool fBlockFiles)
+{
+    int64_t nStart = GetTimeMillis();
+    int nLoaded = 0;
 
-                NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
-                        {
-                            LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            LOCK(cs_main);
-                            CValidationState dummy;
-                            if (AcceptBlock(block, dummy, chainparams, NULL, true, &it->second, NULL))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
-                    }
+    CImportQueue queue(vFiles.size());
+    int nThreads = std::max(1, std::min((int)GetArg("-importthreads", DEFAULT_IMPORT_THREADS), MAX_IMPORT_THREADS));
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads && i < (int)vFiles.size(); i++)
+        threadGroup.create_thread(boost::bind(&ThreadReadImportFiles, boost::cref(chainparams), boost::ref(queue), boost::cref(vFiles), fBlockFiles));
+
+    try {
+        for (size_t nFile = 0; nFile < vFiles.size(); nFile++) {
+            LogPrintf("%s block file %s...\n", fBlockFiles ? "Reindexing" : "Importing", vFiles[nFile].filename().string());
+            bool fFailed = false;
+            CImportBatch batch;
+            while (queue.Pop(nFile, batch)) {
+                for (size_t i = 0; i < batch.vBlocks.size() && !fFailed; i++) {
+                    boost::this_thread::interruption_point();
+                    CDiskBlockPos* dbp = fBlockFiles ? &batch.vBlocks[i].second : NULL;
+                    fFailed = !ImportBlock(chainparams, *batch.vBlocks[i].first, dbp, nLoaded);
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                // Connect what we have so far, while the readers go on
+                CValidationState state;
+                if (!fFailed && !ActivateBestChain(state, chainparams))
+                    fFailed = true;
+                if (fFailed)
+                    break;
+                batch.vBlocks.clear();
             }
+            if (fFailed)
+                break;
         }
+    } catch (const boost::thread_interrupted&) {
+        queue.Stop();
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
+    queue.Stop();
+    threadGroup.join_all();
+
     if (nLoaded > 0)
-        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+        LogPrintf("Loaded %i blocks from %u external files in %dms\n", nLoaded, (unsigned int)vFiles.size(), GetTimeMillis() - nStart);
     return nLoaded > 0;
 }
 
@@ -4567,7 +5180,7 @@ void static CheckBlockIndex(const Consensus::Params& consensusParams)
         assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0)); // nChainTx != 0 is used to signal that all parent blocks have been processed (but may have been pruned).
         assert((pindexFirstNotTransactionsValid != NULL) == (pindex->nChainTx == 0));
         assert(pindex->nHeight == nHeight); // nHeight must be consistent.
-        assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork); // For every block except the genesis block, the chainwork must be larger than the parent's.
+        assert(pindex->pprev == NULL || pindex->GetChainWork() >= pindex->pprev->GetChainWork()); // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight))); // The pskip pointer must point back for all but the first 2 blocks.
         assert(pindexFirstNotTreeValid == NULL); // All mapBlockIndex entries must at least be TREE valid
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TREE) assert(pindexFirstNotTreeValid == NULL); // TREE valid implies all parents are TREE valid
@@ -4765,12 +5378,158 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/** A block ProcessGetData decided to send, read and sent after cs_main is released */
+struct CBlockToServe
+{
+    CInv inv;
+    CDiskBlockPos pos;
+    uint256 hash;
+    //! Near the tip: worth a compact block, and worth keeping in blockRelayCache
+    bool fRecent;
+    bool fPeerWantsWitness;
+    // The inv that makes the peer ask for the next batch, if this block ends one
+    std::vector<CInv> vInvContinue;
+};
+
+/** Get a block from blockRelayCache, or else from disk, adding it to the
+ *  cache if fCache. Returns NULL if it is not on disk (any more). */
+static std::shared_ptr<const CBlock> GetBlockToRelay(const uint256& hash, const CDiskBlockPos& pos, bool fCache, const Consensus::Params& consensusParams)
+{
+    std::shared_ptr<const CBlock> pblock = blockRelayCache.GetBlock(hash);
+    if (pblock)
+        return pblock;
+    std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+    if (!ReadBlockFromDisk(*pblockRead, pos, consensusParams) || pblockRead->GetHash() != hash)
+        return std::shared_ptr<const CBlock>();
+    if (fCache)
+        blockRelayCache.AddBlock(hash, pblockRead);
+    return pblockRead;
+}
+
+/** Get a block serialized in the given form from blockRelayCache, or else
+ *  build it, adding it to the cache if fCache. Returns NULL if the block is
+ *  not on disk (any more). */
+static CNetPayloadRef GetBlockPayloadToRelay(const uint256& hash, const CDiskBlockPos& pos, CBlockRelayCache::Form form, bool fCache, const Consensus::Params& consensusParams)
+{
+    CNetPayloadRef payload = blockRelayCache.GetPayload(hash, form);
+    if (payload)
+        return payload;
+
+    // Blocks are stored with witness data, so that form is the bytes on
+    // disk as they are.
+    CBlockFileSpan span;
+    if (form == CBlockRelayCache::FULL_WITNESS && ReadRawBlockFromDisk(span, pos, hash, Params().MessageStart())) {
+        payload = std::make_shared<const CNetPayload>(std::make_shared<CBlockFileSpan>(span), span.begin(), span.size());
+    } else {
+        std::shared_ptr<const CBlock> pblock = GetBlockToRelay(hash, pos, fCache, consensusParams);
+        if (!pblock)
+            return CNetPayloadRef();
+        switch (form) {
+        case CBlockRelayCache::FULL_WITNESS:
+            payload = MakeNetPayload(*pblock);
+            break;
+        case CBlockRelayCache::FULL_NO_WITNESS:
+            payload = MakeNetPayload(*pblock, SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS);
+            break;
+        case CBlockRelayCache::CMPCT_WITNESS:
+            payload = MakeNetPayload(CBlockHeaderAndShortTxIDs(*pblock, true));
+            break;
+        case CBlockRelayCache::CMPCT_NO_WITNESS:
+            payload = MakeNetPayload(CBlockHeaderAndShortTxIDs(*pblock, false), SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS);
+            break;
+        default:
+            assert(false);
+        }
+    }
+    if (fCache)
+        blockRelayCache.AddPayload(hash, form, payload);
+    return payload;
+}
+
+/** Send a block ProcessGetData picked the way the peer asked for it, from blockRelayCache if it is there */
+void static ServeBlock(CNode* pfrom, const CBlockToServe& serve, const Consensus::Params& consensusParams)
+{
+    const CInv& inv = serve.inv;
+    if (inv.type == MSG_FILTERED_BLOCK)
+    {
+        std::shared_ptr<const CBlock> pblock = GetBlockToRelay(serve.hash, serve.pos, serve.fRecent, consensusParams);
+        if (!pblock) {
+            // The block may have been pruned since cs_main was released
+            LogPrintf("%s: cannot load block %s for peer=%d\n", __func__, serve.hash.ToString(), pfrom->GetId());
+            return;
+        }
+        bool send = false;
+        CMerkleBlock merkleBlock;
+        {
+            LOCK(pfrom->cs_filter);
+            if (pfrom->pfilter) {
+                send = true;
+                merkleBlock = CMerkleBlock(*pblock, *pfrom->pfilter);
+            }
+        }
+        if (send) {
+            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
+            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+            // This avoids hurting performance by pointlessly requiring a round-trip
+            // Note that there is currently no way for a node to request any single transactions we didn't send here -
+            // they must either disconnect and retry or request the full block.
+            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+            // however we MUST always provide at least what the remote peer needs
+            typedef std::pair<unsigned int, uint256> PairType;
+            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, pblock->vtx[pair.first]);
+        }
+        // else
+            // no response
+    }
+    else
+    {
+        const char* pszCommand = NetMsgType::BLOCK;
+        CBlockRelayCache::Form form;
+        if (inv.type == MSG_BLOCK)
+            form = CBlockRelayCache::FULL_NO_WITNESS;
+        else if (inv.type == MSG_WITNESS_BLOCK)
+            form = CBlockRelayCache::FULL_WITNESS;
+        else if (serve.fRecent) {
+            pszCommand = NetMsgType::CMPCTBLOCK;
+            form = serve.fPeerWantsWitness ? CBlockRelayCache::CMPCT_WITNESS : CBlockRelayCache::CMPCT_NO_WITNESS;
+        } else {
+            // If a peer is asking for old blocks, we're almost guaranteed
+            // they wont have a useful mempool to match against a compact block,
+            // and we don't feel like constructing the object for them, so
+            // instead we respond with the full, non-compact block.
+            form = serve.fPeerWantsWitness ? CBlockRelayCache::FULL_WITNESS : CBlockRelayCache::FULL_NO_WITNESS;
+        }
+        CNetPayloadRef payload = GetBlockPayloadToRelay(serve.hash, serve.pos, form, serve.fRecent, consensusParams);
+        if (!payload) {
+            LogPrintf("%s: cannot load block %s for peer=%d\n", __func__, serve.hash.ToString(), pfrom->GetId());
+            return;
+        }
+        pfrom->PushSharedMessage(pszCommand, payload);
+    }
+
+    // Trigger the peer node to send a getblocks request for the next batch of inventory
+    if (!serve.vInvContinue.empty())
+    {
+        // Bypass PushInventory, this must send even if redundant,
+        // and we want it right after the last block so they don't
+        // wait for other stuff first.
+        pfrom->PushMessage(NetMsgType::INV, serve.vInvContinue);
+    }
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
+    // Which block to send is decided under cs_main, but reading it from disk
+    // and serializing it for the peer is done after releasing it.
+    bool fServeBlock = false;
+    CBlockToServe serve;
+
+    {
     LOCK(cs_main);
 
     while (it != pfrom->vRecvGetData.end()) {
@@ -4819,63 +5578,16 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_FILTERED_BLOCK)
-                    {
-                        bool send = false;
-                        CMerkleBlock merkleBlock;
-                        {
-                            LOCK(pfrom->cs_filter);
-                            if (pfrom->pfilter) {
-                                send = true;
-                                merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
-                            }
-                        }
-                        if (send) {
-                            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
-                        }
-                        // else
-                            // no response
-                    }
-                    else if (inv.type == MSG_CMPCT_BLOCK)
-                    {
-                        // If a peer is asking for old blocks, we're almost guaranteed
-                        // they wont have a useful mempool to match against a compact block,
-                        // and we don't feel like constructing the object for them, so
-                        // instead we respond with the full, non-compact block.
-                        bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
-                        if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
-                            CBlockHeaderAndShortTxIDs cmpctblock(block, fPeerWantsWitness);
-                            pfrom->PushMessageWithFlag(fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
-                        } else
-                            pfrom->PushMessageWithFlag(fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    }
+                    fServeBlock = true;
+                    serve.inv = inv;
+                    serve.pos = mi->second->GetBlockPos();
+                    serve.hash = mi->second->GetBlockHash();
+                    serve.fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
+                    serve.fRecent = CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
 
-                    // Trigger the peer node to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
                     {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage(NetMsgType::INV, vInv);
+                        serve.vInvContinue.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
                         pfrom->hashContinue.SetNull();
                     }
                 }
@@ -4909,9 +5621,13 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 break;
         }
     }
+    }
 
     pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
 
+    if (fServeBlock)
+        ServeBlock(pfrom, serve, consensusParams);
+
     if (!vNotFound.empty()) {
         // Let the peer know that we didn't find what it asked for, so it doesn't
         // have to wait around forever. Currently only SPV clients actually care
@@ -5506,15 +6222,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // The context-free checks need no lock, so a malformed transaction
+        // is turned away without running them under cs_main.
+        CValidationState state;
+        bool fCheckedOk = CheckTransaction(tx, state);
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
-        CValidationState state;
 
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv.hash);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
+        bool fAcceptAttempted = fCheckedOk && !AlreadyHave(inv);
+        if (fAcceptAttempted && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
             for (unsigned int i = 0; i < tx.vout.size(); i++) {
@@ -5623,6 +6344,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 recentRejects->insert(tx.GetHash());
             }
 
+            // Transactions the mempool turned away by policy alone may still
+            // be mined. Duplicates of what we already have are not kept, or
+            // any peer could flush the pool by resending them.
+            int nDoSReject = 0;
+            if (fAcceptAttempted && !state.CorruptionPossible() && state.IsInvalid(nDoSReject) && nDoSReject == 0 &&
+                    state.GetRejectCode() != REJECT_ALREADY_KNOWN)
+                AddToCompactExtraTransactions(std::make_shared<const CTransaction>(tx));
+
             if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
                 // Always relay transactions received from whitelisted peers, even
                 // if they were already in the mempool or rejected from it due
@@ -5699,7 +6428,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
             return true;
 
-        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+        if (pindex->GetChainWork() <= chainActive.Tip()->GetChainWork() || // We know something better
                 pindex->nTx != 0) { // We had this block at some point, but pruned it
             if (fAlreadyInFlight) {
                 // We requested this block for some reason, but our mempool will probably be useless
@@ -5740,7 +6469,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 }
 
                 PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
-                ReadStatus status = partialBlock.InitData(cmpctblock);
+                ReadStatus status = partialBlock.InitData(cmpctblock, vExtraTxnForCompact);
                 if (status == READ_STATUS_INVALID) {
                     MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
                     Misbehaving(pfrom->GetId(), 100);
@@ -5783,7 +6512,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 // Optimistically try to reconstruct anyway since we might be
                 // able to without any round trips.
                 PartiallyDownloadedBlock tempBlock(&mempool);
-                ReadStatus status = tempBlock.InitData(cmpctblock);
+                ReadStatus status = tempBlock.InitData(cmpctblock, vExtraTxnForCompact);
                 if (status != READ_STATUS_OK) {
                     // TODO: don't ignore failures
                     return true;
@@ -5920,6 +6649,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Hash the headers and check their proof of work before taking cs_main
+        std::vector<uint256> vHashes;
+        size_t nChecked;
+        CValidationState stateCheck;
+        CheckBlockHeaders(headers, vHashes, nChecked, stateCheck, chainparams.GetConsensus());
+
         {
         LOCK(cs_main);
 
@@ -5942,14 +6677,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             nodestate->nUnconnectingHeaders++;
             pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256());
             LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
-                    headers[0].GetHash().ToString(),
+                    vHashes[0].ToString(),
                     headers[0].hashPrevBlock.ToString(),
                     pindexBestHeader->nHeight,
                     pfrom->id, nodestate->nUnconnectingHeaders);
             // Set hashLastUnknownBlock for this peer, so that if we
             // eventually get the headers - even from a different peer -
             // we can use this peer to download.
-            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+            UpdateBlockAvailability(pfrom->GetId(), vHashes.back());
 
             if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0) {
                 Misbehaving(pfrom->GetId(), 20);
@@ -5958,20 +6693,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
-            CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
-                Misbehaving(pfrom->GetId(), 20);
-                return error("non-continuous headers sequence");
-            }
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
-                int nDoS;
-                if (state.IsInvalid(nDoS)) {
-                    if (nDoS > 0)
-                        Misbehaving(pfrom->GetId(), nDoS);
-                    return error("invalid header received");
-                }
-            }
+        CValidationState state;
+        if (!AcceptBlockHeaders(headers, vHashes, nChecked, stateCheck, state, chainparams, &pindexLast)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0)
+                Misbehaving(pfrom->GetId(), nDoS);
+            return error("invalid header received");
         }
 
         if (nodestate->nUnconnectingHeaders > 0) {
@@ -5993,7 +6720,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         bool fCanDirectFetch = CanDirectFetch(chainparams.GetConsensus());
         // If this set of headers is valid and ends in a block with at least as
         // much work as our tip, download as much as possible.
-        if (fCanDirectFetch && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
+        if (fCanDirectFetch && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->GetChainWork() <= pindexLast->GetChainWork()) {
             vector<CBlockIndex *> vToFetch;
             CBlockIndex *pindexWalk = pindexLast;
             // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
@@ -6099,7 +6826,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -6448,7 +7178,7 @@ public:
         mp = mempool;
     }
 
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
+    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b) const
     {
         /* As std::make_heap produces a max-heap, we want the entries with the
          * fewest ancestors/highest fee to sort later. */
@@ -6508,6 +7238,7 @@ bool SendMessages(CNode* pto)
         // Message: addr
         //
         if (pto->nNextAddrSend < nNow) {
+            LOCK(pto->cs_addrSend);
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
@@ -6658,11 +7389,12 @@ bool SendMessages(CNode* pto)
                     // probably means we're doing an initial-ish-sync or they're slow
                     LogPrint("net", "%s sending header-and-ids %s to peer %d\n", __func__,
                             vHeaders.front().GetHash().ToString(), pto->id);
-                    //TODO: Shouldn't need to reload block from disk, but requires refactor
-                    CBlock block;
-                    assert(ReadBlockFromDisk(block, pBestIndex, consensusParams));
-                    CBlockHeaderAndShortTxIDs cmpctblock(block, state.fWantsCmpctWitness);
-                    pto->PushMessageWithFlag(state.fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
+                    // Built once for all high-bandwidth peers, and kept for
+                    // those fetching it with getdata
+                    CNetPayloadRef cmpctblock = GetBlockPayloadToRelay(pBestIndex->GetBlockHash(), pBestIndex->GetBlockPos(),
+                            state.fWantsCmpctWitness ? CBlockRelayCache::CMPCT_WITNESS : CBlockRelayCache::CMPCT_NO_WITNESS, true, consensusParams);
+                    assert(cmpctblock);
+                    pto->PushSharedMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
                     state.pindexBestHeaderSent = pBestIndex;
                 } else if (state.fPreferHeaders) {
                     if (vHeaders.size() > 1) {
@@ -6950,16 +7682,146 @@ ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::D
     return VersionBitsState(chainActive.Tip(), params, pos, versionbitscache);
 }
 
+namespace {
+
+const char MEMPOOL_FILENAME[] = "mempool.dat";
+const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+std::atomic<bool> fMempoolLoaded(false);
+std::atomic<uint64_t> nMempoolLoadTotal(0);
+std::atomic<uint64_t> nMempoolLoadProcessed(0);
+std::atomic<uint64_t> nMempoolLoadAccepted(0);
+
+} // anon namespace
+
+/**
+ * The file holds a version, the prioritisation deltas, then the mempool
+ * transactions, each with the time it entered the mempool. The transactions
+ * are written parents first, so they can be accepted again in file order.
+ */
+bool DumpMempool()
+{
+    // A mempool that has not been loaded in full would overwrite the file
+    // with less than it holds.
+    if (!fMempoolLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<TxMempoolInfo> vInfo;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vInfo = mempool.infoAll();
+    }
+
+    boost::filesystem::path path = GetDataDir() / MEMPOOL_FILENAME;
+    boost::filesystem::path pathTmp = GetDataDir() / (std::string(MEMPOOL_FILENAME) + ".new");
+    try {
+        CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s: cannot open %s", __func__, pathTmp.string());
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << (uint64_t)vInfo.size();
+        BOOST_FOREACH(const TxMempoolInfo& info, vInfo) {
+            file << *info.tx;
+            file << info.nTime;
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, path))
+            throw std::runtime_error("rename failed");
+    } catch (const std::exception& e) {
+        boost::filesystem::remove(pathTmp);
+        return error("%s: failed to write %s: %s", __func__, path.string(), e.what());
+    }
+    LogPrintf("Dumped %u mempool transactions in %dms\n", (unsigned int)vInfo.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    if (!GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    boost::filesystem::path path = GetDataDir() / MEMPOOL_FILENAME;
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    int64_t nNow = GetTime();
+    uint64_t nExpired = 0;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            throw std::runtime_error(strprintf("unknown version %u", nVersion));
+
+        // Deltas go in first, so that they count when their transaction is accepted
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t nTotal;
+        file >> nTotal;
+        nMempoolLoadTotal = nTotal;
+        for (uint64_t i = 0; i < nTotal; i++) {
+            CTransaction tx;
+            int64_t nTime;
+            file >> tx;
+            file >> nTime;
+
+            if (nTime + nExpiryTimeout > nNow) {
+                CValidationState state;
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime))
+                    ++nMempoolLoadAccepted;
+            } else {
+                nExpired++;
+            }
+            ++nMempoolLoadProcessed;
+
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: failed to read %s: %s\n", __func__, path.string(), e.what());
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    LogPrintf("Loaded %u of %u mempool transactions (%u expired) in %dms\n", (uint64_t)nMempoolLoadAccepted,
+        (uint64_t)nMempoolLoadTotal, nExpired, GetTimeMillis() - nStart);
+    fMempoolLoaded = true;
+    return true;
+}
+
+CMempoolLoadProgress GetMempoolLoadProgress()
+{
+    CMempoolLoadProgress progress;
+    progress.fDone = fMempoolLoaded;
+    progress.nTotal = nMempoolLoadTotal;
+    progress.nProcessed = nMempoolLoadProcessed;
+    progress.nAccepted = nMempoolLoadAccepted;
+    return progress;
+}
+
 class CMainCleanup
 {
 public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
@@ -11,8 +11,11 @@
 #endif
 
 #include "amount.h"
+#include "blockfilemap.h"
+#include "blockrelaycache.h"
 #include "chain.h"
 #include "coins.h"
+#include "flathashmap.h"
 #include "net.h"
 #include "script/script_error.h"
 #include "sync.h"
@@ -31,6 +34,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
 class CBloomFilter;
 class CChainParams;
 class CInv;
@@ -57,6 +61,8 @@ static const CAmount HIGH_TX_FEE_PER_KB = 0.01 * COIN;
 static const CAmount HIGH_MAX_TX_FEE = 100 * HIGH_TX_FEE_PER_KB;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -blockreconstructionextratxn, number of transactions kept outside the mempool for compact block reconstruction */
+static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
 /** Expiration time for orphan transactions in seconds */
 static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** Minimum time between orphan transactions expire time checks in seconds */
@@ -82,6 +88,18 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of threads reading a block's inputs ahead of connecting it */
+static const int MAX_PREFETCH_THREADS = 16;
+/** -prefetchthreads default */
+static const int DEFAULT_PREFETCH_THREADS = 4;
+/** Maximum number of threads reading block files during -reindex and -loadblock */
+static const int MAX_IMPORT_THREADS = 16;
+/** -importthreads default */
+static const int DEFAULT_IMPORT_THREADS = 4;
+/** Blocks read by an import thread are handed over in batches of this size */
+static const size_t IMPORT_BATCH_BYTES = 16 * 1024 * 1024;
+/** Maximum size of the blocks read ahead of the one being imported */
+static const size_t MAX_IMPORT_QUEUE_BYTES = 256 * 1024 * 1024;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -132,6 +150,10 @@ static const int64_t DEFAULT_MAX_TIP_AGE = 7 * 24 * 60 * 60;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = false;
+/** Default for -blockindexsnapshot */
+static const bool DEFAULT_BLOCK_INDEX_SNAPSHOT = true;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 
 static const bool DEFAULT_TESTSAFEMODE = false;
@@ -156,7 +178,9 @@ struct BlockHasher
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+/** Recent blocks serialized for relay, shared by all peers */
+extern CBlockRelayCache blockRelayCache;
+typedef flathashmap<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
@@ -167,6 +191,7 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nPrefetchThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
@@ -228,6 +253,17 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @return True if state.IsValid()
  */
 bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, CNode* pfrom, const CBlock* pblock, bool fForceProcessing, const CDiskBlockPos* dbp, bool fMayBanPeerIfInvalid);
+/**
+ * Add a run of block headers, each building on the one before, to the block
+ * index. The headers are hashed together and their proof of work is checked
+ * before cs_main is taken; the contextual checks and the insertion happen in
+ * one locked step. Stops at the first invalid header.
+ *
+ * @param[out]  state   The reason the first invalid header was rejected.
+ * @param[out]  ppindex If not NULL, set to the last header accepted.
+ * @return True if all headers were accepted
+ */
+bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex = NULL);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -236,8 +272,13 @@ FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Translation to a filesystem path */
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
-/** Import blocks from an external file */
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/**
+ * Import blocks from the given files, in order. With fBlockFiles, vFiles[i]
+ * must be block file i, and the blocks are indexed where they are instead of
+ * being copied. The files are read and checked by -importthreads threads while
+ * the calling thread adds the blocks to the index and connects them.
+ */
+bool LoadExternalBlockFiles(const CChainParams& chainparams, const std::vector<boost::filesystem::path>& vFiles, bool fBlockFiles = false);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
@@ -254,6 +295,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the input prefetching thread */
+void ThreadPrefetchCoins();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -298,8 +341,8 @@ CBlockIndex * InsertBlockIndex(uint256 hash);
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
-/** Flush all state, indexes and buffers to disk. */
-void FlushStateToDisk();
+/** Flush all state, indexes and buffers to disk. Returns whether it succeeded. */
+bool FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
@@ -307,12 +350,31 @@ void PruneAndFlush();
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
 
+/** (try to) add transaction to memory pool, as if it had arrived at nAcceptTime **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
 /** Get the BIP9 state for a given deployment at the current tip. */
 ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::DeploymentPos pos);
 
+/** Write the mempool and the prioritisation deltas to a file, see -persistmempool */
+bool DumpMempool();
+/** Feed the transactions written by DumpMempool back through AcceptToMemoryPool,
+ *  unless -persistmempool=0 */
+bool LoadMempool();
+
+/** How far LoadMempool has got */
+struct CMempoolLoadProgress {
+    bool fDone;             //!< Whether loading has finished, or there was nothing to load
+    uint64_t nTotal;        //!< Number of transactions in the file
+    uint64_t nProcessed;    //!< Number of transactions looked at so far
+    uint64_t nAccepted;     //!< Number of those that made it into the mempool
+};
+CMempoolLoadProgress GetMempoolLoadProgress();
+
 struct CNodeStateStats {
     int nMisbehavior;
     int nSyncHeight;
@@ -443,6 +505,11 @@ public:
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Write the block index to a file for a fast start next time, see -blockindexsnapshot */
+bool WriteBlockIndexSnapshot();
+/** Get the serialized block as stored on disk (with witness data), without copying or deserializing it */
+bool ReadRawBlockFromDisk(CBlockFileSpan& span, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
+bool ReadRawBlockFromDisk(CBlockFileSpan& span, const CDiskBlockPos& pos, const uint256& hash, const CMessageHeader::MessageStartChars& messageStart);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -506,6 +573,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coin database underneath pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
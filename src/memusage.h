@@ -5,6 +5,7 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include "flathashmap.h"
 #include "indirectmap.h"
 
 #include <stdlib.h>
@@ -167,6 +168,14 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+// flathashmap allocates its elements in whole chunks, and has two index arrays
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const flathashmap<X, Y, Z>& m)
+{
+    return MallocUsage(m.chunk_bytes()) * m.chunk_count() + MallocUsage(sizeof(uint32_t) * m.slot_count()) + MallocUsage(m.slot_count());
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
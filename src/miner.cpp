@@ -12,6 +12,7 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
 #include "hash.h"
 #include "main.h"
 #include "net.h"
@@ -28,6 +29,7 @@
 #include <algorithm>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <deque>
 #include <queue>
 
 using namespace std;
@@ -47,12 +49,87 @@ uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 uint64_t nLastBlockWeight = 0;
 
+// The last block assembled that passed TestBlockValidity, by previous block
+// and merkle root. Once segwit is active the coinbase commits to the witnesses
+// as well. Protected by cs_main.
+static uint256 hashLastValidPrevBlock;
+static uint256 hashLastValidMerkleRoot;
+
+namespace {
+
+const int64_t TEMPLATE_LATENCY_BOUNDS_MS[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+const size_t TEMPLATE_LATENCY_BUCKETS = sizeof(TEMPLATE_LATENCY_BOUNDS_MS) / sizeof(TEMPLATE_LATENCY_BOUNDS_MS[0]) + 1;
+
+CCriticalSection cs_templateStats;
+uint64_t vTemplateLatencyCounts[TEMPLATE_LATENCY_BUCKETS];
+uint64_t nTemplateChecks[TEMPLATE_CHECK_STALE + 1];
+uint64_t nTemplateChecksSkipped;
+
+void RecordTemplateLatency(int64_t nMicros)
+{
+    size_t i = 0;
+    while (i < TEMPLATE_LATENCY_BUCKETS - 1 && nMicros > TEMPLATE_LATENCY_BOUNDS_MS[i] * 1000)
+        i++;
+    LOCK(cs_templateStats);
+    vTemplateLatencyCounts[i]++;
+}
+
+void RecordTemplateCheck(TemplateCheckState result)
+{
+    LOCK(cs_templateStats);
+    nTemplateChecks[result]++;
+}
+
+void RecordTemplateCheckSkipped()
+{
+    LOCK(cs_templateStats);
+    nTemplateChecksSkipped++;
+}
+
+/**
+ * Block templates waiting for their TestBlockValidity run, oldest first.
+ * Every template is checked, as each may have been handed out already; one
+ * whose previous block is no longer the tip by its turn is marked stale.
+ */
+class CTemplateCheckQueue
+{
+private:
+    typedef std::pair<std::shared_ptr<const CBlock>, std::shared_ptr<std::atomic<TemplateCheckState> > > CheckItem;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<CheckItem> queue;
+
+public:
+    void Push(const CBlock& block, const std::shared_ptr<std::atomic<TemplateCheckState> >& checkState)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queue.push_back(std::make_pair(std::make_shared<const CBlock>(block), checkState));
+        cond.notify_one();
+    }
+
+    /** Wait for a template to check; interruptible */
+    void Pop(std::shared_ptr<const CBlock>& pblockOut, std::shared_ptr<std::atomic<TemplateCheckState> >& checkStateOut)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty())
+            cond.wait(lock);
+        pblockOut = queue.front().first;
+        checkStateOut = queue.front().second;
+        queue.pop_front();
+    }
+};
+
+CTemplateCheckQueue templateCheckQueue;
+
+} // anon namespace
+
 class ScoreCompare
 {
 public:
     ScoreCompare() {}
 
-    bool operator()(const CTxMemPool::txiter a, const CTxMemPool::txiter b)
+    bool operator()(const CTxMemPool::txiter a, const CTxMemPool::txiter b) const
     {
         return CompareTxMemPoolEntryByScore()(*b,*a); // Convert to less than
     }
@@ -102,6 +179,8 @@ BlockAssembler::BlockAssembler(const CChainParams& _chainparams)
 
     // Whether we need to account for byte usage (in addition to weight usage)
     fNeedSizeAccounting = (nBlockMaxSize < MAX_BLOCK_SERIALIZED_SIZE-1000);
+
+    fAsyncCheck = GetBoolArg("-asynctemplatecheck", DEFAULT_ASYNC_TEMPLATE_CHECK);
 }
 
 void BlockAssembler::resetBlock()
@@ -124,6 +203,7 @@ void BlockAssembler::resetBlock()
 
 CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
 {
+    int64_t nTimeStart = GetTimeMicros();
     resetBlock();
 
     pblocktemplate.reset(new CBlockTemplate());
@@ -191,14 +271,79 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
     pblock->nNonce         = 0;
     pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(pblock->vtx[0]);
 
-    CValidationState state;
-    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
-        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+    // Asking for a template again before the chain or the mempool changed
+    // gives the same block, which needs no checking again
+    uint256 hashMerkleRoot = BlockMerkleRoot(*pblock);
+    if (pblock->hashPrevBlock != hashLastValidPrevBlock || hashMerkleRoot != hashLastValidMerkleRoot) {
+        if (fAsyncCheck) {
+            *pblocktemplate->checkState = TEMPLATE_CHECK_PENDING;
+            templateCheckQueue.Push(*pblock, pblocktemplate->checkState);
+        } else {
+            CValidationState state;
+            if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+                throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+            }
+            hashLastValidPrevBlock = pblock->hashPrevBlock;
+            hashLastValidMerkleRoot = hashMerkleRoot;
+        }
+    } else {
+        RecordTemplateCheckSkipped();
     }
 
+    RecordTemplateLatency(GetTimeMicros() - nTimeStart);
     return pblocktemplate.release();
 }
 
+void ThreadCheckBlockTemplates()
+{
+    RenameThread("bitcoin-tmplcheck");
+    while (true) {
+        std::shared_ptr<const CBlock> pblock;
+        std::shared_ptr<std::atomic<TemplateCheckState> > checkState;
+        templateCheckQueue.Pop(pblock, checkState);
+
+        TemplateCheckState result;
+        bool fSkipped = false;
+        {
+            LOCK(cs_main);
+            CBlockIndex* pindexPrev = chainActive.Tip();
+            CValidationState state;
+            if (pblock->hashPrevBlock != pindexPrev->GetBlockHash()) {
+                result = TEMPLATE_CHECK_STALE;
+            } else if (pblock->hashPrevBlock == hashLastValidPrevBlock && BlockMerkleRoot(*pblock) == hashLastValidMerkleRoot) {
+                result = TEMPLATE_CHECK_VALID;
+                fSkipped = true;
+            } else if (TestBlockValidity(state, Params(), *pblock, pindexPrev, false, false)) {
+                result = TEMPLATE_CHECK_VALID;
+                hashLastValidPrevBlock = pblock->hashPrevBlock;
+                hashLastValidMerkleRoot = BlockMerkleRoot(*pblock);
+            } else {
+                result = TEMPLATE_CHECK_INVALID;
+                LogPrintf("%s: block template with %u transactions on %s failed TestBlockValidity: %s\n", __func__,
+                    pblock->vtx.size(), pblock->hashPrevBlock.ToString(), FormatStateMessage(state));
+            }
+        }
+        *checkState = result;
+        if (fSkipped)
+            RecordTemplateCheckSkipped();
+        else
+            RecordTemplateCheck(result);
+    }
+}
+
+CBlockTemplateStats GetBlockTemplateStats()
+{
+    CBlockTemplateStats stats;
+    stats.vLatencyBoundsMs.assign(TEMPLATE_LATENCY_BOUNDS_MS, TEMPLATE_LATENCY_BOUNDS_MS + TEMPLATE_LATENCY_BUCKETS - 1);
+    LOCK(cs_templateStats);
+    stats.vLatencyCounts.assign(vTemplateLatencyCounts, vTemplateLatencyCounts + TEMPLATE_LATENCY_BUCKETS);
+    stats.nChecksValid = nTemplateChecks[TEMPLATE_CHECK_VALID];
+    stats.nChecksInvalid = nTemplateChecks[TEMPLATE_CHECK_INVALID];
+    stats.nChecksStale = nTemplateChecks[TEMPLATE_CHECK_STALE];
+    stats.nChecksSkipped = nTemplateChecksSkipped;
+    return stats;
+}
+
 bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
 {
     BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
@@ -409,6 +554,12 @@ void BlockAssembler::addPackageTxs()
     // and modifying them for their already included ancestors
     UpdatePackagesForAdded(inBlock, mapModifiedTx);
 
+    // Limit the number of attempts to add transactions to the block when it is
+    // close to full; this is just a simple heuristic to finish quickly if the
+    // mempool has a lot of entries.
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
     CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
     CTxMemPool::txiter iter;
     while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())
@@ -472,6 +623,12 @@ void BlockAssembler::addPackageTxs()
                 mapModifiedTx.get<ancestor_score>().erase(modit);
                 failedTx.insert(iter);
             }
+
+            ++nConsecutiveFailed;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockWeight > nBlockMaxWeight - 4000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
             continue;
         }
 
@@ -492,6 +649,9 @@ void BlockAssembler::addPackageTxs()
             continue;
         }
 
+        // This transaction will make it in; reset the failed counter.
+        nConsecutiveFailed = 0;
+
         // Package can be added. Sort the entries in a valid order.
         vector<CTxMemPool::txiter> sortedEntries;
         SortForBlock(ancestors, iter, sortedEntries);
@@ -649,36 +809,47 @@ void SetThreadPriority(int nPriority)
 //
 // ScanHash scans nonces looking for a hash with at least some zero bits.
 // The nonce is usually preserved between calls, but periodically or if the
-// nonce is 0xffff0000 or above, the block is rebuilt and nNonce starts over at
-// zero.
+// nonce reaches the end of the thread's share of the nonces, the block is
+// rebuilt and nNonce starts over.
 //
-bool static ScanHash(const CBlockHeader *pblock, uint32_t& nNonce, uint256 *phash)
+bool static ScanHash(const CSHA256D80Nonces& hasher, uint32_t& nNonce, uint256 *phash)
 {
-    // Write the first 76 bytes of the block header to a double-SHA256 state.
-    CHash256 hasher;
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss << *pblock;
-    assert(ss.size() == 80);
-    hasher.Write((unsigned char*)&ss[0], 76);
+    // Hash the nonces in batches, which the hasher runs several at a time.
+    static const uint32_t nBatch = 64;
+    unsigned char hashes[32 * nBatch];
 
     while (true) {
-        nNonce++;
-
-        // Write the last 4 bytes of the block header (the nonce) to a copy of
-        // the double-SHA256 state, and compute the result.
-        CHash256(hasher).Write((unsigned char*)&nNonce, 4).Finalize((unsigned char*)phash);
-
-        // Return the nonce if the hash has at least some zero bits,
-        // caller will check if it has enough to reach the target
-        if (((uint16_t*)phash)[15] == 0)
-            return true;
+        // Stop each batch at a multiple of 0x1000, where we return -1
+        uint32_t nCount = std::min(nBatch, 0x1000 - (nNonce & 0xfff));
+        hasher.Hash(hashes, nNonce + 1, nCount);
+
+        for (uint32_t i = 0; i < nCount; i++) {
+            nNonce++;
+
+            // Return the nonce if the hash has at least some zero bits,
+            // caller will check if it has enough to reach the target
+            const unsigned char* hash = hashes + 32 * i;
+            if (hash[30] == 0 && hash[31] == 0) {
+                memcpy(phash->begin(), hash, 32);
+                return true;
+            }
 
-        // If nothing found after trying for a while, return -1
-        if ((nNonce & 0xfff) == 0)
-            return false;
+            // If nothing found after trying for a while, return -1
+            if ((nNonce & 0xfff) == 0)
+                return false;
+        }
     }
 }
 
+/** The nonce hasher for a block header */
+static CSHA256D80Nonces HeaderHasher(const CBlockHeader& header)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header;
+    assert(ss.size() == 80);
+    return CSHA256D80Nonces((const unsigned char*)&ss[0]);
+}
+
 static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainparams)
 {
     LogPrintf("%s\n", pblock->ToString());
@@ -702,24 +873,137 @@ static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainpar
     return true;
 }
 
-void static BitcoinMiner(const CChainParams& chainparams)
+namespace {
+/** Hashes tried by the miner threads, and the rate of the last few seconds */
+std::atomic<uint64_t> nMinerHashes(0);
+boost::mutex cs_hashMeter;
+int64_t nHashMeterStart = 0;
+uint64_t nHashMeterStartCount = 0;
+double dHashesPerSec = 0;
+
+void CountMinerHashes(uint64_t nHashes)
+{
+    nMinerHashes += nHashes;
+
+    // Whichever thread gets here first after a few seconds updates the rate
+    boost::unique_lock<boost::mutex> lock(cs_hashMeter, boost::try_to_lock);
+    if (!lock.owns_lock())
+        return;
+    int64_t nNow = GetTimeMillis();
+    uint64_t nTotal = nMinerHashes;
+    if (nHashMeterStart == 0) {
+        nHashMeterStart = nNow;
+        nHashMeterStartCount = nTotal;
+    } else if (nNow - nHashMeterStart >= 4000) {
+        dHashesPerSec = 1000.0 * (nTotal - nHashMeterStartCount) / (nNow - nHashMeterStart);
+        nHashMeterStart = nNow;
+        nHashMeterStartCount = nTotal;
+    }
+}
+
+void ResetHashMeter()
+{
+    boost::unique_lock<boost::mutex> lock(cs_hashMeter);
+    nHashMeterStart = 0;
+    dHashesPerSec = 0;
+}
+
+/** A block for the miner threads to search, with what it was built on */
+struct CMinerJob
+{
+    std::shared_ptr<const CBlock> pblock;
+    const CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64_t nCreated;
+    uint64_t nGeneration;
+
+    CMinerJob() : pindexPrev(NULL), nTransactionsUpdatedLast(0), nCreated(0), nGeneration(0) {}
+};
+
+/**
+ * The block all the miner threads work on, each on its own share of the
+ * nonces, so a new tip or mempool builds one template rather than one per
+ * thread. Every rebuild starts a new generation, with a new extranonce.
+ */
+class CMinerWork
+{
+private:
+    const CChainParams& chainparams;
+    boost::mutex cs;
+    boost::shared_ptr<CReserveScript> coinbaseScript;
+    CMinerJob job;
+    unsigned int nExtraNonce;
+    std::atomic<uint64_t> nGeneration;
+
+public:
+    explicit CMinerWork(const CChainParams& chainparamsIn) : chainparams(chainparamsIn), nExtraNonce(0), nGeneration(0) {}
+
+    uint64_t Generation() const { return nGeneration; }
+
+    /**
+     * The current job. If it is still generation nStale (or there is none
+     * yet), build a new one first; threads that find the same job stale
+     * then rebuild it only once. Returns false if no block could be built.
+     */
+    bool Get(CMinerJob& jobOut, uint64_t nStale)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (!job.pblock || job.nGeneration == nStale) {
+            if (!coinbaseScript) {
+                GetMainSignals().ScriptForMining(coinbaseScript);
+                // Throw an error if no script was provided.  This can happen
+                // due to some internal error but also if the keypool is empty.
+                // In the latter case, already the pointer is NULL.
+                if (!coinbaseScript || coinbaseScript->reserveScript.empty())
+                    throw std::runtime_error("No coinbase script available (mining requires a wallet)");
+            }
+
+            CMinerJob jobNew;
+            jobNew.nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+            jobNew.pindexPrev = chainActive.Tip();
+            jobNew.nCreated = GetTime();
+
+            BlockAssembler blockAssembler(chainparams);
+            std::unique_ptr<CBlockTemplate> pblocktemplate(blockAssembler.CreateNewBlock(coinbaseScript->reserveScript));
+            if (!pblocktemplate)
+                return false;
+            CBlock *pblock = &pblocktemplate->block;
+            IncrementExtraNonce(pblock, jobNew.pindexPrev, nExtraNonce);
+
+            LogPrintf("Running Miner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
+                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+
+            jobNew.pblock = std::make_shared<const CBlock>(*pblock);
+            jobNew.nGeneration = ++nGeneration;
+            job = jobNew;
+        }
+        jobOut = job;
+        return true;
+    }
+
+    void KeepScript()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        coinbaseScript->KeepScript();
+    }
+};
+} // anon namespace
+
+void static BitcoinMiner(const CChainParams& chainparams, std::shared_ptr<CMinerWork> work, int nThread, int nThreads)
 {
     LogPrintf("Miner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("bitcoin-miner");
 
-    unsigned int nExtraNonce = 0;
-
-    boost::shared_ptr<CReserveScript> coinbaseScript;
-    GetMainSignals().ScriptForMining(coinbaseScript);
+    // This thread's share of the nonces, leaving the last 0x10000 of it unused
+    // like a single thread did with the whole range
+    const uint64_t nShare = (UINT64_C(1) << 32) / nThreads;
+    const uint32_t nNonceBegin = nShare * nThread;
+    const uint64_t nNonceSpan = nShare - std::min(nShare, (uint64_t)0x10000);
+    assert(nNonceSpan > 0);
 
     try {
-        // Throw an error if no script was provided.  This can happen
-        // due to some internal error but also if the keypool is empty.
-        // In the latter case, already the pointer is NULL.
-        if (!coinbaseScript || coinbaseScript->reserveScript.empty())
-            throw std::runtime_error("No coinbase script available (mining requires a wallet)");
-
+        uint64_t nStale = 0;
         while (true) {
             if (chainparams.MiningRequiresPeers()) {
                 // Busy-wait for the network to come online so we don't waste time mining
@@ -737,77 +1021,84 @@ void static BitcoinMiner(const CChainParams& chainparams)
             }
 
             //
-            // Create new block
+            // Get the shared block, building a new one if ours is stale
             //
-            unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrev = chainActive.Tip();
-
-            BlockAssembler blockAssembler(chainparams);
-            auto_ptr<CBlockTemplate> pblocktemplate(blockAssembler.CreateNewBlock(coinbaseScript->reserveScript));
-            if (!pblocktemplate.get())
+            CMinerJob job;
+            if (!work->Get(job, nStale))
             {
                 LogPrintf("Error in Miner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
                 return;
             }
-            CBlock *pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-            LogPrintf("Running Miner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
-                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+            nStale = 0;
+            const CBlockIndex* pindexPrev = job.pindexPrev;
+            CBlockHeader header = job.pblock->GetBlockHeader();
 
             //
             // Search
             //
-            int64_t nStart = GetTime();
-            arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
+            arith_uint256 hashTarget = arith_uint256().SetCompact(header.nBits);
+            CSHA256D80Nonces hasher = HeaderHasher(header);
             uint256 hash;
-            uint32_t nNonce = 0;
+            uint32_t nNonce = nNonceBegin - 1;
             while (true) {
                 // Check if something found
-                if (ScanHash(pblock, nNonce, &hash))
+                uint32_t nNonceLast = nNonce;
+                bool fFound = ScanHash(hasher, nNonce, &hash);
+                CountMinerHashes((uint32_t)(nNonce - nNonceLast));
+                if (fFound)
                 {
                     if (UintToArith256(hash) <= hashTarget)
                     {
                         // Found a solution
-                        pblock->nNonce = nNonce;
-                        assert(hash == pblock->GetHash());
+                        CBlock block(*job.pblock);
+                        block.nTime = header.nTime;
+                        block.nBits = header.nBits;
+                        block.nNonce = nNonce;
+                        assert(hash == block.GetHash());
 
                         SetThreadPriority(THREAD_PRIORITY_NORMAL);
                         LogPrintf("Miner:\n");
                         LogPrintf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex(), hashTarget.GetHex());
-                        ProcessBlockFound(pblock, chainparams);
+                        ProcessBlockFound(&block, chainparams);
                         SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                        coinbaseScript->KeepScript();
+                        work->KeepScript();
 
                         // In regression test mode, stop mining after a block is found.
                         if (chainparams.MineBlocksOnDemand())
                             throw boost::thread_interrupted();
 
+                        nStale = job.nGeneration;
                         break;
                     }
                 }
 
                 // Check for stop or if block needs to be rebuilt
                 boost::this_thread::interruption_point();
+                // Another thread already replaced the block
+                if (work->Generation() != job.nGeneration)
+                    break;
                 // Regtest mode doesn't require peers
                 if (vNodes.empty() && chainparams.MiningRequiresPeers())
                     break;
-                if (nNonce >= 0xffff0000)
+                // Rebuild the block once this thread has run out of nonces,
+                // the mempool has changed for a while, or the tip moved
+                bool fStale = (uint32_t)(nNonce - nNonceBegin) >= nNonceSpan;
+                fStale = fStale || (mempool.GetTransactionsUpdated() != job.nTransactionsUpdatedLast && GetTime() - job.nCreated > 60);
+                fStale = fStale || pindexPrev != chainActive.Tip();
+
+                // Update nTime every few seconds, and recreate the block if
+                // the clock has run backwards, so that we can use the correct time.
+                fStale = fStale || UpdateTime(&header, chainparams.GetConsensus(), pindexPrev) < 0;
+                if (fStale) {
+                    nStale = job.nGeneration;
                     break;
-                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                    break;
-                if (pindexPrev != chainActive.Tip())
-                    break;
-
-                // Update nTime every few seconds
-                if (UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev) < 0)
-                    break; // Recreate the block if the clock has run backwards,
-                           // so that we can use the correct time.
+                }
                 if (chainparams.GetConsensus().fPowAllowMinDifficultyBlocks)
                 {
-                    // Changing pblock->nTime can change work required on testnet:
-                    hashTarget.SetCompact(pblock->nBits);
+                    // Changing header.nTime can change work required on testnet:
+                    hashTarget.SetCompact(header.nBits);
                 }
+                hasher = HeaderHasher(header);
             }
         }
     }
@@ -823,24 +1114,37 @@ void static BitcoinMiner(const CChainParams& chainparams)
     }
 }
 
+double GetMinerHashesPerSec()
+{
+    boost::unique_lock<boost::mutex> lock(cs_hashMeter);
+    return dHashesPerSec;
+}
+
 void GenerateBitcoins(bool fGenerate, int nThreads, const CChainParams& chainparams)
 {
     static boost::thread_group* minerThreads = NULL;
 
     if (nThreads < 0)
         nThreads = GetNumCores();
+    // With more threads their shares of the nonces would leave nothing to
+    // search, and each would rebuild the block without hashing it
+    nThreads = std::min(nThreads, MAX_GENERATE_THREADS);
 
     if (minerThreads != NULL)
     {
+        // Wait for the old threads, so none still runs once we return
         minerThreads->interrupt_all();
+        minerThreads->join_all();
         delete minerThreads;
         minerThreads = NULL;
+        ResetHashMeter();
     }
 
     if (nThreads == 0 || !fGenerate)
         return;
 
+    std::shared_ptr<CMinerWork> work = std::make_shared<CMinerWork>(chainparams);
     minerThreads = new boost::thread_group();
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&BitcoinMiner, boost::cref(chainparams)));
+        minerThreads->create_thread(boost::bind(&BitcoinMiner, boost::cref(chainparams), work, i, nThreads));
 }
@@ -9,8 +9,10 @@
 #include "primitives/block.h"
 #include "txmempool.h"
 
+#include <atomic>
 #include <stdint.h>
 #include <memory>
+#include <vector>
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 
@@ -23,6 +25,16 @@ class CWallet;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Default for -asynctemplatecheck */
+static const bool DEFAULT_ASYNC_TEMPLATE_CHECK = false;
+
+/** Where the TestBlockValidity run of a block template stands */
+enum TemplateCheckState {
+    TEMPLATE_CHECK_PENDING, //!< Waiting to be checked in the background, see -asynctemplatecheck
+    TEMPLATE_CHECK_VALID,
+    TEMPLATE_CHECK_INVALID,
+    TEMPLATE_CHECK_STALE,   //!< The tip moved on before the check came to it
+};
 
 struct CBlockTemplate
 {
@@ -30,6 +42,26 @@ struct CBlockTemplate
     std::vector<CAmount> vTxFees;
     std::vector<int64_t> vTxSigOpsCost;
     std::vector<unsigned char> vchCoinbaseCommitment;
+    //! Shared with the background check, which may outlive the template
+    std::shared_ptr<std::atomic<TemplateCheckState> > checkState;
+
+    CBlockTemplate() : checkState(std::make_shared<std::atomic<TemplateCheckState> >(TEMPLATE_CHECK_VALID)) {}
+
+    TemplateCheckState GetCheckState() const { return *checkState; }
+};
+
+/** Latencies of CreateNewBlock and outcomes of template checks */
+struct CBlockTemplateStats
+{
+    //! Upper bounds, in milliseconds, of the latency buckets
+    std::vector<int64_t> vLatencyBoundsMs;
+    //! Templates created per bucket, with one more at the end for those slower than all bounds
+    std::vector<uint64_t> vLatencyCounts;
+    uint64_t nChecksValid;
+    uint64_t nChecksInvalid;
+    uint64_t nChecksStale;
+    //! Templates not checked again, being the same block as the last one that passed
+    uint64_t nChecksSkipped;
 };
 
 // Container for tracking updates to ancestor feerate as we include (parent)
@@ -73,7 +105,7 @@ struct modifiedentry_iter {
 // except operating on CTxMemPoolModifiedEntry.
 // TODO: refactor to avoid duplication of this logic.
 struct CompareModifiedEntry {
-    bool operator()(const CTxMemPoolModifiedEntry &a, const CTxMemPoolModifiedEntry &b)
+    bool operator()(const CTxMemPoolModifiedEntry &a, const CTxMemPoolModifiedEntry &b) const
     {
         double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
         double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
@@ -88,7 +120,7 @@ struct CompareModifiedEntry {
 // This is sufficient to sort an ancestor package in an order that is valid
 // to appear in a block.
 struct CompareTxIterByAncestorCount {
-    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b)
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
     {
         if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
             return a->GetCountWithAncestors() < b->GetCountWithAncestors();
@@ -161,6 +193,9 @@ private:
     int lastFewTxs;
     bool blockFinished;
 
+    // Whether to return the template before TestBlockValidity has run
+    bool fAsyncCheck;
+
 public:
     BlockAssembler(const CChainParams& chainparams);
     /** Construct a new block template with coinbase to scriptPubKeyIn */
@@ -205,6 +240,10 @@ private:
     void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
 };
 
+/** Check the templates CreateNewBlock queued with -asynctemplatecheck */
+void ThreadCheckBlockTemplates();
+CBlockTemplateStats GetBlockTemplateStats();
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
@@ -212,6 +251,10 @@ int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParam
 /** Run the miner threads */
 static const bool DEFAULT_GENERATE = false;
 static const int DEFAULT_GENERATE_THREADS = 1;
+/** The most miner threads, so that each searches a share of at least 2^20 nonces */
+static const int MAX_GENERATE_THREADS = 4096;
 void GenerateBitcoins(bool fGenerate, int nThreads, const CChainParams& chainparams);
+/** The rate of the miner threads over the last few seconds; 0 when they are not running */
+double GetMinerHashesPerSec();
 
 #endif // BITCOIN_MINER_H
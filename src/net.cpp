@@ -25,6 +25,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -45,6 +46,9 @@
 // We add a random period time (0 to 1 seconds) to feeler connections to prevent synchronization.
 #define FEELER_SLEEP_WINDOW 1
 
+// Time to wait for socket events in one round of ThreadSocketHandler (in milliseconds), also the most time between its passes over all nodes
+#define SOCKET_EVENTS_TIMEOUT 50
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -93,11 +97,16 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
 std::vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
+/** Nodes by socket, to find the node behind a ready socket. Guarded by cs_vNodes */
+static std::map<SOCKET, CNode*> mapSocketNodes;
+/** What ThreadSocketHandler waits on; nodes register their socket when they connect */
+static CSocketEvents* pSocketEvents = NULL;
 limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static std::deque<std::string> vOneShots;
@@ -382,6 +391,30 @@ CNode* FindNode(const NodeId nodeid)
     return NULL;
 }
 
+/** Create what ThreadSocketHandler waits on, in -socketevents mode, unless done already */
+void StartSocketEvents()
+{
+    if (pSocketEvents == NULL) {
+        pSocketEvents = new CSocketEvents(nSocketEventsMode);
+        // The epoll backend falls back to select if it cannot be set up
+        nSocketEventsMode = pSocketEvents->GetMode();
+        LogPrintf("Using %s for socket events\n", GetSocketEventsModeName(nSocketEventsMode));
+    }
+}
+
+/** Hand a newly connected node to ThreadSocketHandler */
+void AddConnectedNode(CNode* pnode)
+{
+    LOCK(cs_vNodes);
+    if (pnode->RegisterSocketEvents()) {
+        mapSocketNodes[pnode->hSocket] = pnode;
+    } else {
+        LogPrintf("Cannot wait for events on the socket of peer=%d\n", pnode->id);
+        pnode->CloseSocketDisconnect();
+    }
+    vNodes.push_back(pnode);
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure)
 {
     if (pszDest == NULL) {
@@ -408,7 +441,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -439,11 +472,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
+        AddConnectedNode(pnode);
 
         pnode->nServicesExpected = ServiceFlags(addrConnect.nServices & nRelevantServices);
         pnode->nTimeConnected = GetTime();
@@ -481,10 +510,16 @@ static void DumpBanlist()
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
-    if (hSocket != INVALID_SOCKET)
     {
-        LogPrint("net", "disconnecting peer=%d\n", id);
-        CloseSocket(hSocket);
+        LOCK(cs_hSocket);
+        if (hSocket != INVALID_SOCKET)
+        {
+            LogPrint("net", "disconnecting peer=%d\n", id);
+            if (nSocketEvents)
+                pSocketEvents->Remove(hSocket);
+            nSocketEvents = 0;
+            CloseSocket(hSocket);
+        }
     }
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
@@ -721,15 +756,147 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
+namespace {
+/**
+ * Buffers of processed messages, kept to receive new ones into. Blocks
+ * would otherwise cost a large allocation, and the zeroing of the old one
+ * on release, every time.
+ */
+class CRecvBufferPool
+{
+private:
+    static const size_t MAX_BUFFERS = 512;
+    static const size_t MAX_BYTES = 16 * 1000 * 1000;
+
+    boost::mutex cs;
+    /** Pooled buffers by capacity */
+    std::multimap<size_t, CSerializeData> mapBuffers;
+    size_t nBytes;
+
+    /** Move a pooled buffer with room for nSize bytes, if any, into buffer:
+     *  the smallest with room for nSizeWanted, or else the largest. */
+    void TakeBuffer(CSerializeData& buffer, size_t nSize, size_t nSizeWanted)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        std::multimap<size_t, CSerializeData>::iterator it = mapBuffers.lower_bound(nSizeWanted);
+        if (it == mapBuffers.end() && !mapBuffers.empty() && (--it)->first < nSize)
+            it = mapBuffers.end();
+        if (it != mapBuffers.end()) {
+            buffer.swap(it->second);
+            mapBuffers.erase(it);
+            nBytes -= buffer.capacity();
+        }
+    }
+
+    /** Keep buffer, if there is room for it */
+    void KeepBuffer(CSerializeData& buffer)
+    {
+        if (buffer.capacity() == 0)
+            return;
+        buffer.clear();
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (mapBuffers.size() < MAX_BUFFERS && nBytes + buffer.capacity() <= MAX_BYTES) {
+            nBytes += buffer.capacity();
+            mapBuffers.insert(std::make_pair(buffer.capacity(), CSerializeData()))->second.swap(buffer);
+        }
+    }
+
+public:
+    std::atomic<uint64_t> nBytesReceived;
+    std::atomic<uint64_t> nBytesCopied;
+    std::atomic<uint64_t> nAllocs;
+    std::atomic<uint64_t> nReuses;
+
+    CRecvBufferPool() : nBytes(0), nBytesReceived(0), nBytesCopied(0), nAllocs(0), nReuses(0) {}
+
+    /** Give the empty stream vRecv a buffer with room for nSize bytes, which
+     *  it may grow to nSizeWanted: a pooled one, preferably with room for
+     *  all of nSizeWanted, or a new one of nSize. */
+    void Take(CDataStream& vRecv, size_t nSize, size_t nSizeWanted)
+    {
+        if (nSize == 0)
+            return;
+        CSerializeData buffer;
+        TakeBuffer(buffer, nSize, nSizeWanted);
+        if (buffer.capacity() >= nSize) {
+            nReuses++;
+        } else {
+            buffer.reserve(nSize);
+            nAllocs++;
+        }
+        vRecv.swap(buffer);
+    }
+
+    /** Make room for nSize bytes in vRecv, keeping its contents. If it has
+     *  to move, it moves into a pooled buffer as Take() picks one, if any;
+     *  otherwise it grows as a vector does. */
+    void Reserve(CDataStream& vRecv, size_t nSize, size_t nSizeWanted)
+    {
+        CSerializeData data;
+        vRecv.swap(data);
+        if (data.capacity() < nSize) {
+            nBytesCopied += data.size();
+            CSerializeData buffer;
+            TakeBuffer(buffer, nSize, nSizeWanted);
+            if (buffer.capacity() >= nSize) {
+                nReuses++;
+                buffer.assign(data.begin(), data.end());
+                data.swap(buffer);
+                KeepBuffer(buffer);
+            } else {
+                nAllocs++;
+            }
+        }
+        vRecv.swap(data);
+    }
+
+    /** Keep vRecv's buffer, if there is room for it */
+    void Release(CDataStream& vRecv)
+    {
+        CSerializeData buffer;
+        vRecv.swap(buffer);
+        KeepBuffer(buffer);
+    }
+};
+
+CRecvBufferPool recvBufferPool;
+} // anon namespace
+
+CNetRecvStats GetNetRecvStats()
+{
+    CNetRecvStats stats;
+    stats.nBytes = recvBufferPool.nBytesReceived;
+    stats.nBytesCopied = recvBufferPool.nBytesCopied;
+    stats.nBufferAllocs = recvBufferPool.nAllocs;
+    stats.nBufferReuses = recvBufferPool.nReuses;
+    return stats;
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::MessageComplete(CNetMessage& msg)
+{
+    //store received bytes per message command
+    //to prevent a memory DOS, only allow valid commands
+    mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
+    if (i == mapRecvBytesPerMsgCmd.end())
+        i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapRecvBytesPerMsgCmd.end());
+    i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+
+    msg.nTime = GetTimeMicros();
+    messageHandlerCondition.notify_one();
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    recvBufferPool.nBytesReceived += nBytes;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, nRecvVersion));
+            vRecvMsg.emplace_back(Params().MessageStart(), SER_NETWORK, nRecvVersion);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -750,23 +917,48 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         pch += handled;
         nBytes -= handled;
+        recvBufferPool.nBytesCopied += handled;
+
+        if (msg.complete())
+            MessageComplete(msg);
+    }
 
-        if (msg.complete()) {
+    return true;
+}
 
-            //store received bytes per message command
-            //to prevent a memory DOS, only allow valid commands
-            mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
-            if (i == mapRecvBytesPerMsgCmd.end())
-                i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
-            assert(i != mapRecvBytesPerMsgCmd.end());
-            i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+// requires LOCK(cs_vRecvMsg)
+bool CNode::ReceiveFromSocket(int& nBytes)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
 
-            msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
-        }
+    // Read the rest of a message that would fill the buffer anyway straight
+    // into it. There is nothing after it in the same read to sort out.
+    if (!vRecvMsg.empty() && vRecvMsg.back().in_data &&
+        vRecvMsg.back().hdr.nMessageSize <= MAX_PROTOCOL_MESSAGE_LENGTH &&
+        vRecvMsg.back().hdr.nMessageSize - vRecvMsg.back().nDataPos >= sizeof(pchBuf)) {
+        CNetMessage& msg = vRecvMsg.back();
+        unsigned int nSpace;
+        char* pch = msg.getDataBuffer(nSpace);
+        nBytes = recv(hSocket, pch, nSpace, MSG_DONTWAIT);
+        if (nBytes <= 0)
+            return true;
+        msg.readDataDirect(nBytes);
+        recvBufferPool.nBytesReceived += nBytes;
+        if (msg.complete())
+            MessageComplete(msg);
+        return true;
     }
 
-    return true;
+    nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes <= 0)
+        return true;
+    return ReceiveMsgBytes(pchBuf, nBytes);
+}
+
+CNetMessage::~CNetMessage()
+{
+    recvBufferPool.Release(vRecv);
 }
 
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
@@ -794,6 +986,13 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
             return -1;
 
+    // Allocate at most the first 256 KiB, like readData() allocates ahead,
+    // so a header alone cannot make us allocate a large message. A pooled
+    // buffer with room for all of it is taken if there is one, and is never
+    // moved. Oversized messages disconnect the peer.
+    if (hdr.nMessageSize <= MAX_PROTOCOL_MESSAGE_LENGTH)
+        recvBufferPool.Take(vRecv, std::min(hdr.nMessageSize, 256U * 1024), hdr.nMessageSize);
+
     // switch state to reading message data
     in_data = true;
 
@@ -807,7 +1006,9 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
     if (vRecv.size() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        unsigned int nSize = std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024);
+        recvBufferPool.Reserve(vRecv, nSize, hdr.nMessageSize);
+        vRecv.resize(nSize);
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
@@ -816,33 +1017,119 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     return nCopy;
 }
 
+char* CNetMessage::getDataBuffer(unsigned int& nBytes)
+{
+    if (vRecv.size() == nDataPos) {
+        // Allocate up to 256 KiB ahead, but never more than the total message size.
+        unsigned int nSize = std::min(hdr.nMessageSize, nDataPos + 256 * 1024);
+        recvBufferPool.Reserve(vRecv, nSize, hdr.nMessageSize);
+        vRecv.resize(nSize);
+    }
+    nBytes = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
 
+CNetPayload::CNetPayload(CSerializeData& data)
+{
+    std::shared_ptr<CSerializeData> pdata = std::make_shared<CSerializeData>();
+    pdata->swap(data);
+    owner = pdata;
+    pbegin = pdata->empty() ? NULL : &(*pdata)[0];
+    nSize = pdata->size();
+    SetChecksum();
+}
 
+CNetPayload::CNetPayload(const std::shared_ptr<const void>& ownerIn, const char* pbeginIn, size_t nSizeIn) : owner(ownerIn), pbegin(pbeginIn), nSize(nSizeIn)
+{
+    SetChecksum();
+}
 
+void CNetPayload::SetChecksum()
+{
+    uint256 hash = Hash(pbegin, pbegin + nSize);
+    nChecksum = ReadLE32(hash.begin());
+}
 
+namespace {
+#ifdef WIN32
+// Without sendmsg, every buffer takes its own send()
+static const int MAX_SEND_BUFFERS = 1;
+#else
+static const int MAX_SEND_BUFFERS = 64;
+#endif
 
+/** A part of a queued message that has not been sent yet */
+struct CSendBuffer
+{
+    const char* pch;
+    size_t nSize;
+};
 
-
+/** Send as much of the buffers, in order, as the socket takes in one call */
+int SendBuffers(SOCKET hSocket, const CSendBuffer* pBuffers, int nBuffers)
+{
+#ifdef WIN32
+    return send(hSocket, pBuffers[0].pch, pBuffers[0].nSize, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    struct iovec iov[MAX_SEND_BUFFERS];
+    for (int i = 0; i < nBuffers; i++) {
+        iov[i].iov_base = const_cast<char*>(pBuffers[i].pch);
+        iov[i].iov_len = pBuffers[i].nSize;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nBuffers;
+    return sendmsg(hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
+} // anon namespace
 
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    // Hand the queued messages to the socket up to MAX_SEND_BUFFERS buffers
+    // at a time, each message being its own bytes plus any shared payload.
+    CSendBuffer buffers[MAX_SEND_BUFFERS];
+    std::deque<CNetSendMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        int nBuffers = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CNetSendMessage>::iterator itBuf = it; itBuf != pnode->vSendMsg.end() && nBuffers < MAX_SEND_BUFFERS; ++itBuf) {
+            const CNetSendMessage& msg = *itBuf;
+            assert(msg.size() > nOffset);
+            if (nOffset < msg.data.size()) {
+                buffers[nBuffers].pch = &msg.data[nOffset];
+                buffers[nBuffers].nSize = msg.data.size() - nOffset;
+                nBuffers++;
+                nOffset = 0;
+            } else {
+                nOffset -= msg.data.size();
+            }
+            if (msg.payload && msg.payload->size() > nOffset && nBuffers < MAX_SEND_BUFFERS) {
+                buffers[nBuffers].pch = msg.payload->begin() + nOffset;
+                buffers[nBuffers].nSize = msg.payload->size() - nOffset;
+                nBuffers++;
+            }
+            nOffset = 0;
+        }
+
+        int nBytes = SendBuffers(pnode->hSocket, buffers, nBuffers);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Step past the messages sent in full
+            size_t nSent = nBytes;
+            while (it != pnode->vSendMsg.end() && nSent >= it->size() - pnode->nSendOffset) {
+                nSent -= it->size() - pnode->nSendOffset;
+                pnode->nSendSize -= it->size();
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
                 it++;
-            } else {
+            }
+            pnode->nSendOffset += nSent;
+            if (pnode->nSendOffset > 0) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -866,6 +1153,7 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    pnode->UpdateSendQueued();
 }
 
 static std::list<CNode*> vNodesDisconnected;
@@ -1043,7 +1331,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1082,208 +1370,193 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
 
     LogPrint("net", "connection from %s accepted\n", addr.ToString());
 
+    AddConnectedNode(pnode);
+}
+
+static void CheckInactivity(CNode* pnode, int64_t nTime)
+{
+    if (nTime - pnode->nTimeConnected > 60)
     {
-        LOCK(cs_vNodes);
-        vNodes.push_back(pnode);
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
     }
 }
 
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastPass = 0;
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        if (!pSocketEvents->Add(hListenSocket.socket, SOCKET_EVENT_RECV))
+            LogPrintf("Cannot wait for connections on listening socket %d\n", hListenSocket.socket);
+    }
     while (true)
     {
         //
-        // Disconnect nodes
+        // Disconnect nodes, delete disconnected nodes and check for timeouts.
+        // This looks at every node, so it runs at most once per
+        // SOCKET_EVENTS_TIMEOUT, however many sockets are ready.
         //
+        int64_t nNow = GetTimeMillis();
+        if (nNow - nLastPass >= SOCKET_EVENTS_TIMEOUT)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            std::vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            nLastPass = nNow;
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+                LOCK(cs_vNodes);
+                // Disconnect unused nodes
+                std::vector<CNode*> vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    if (pnode->fDisconnect ||
+                        (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+                    {
+                        // remove from vNodes, and from mapSocketNodes unless a new
+                        // connection has taken over its descriptor already
+                        vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                        for (std::map<SOCKET, CNode*>::iterator it = mapSocketNodes.begin(); it != mapSocketNodes.end(); ++it) {
+                            if (it->second == pnode) {
+                                mapSocketNodes.erase(it);
+                                break;
+                            }
+                        }
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                        // release outbound grant (if any)
+                        pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                        // close socket and cleanup
+                        pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+                        // hold in disconnected pool until all refs are released
+                        if (pnode->fNetworkNode || pnode->fInbound)
+                            pnode->Release();
+                        vNodesDisconnected.push_back(pnode);
+                    }
                 }
+                // Inactivity checking
+                int64_t nTime = GetTime();
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    CheckInactivity(pnode, nTime);
             }
-        }
-        {
-            // Delete disconnected nodes
-            std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                // Delete disconnected nodes
+                std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+                BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
                 {
-                    bool fDelete = false;
+                    // wait until threads are done using it
+                    if (pnode->GetRefCount() <= 0)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        bool fDelete = false;
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
+                            TRY_LOCK(pnode->cs_vSend, lockSend);
+                            if (lockSend)
                             {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
+                                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                                if (lockRecv)
+                                {
+                                    TRY_LOCK(pnode->cs_inventory, lockInv);
+                                    if (lockInv)
+                                        fDelete = true;
+                                }
                             }
                         }
-                    }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        if (fDelete)
+                        {
+                            vNodesDisconnected.remove(pnode);
+                            delete pnode;
+                        }
                     }
                 }
             }
-        }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+            if(vNodes.size() != nPrevNodeCount) {
+                nPrevNodeCount = vNodes.size();
+                uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+            }
         }
 
         //
-        // Find which sockets have data to receive
+        // Wait for the sockets to become ready
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
+        std::vector<std::pair<SOCKET, int> > vReady;
+        if (!pSocketEvents->Wait(SOCKET_EVENTS_TIMEOUT, vReady))
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
+            int nErr = WSAGetLastError();
+            LogPrintf("socket %s error %s\n", GetSocketEventsModeName(pSocketEvents->GetMode()), NetworkErrorString(nErr));
+            MilliSleep(SOCKET_EVENTS_TIMEOUT);
         }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
-
         //
-        // Accept new connections
+        // Accept new connections, and find the nodes behind the other ready sockets
         //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        std::vector<std::pair<CNode*, int> > vReadyNodes;
+        vReadyNodes.reserve(vReady.size());
+        for (size_t i = 0; i < vReady.size(); i++)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                AcceptConnection(hListenSocket);
+            const ListenSocket* pListenSocket = NULL;
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+                if (hListenSocket.socket == vReady[i].first)
+                    pListenSocket = &hListenSocket;
+            }
+            if (pListenSocket) {
+                if (vReady[i].second & SOCKET_EVENT_RECV)
+                    AcceptConnection(*pListenSocket);
+                continue;
             }
+            LOCK(cs_vNodes);
+            std::map<SOCKET, CNode*>::iterator it = mapSocketNodes.find(vReady[i].first);
+            if (it != mapSocketNodes.end())
+                vReadyNodes.push_back(std::make_pair(it->second->AddRef(), vReady[i].second));
         }
 
         //
-        // Service each socket
+        // Service each ready socket
         //
-        std::vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        for (size_t i = 0; i < vReadyNodes.size(); i++)
         {
             boost::this_thread::interruption_point();
 
+            CNode* pnode = vReadyNodes[i].first;
+            int nReadyEvents = vReadyNodes[i].second;
+
             //
             // Receive
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (nReadyEvents & (SOCKET_EVENT_RECV | SOCKET_EVENT_ERR))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
                     {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        int nBytes;
+                        bool fValid = pnode->ReceiveFromSocket(nBytes);
                         if (nBytes > 0)
                         {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (!fValid)
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            pnode->UpdateRecvFlooded();
                         }
                         else if (nBytes == 0)
                         {
@@ -1312,45 +1585,17 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (nReadyEvents & SOCKET_EVENT_SEND)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                     SocketSendData(pnode);
             }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
         }
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            for (size_t i = 0; i < vReadyNodes.size(); i++)
+                vReadyNodes[i].first->Release();
         }
     }
 }
@@ -1849,68 +2094,142 @@ bool OpenNetworkConnection(const CAddress& addrConnect, bool fCountFailure, CSem
 }
 
 
-void ThreadMessageHandler()
+namespace {
+/**
+ * Peers waiting for a message handler worker. ThreadMessageHandler queues
+ * each peer at most once (CNode::fMsgHandlerQueued), so a peer's messages
+ * are still processed, and its replies sent, by one thread at a time and in
+ * order, while a slow peer only holds up the worker handling it.
+ */
+class CMessageHandlerQueue
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
+private:
+    boost::mutex cs;
+    boost::condition_variable cond;
+    std::deque<CNode*> queue;
 
-    while (true)
+public:
+    /** Queue a peer the caller holds a reference to */
+    void Push(CNode* pnode)
     {
-        std::vector<CNode*> vNodesCopy;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
-            }
+            boost::unique_lock<boost::mutex> lock(cs);
+            queue.push_back(pnode);
         }
+        cond.notify_one();
+    }
+
+    /** Wait for a queued peer, handing over its reference */
+    CNode* Pop()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (queue.empty())
+            cond.wait(lock);
+        CNode* pnode = queue.front();
+        queue.pop_front();
+        return pnode;
+    }
+};
+
+CMessageHandlerQueue msgHandlerQueue;
+
+/** Set by a worker that left a peer with messages it can process right away */
+std::atomic<bool> fMsgHandlerMoreWork(false);
+
+/** Process a peer's received messages and send it what is due. Returns
+ *  whether it has more messages that can be processed now. */
+bool HandlePeerMessages(CNode* pnode)
+{
+    if (pnode->fDisconnect)
+        return false;
 
-        bool fSleep = true;
+    bool fMoreWork = false;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
         {
-            if (pnode->fDisconnect)
-                continue;
+            if (!GetNodeSignals().ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+            pnode->UpdateRecvFlooded();
 
-            // Receive messages
+            if (pnode->nSendSize < SendBufferSize())
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                 {
-                    if (!GetNodeSignals().ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
+                    fMoreWork = true;
                 }
             }
-            boost::this_thread::interruption_point();
+        }
+    }
+    boost::this_thread::interruption_point();
 
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    GetNodeSignals().SendMessages(pnode);
-            }
-            boost::this_thread::interruption_point();
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            GetNodeSignals().SendMessages(pnode);
+    }
+    boost::this_thread::interruption_point();
+
+    return fMoreWork;
+}
+} // anon namespace
+
+void ThreadMessageHandlerWorker()
+{
+    while (true)
+    {
+        CNode* pnode = msgHandlerQueue.Pop();
+        bool fMoreWork = HandlePeerMessages(pnode);
+
+        pnode->fMsgHandlerQueued = false;
+        {
+            LOCK(cs_vNodes);
+            pnode->Release();
         }
+        if (fMoreWork) {
+            fMsgHandlerMoreWork = true;
+            messageHandlerCondition.notify_one();
+        }
+    }
+}
 
+void ThreadMessageHandler()
+{
+    boost::mutex condition_mutex;
+    boost::unique_lock<boost::mutex> lock(condition_mutex);
+
+    while (true)
+    {
+        // Queue every peer that is not already waiting for or being handled
+        // by a worker, in the order they connected
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (pnode->fDisconnect || pnode->fMsgHandlerQueued.exchange(true))
+                    continue;
+                pnode->AddRef();
+                msgHandlerQueue.Push(pnode);
+            }
         }
+        boost::this_thread::interruption_point();
 
-        if (fSleep)
+        if (!fMsgHandlerMoreWork.exchange(false))
             messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
     }
 }
 
+void StartMessageHandler(boost::thread_group& threadGroup, int nThreads)
+{
+    nThreads = std::max(1, std::min(nThreads, MAX_MSGHAND_THREADS));
+    LogPrintf("Using %d message handler threads\n", nThreads);
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadMessageHandlerWorker));
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+}
+
 
 
 
@@ -1938,7 +2257,7 @@ bool BindListenPort(const CService &addrBind, std::string& strError, bool fWhite
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket))
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hListenSocket))
     {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
@@ -2109,6 +2428,8 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
         semOutbound = new CSemaphore(nMaxOutbound);
     }
 
+    StartSocketEvents();
+
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
@@ -2136,7 +2457,7 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    StartMessageHandler(threadGroup, GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2182,7 +2503,10 @@ public:
             delete pnode;
         vNodes.clear();
         vNodesDisconnected.clear();
+        mapSocketNodes.clear();
         vhListenSocket.clear();
+        delete pSocketEvents;
+        pSocketEvents = NULL;
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -2458,6 +2782,73 @@ bool CAddrDB::Read(CAddrMan& addr, CDataStream& ssPeers)
     return true;
 }
 
+bool CNode::RegisterSocketEvents()
+{
+    LOCK(cs_hSocket);
+    if (hSocket == INVALID_SOCKET || pSocketEvents == NULL)
+        return false;
+    int nEvents = GetSocketEvents();
+    if (!pSocketEvents->Add(hSocket, nEvents))
+        return false;
+    nSocketEvents = nEvents;
+    return true;
+}
+
+int CNode::GetSocketEvents() const
+{
+    // Implement the following logic:
+    // * If there is data to send, wait for sending data. As this only
+    //   happens when optimistic write failed, we choose to first drain the
+    //   write buffer in this case before receiving more. This avoids
+    //   needlessly queueing received data, if the remote peer is not themselves
+    //   receiving data. This means properly utilizing TCP flow control signalling.
+    // * Otherwise, if there is no (complete) message in the receive buffer,
+    //   or there is space left in the buffer, wait for receiving data.
+    // * (if neither of the above applies, there is certainly one message
+    //   in the receiver buffer ready to be processed).
+    // Together, that means that at least one of the following is always possible,
+    // so we don't deadlock:
+    // * We send some data.
+    // * We wait for data to be received (and disconnect after timeout).
+    // * We process a message in the buffer (message handler thread).
+    if (fSendQueued)
+        return SOCKET_EVENT_ERR | SOCKET_EVENT_SEND;
+    if (fRecvFlooded)
+        return SOCKET_EVENT_ERR;
+    return SOCKET_EVENT_ERR | SOCKET_EVENT_RECV;
+}
+
+void CNode::UpdateSocketEvents()
+{
+    LOCK(cs_hSocket);
+    // Not registered yet, or already closed
+    if (!nSocketEvents)
+        return;
+    int nEvents = GetSocketEvents();
+    if (nEvents != nSocketEvents && pSocketEvents->Set(hSocket, nEvents))
+        nSocketEvents = nEvents;
+}
+
+// requires LOCK(cs_vSend)
+void CNode::UpdateSendQueued()
+{
+    bool fQueued = !vSendMsg.empty();
+    if (fQueued != fSendQueued) {
+        fSendQueued = fQueued;
+        UpdateSocketEvents();
+    }
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::UpdateRecvFlooded()
+{
+    bool fFlooded = !vRecvMsg.empty() && vRecvMsg.front().complete() && GetTotalRecvSize() > ReceiveFloodSize();
+    if (fFlooded != fRecvFlooded) {
+        fRecvFlooded = fFlooded;
+        UpdateSocketEvents();
+    }
+}
+
 unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", DEFAULT_MAXRECEIVEBUFFER); }
 unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", DEFAULT_MAXSENDBUFFER); }
 
@@ -2489,6 +2880,10 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fMsgHandlerQueued = false;
+    nSocketEvents = 0;
+    fSendQueued = false;
+    fRecvFlooded = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -2538,6 +2933,8 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
 
 CNode::~CNode()
 {
+    if (nSocketEvents)
+        pSocketEvents->Remove(hSocket);
     CloseSocket(hSocket);
 
     if (pfilter)
@@ -2616,25 +3013,41 @@ void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
     unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
+    QueueMessage(pszCommand, nSize, ReadLE32(hash.begin()), CNetPayloadRef());
+}
+
+void CNode::PushSharedMessage(const char* pszCommand, const CNetPayloadRef& payload)
+{
+    BeginMessage(pszCommand);
+    if (mapArgs.count("-dropmessagestest") && GetRand(GetArg("-dropmessagestest", 2)) == 0)
+    {
+        LogPrint("net", "dropmessages DROPPING SEND MESSAGE\n");
+        AbortMessage();
+        return;
+    }
+    QueueMessage(pszCommand, payload->size(), payload->GetChecksum(), payload);
+}
+
+void CNode::QueueMessage(const char* pszCommand, unsigned int nPayloadSize, uint32_t nChecksum, const CNetPayloadRef& payload) UNLOCK_FUNCTION(cs_vSend)
+{
+    // Set the size
+    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nPayloadSize);
 
     //log total amount of bytes per command
-    mapSendBytesPerMsgCmd[std::string(pszCommand)] += nSize + CMessageHeader::HEADER_SIZE;
+    mapSendBytesPerMsgCmd[std::string(pszCommand)] += nPayloadSize + CMessageHeader::HEADER_SIZE;
 
     // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
     assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    WriteLE32((uint8_t*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], nChecksum);
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LogPrint("net", "(%d bytes) peer=%d\n", nPayloadSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    std::deque<CNetSendMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), CNetSendMessage());
+    ssSend.GetAndClear(it->data);
+    it->payload = payload;
+    nSendSize += it->size();
 
     // If write queue empty, attempt "optimistic write"
     if (it == vSendMsg.begin())
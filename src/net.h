@@ -19,6 +19,7 @@
 
 #include <atomic>
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -76,6 +77,11 @@ static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
+/** -msghandthreads default: threads that process peers' messages */
+static const int DEFAULT_MSGHAND_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHAND_THREADS = 16;
+
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
 
@@ -96,6 +102,9 @@ void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
+/** Start the message handler: a thread that hands peers with work to nThreads
+ *  worker threads, each handling one peer at a time. Part of StartNode. */
+void StartMessageHandler(boost::thread_group& threadGroup, int nThreads);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
@@ -165,6 +174,8 @@ extern CAddrMan addrman;
 
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+/** How ThreadSocketHandler waits for socket readiness (-socketevents) */
+extern SocketEventsMode nSocketEventsMode;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -217,6 +228,16 @@ public:
 
 
 
+/** Counters of the receive path since startup */
+struct CNetRecvStats
+{
+    uint64_t nBytes;            // message bytes received, headers included
+    uint64_t nBytesCopied;      // of those, bytes copied out of a read buffer
+    uint64_t nBufferAllocs;     // message buffers allocated
+    uint64_t nBufferReuses;     // message buffers taken from the pool instead
+};
+CNetRecvStats GetNetRecvStats();
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
@@ -237,6 +258,8 @@ public:
         nDataPos = 0;
         nTime = 0;
     }
+    // Hands vRecv's buffer back to the pool
+    ~CNetMessage();
 
     bool complete() const
     {
@@ -253,6 +276,64 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Room to read the message's data into directly, growing vRecv as
+     *  readData does; nBytes is set to its size. */
+    char* getDataBuffer(unsigned int& nBytes);
+    /** Account for nBytes read into getDataBuffer's buffer */
+    void readDataDirect(unsigned int nBytes) { nDataPos += nBytes; }
+};
+
+
+/**
+ * A serialized message payload that is not changed once built, with its
+ * checksum computed once. Any number of peers can queue the same one: their
+ * send queues refer to it instead of holding a copy.
+ */
+class CNetPayload
+{
+private:
+    std::shared_ptr<const void> owner;
+    const char* pbegin;
+    size_t nSize;
+    uint32_t nChecksum;
+
+    void SetChecksum();
+
+public:
+    /** Take over the bytes of a serialized message payload */
+    explicit CNetPayload(CSerializeData& data);
+    /** Refer to nSize bytes at pbeginIn, which ownerIn keeps alive */
+    CNetPayload(const std::shared_ptr<const void>& ownerIn, const char* pbeginIn, size_t nSizeIn);
+
+    const char* begin() const { return pbegin; }
+    size_t size() const { return nSize; }
+    uint32_t GetChecksum() const { return nChecksum; }
+};
+typedef std::shared_ptr<const CNetPayload> CNetPayloadRef;
+
+/** Serialize obj into a payload to push to any number of peers */
+template<typename T>
+CNetPayloadRef MakeNetPayload(const T& obj, int nType = SER_NETWORK, int nVersion = PROTOCOL_VERSION)
+{
+    CDataStream ss(nType, nVersion);
+    ss << obj;
+    CSerializeData data;
+    ss.GetAndClear(data);
+    return std::make_shared<const CNetPayload>(data);
+}
+
+/**
+ * A message in a peer's send queue: the bytes serialized for this peer (the
+ * whole message, or only the header of a shared payload), then the shared
+ * payload if there is one.
+ */
+struct CNetSendMessage
+{
+    CSerializeData data;
+    CNetPayloadRef payload;
+
+    size_t size() const { return data.size() + (payload ? payload->size() : 0); }
 };
 
 
@@ -325,11 +406,15 @@ public:
     ServiceFlags nServices;
     ServiceFlags nServicesExpected;
     SOCKET hSocket;
+    CCriticalSection cs_hSocket; // held while closing hSocket or changing nSocketEvents
+    int nSocketEvents; // events ThreadSocketHandler waits for on hSocket, 0 if not registered
+    std::atomic<bool> fSendQueued; // vSendMsg is not empty
+    std::atomic<bool> fRecvFlooded; // the receive buffer is full, stop reading
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CNetSendMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -359,6 +444,9 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Set while the node is queued for or handled by a message handler
+    // thread, so that no two threads handle it at the same time
+    std::atomic<bool> fMsgHandlerQueued;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
@@ -396,6 +484,9 @@ public:
     int nStartingHeight;
 
     // flood relay
+    // Other peers' message handlers relay addresses here, so vAddrToSend
+    // and addrKnown are protected by cs_addrSend
+    CCriticalSection cs_addrSend;
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
     bool fGetAddr;
@@ -465,6 +556,19 @@ private:
     CNode(const CNode&);
     void operator=(const CNode&);
 
+    /** Events to wait for on hSocket, from fSendQueued and fRecvFlooded */
+    int GetSocketEvents() const;
+    /** Bring the events waited for on hSocket in line with GetSocketEvents() */
+    void UpdateSocketEvents();
+
+    // requires LOCK(cs_vRecvMsg)
+    /** Book a message whose data is now complete and wake the message handler */
+    void MessageComplete(CNetMessage& msg);
+
+    /** Finish the header in ssSend for a payload of nPayloadSize bytes,
+     *  queue it with payload (if any) and release cs_vSend */
+    void QueueMessage(const char* pszCommand, unsigned int nPayloadSize, uint32_t nChecksum, const CNetPayloadRef& payload) UNLOCK_FUNCTION(cs_vSend);
+
     static uint64_t CalculateKeyedNetGroup(const CAddress& ad);
 
 public:
@@ -491,6 +595,25 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    /** recv() from the socket into vRecvMsg. A large message's data goes
+     *  straight into its buffer; smaller reads, which may hold several
+     *  messages, go through ReceiveMsgBytes. nBytes is set to what recv()
+     *  returned. Returns false if the data received is invalid. */
+    bool ReceiveFromSocket(int& nBytes);
+
+    /** Start waiting for events on hSocket; fails if the socket events
+     *  backend cannot handle it */
+    bool RegisterSocketEvents();
+
+    // requires LOCK(cs_vSend)
+    /** Wait for hSocket to become writable while vSendMsg is not empty */
+    void UpdateSendQueued();
+
+    // requires LOCK(cs_vRecvMsg)
+    /** Stop reading from hSocket while the receive buffer is full */
+    void UpdateRecvFlooded();
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -514,6 +637,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -522,6 +646,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrSend);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -571,6 +696,9 @@ public:
 
     void PushVersion();
 
+    /** Send a payload that may be queued to other peers as well. Its bytes
+     *  are neither copied nor hashed again. */
+    void PushSharedMessage(const char* pszCommand, const CNetPayloadRef& payload);
 
     void PushMessage(const char* pszCommand)
     {
@@ -25,6 +25,11 @@
 #include <arpa/inet.h>
 #endif
 #include <fcntl.h>
+#include <poll.h>
+#endif
+
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
 #endif
 
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
@@ -190,6 +195,30 @@ struct timeval MillisToTimeval(int64_t nTimeout)
     return timeout;
 }
 
+/**
+ * Wait until a single socket is readable (or writable, if fWrite is set).
+ * Returns 1 if it is, 0 on timeout and SOCKET_ERROR on failure. Unlike a bare
+ * select() this also works for descriptors above FD_SETSIZE where poll() is
+ * available.
+ */
+static int WaitForSocket(SOCKET hSocket, bool fWrite, int64_t nTimeout)
+{
+#ifdef WIN32
+    struct timeval tval = MillisToTimeval(nTimeout);
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    return select(hSocket + 1, fWrite ? NULL : &fdset, fWrite ? &fdset : NULL, NULL, &tval);
+#else
+    struct pollfd pfd;
+    pfd.fd = hSocket;
+    pfd.events = fWrite ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    int nRet = poll(&pfd, 1, nTimeout);
+    return nRet > 0 ? 1 : nRet;
+#endif
+}
+
 /**
  * Read bytes from socket. This will either read the full number of bytes requested
  * or return False on error or timeout.
@@ -218,14 +247,7 @@ bool static InterruptibleRecv(char* data, size_t len, int timeout, SOCKET& hSock
         } else { // Other error or blocking
             int nErr = WSAGetLastError();
             if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL) {
-                if (!IsSelectableSocket(hSocket)) {
-                    return false;
-                }
-                struct timeval tval = MillisToTimeval(std::min(endTime - curTime, maxWait));
-                fd_set fdset;
-                FD_ZERO(&fdset);
-                FD_SET(hSocket, &fdset);
-                int nRet = select(hSocket + 1, &fdset, NULL, NULL, &tval);
+                int nRet = WaitForSocket(hSocket, false, std::min(endTime - curTime, maxWait));
                 if (nRet == SOCKET_ERROR) {
                     return false;
                 }
@@ -426,11 +448,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL)
         {
-            struct timeval timeout = MillisToTimeval(nTimeout);
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+            int nRet = WaitForSocket(hSocket, true, nTimeout);
             if (nRet == 0)
             {
                 LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
@@ -1431,3 +1449,203 @@ bool SetSocketNonBlocking(SOCKET& hSocket, bool fNonBlocking)
 
     return true;
 }
+
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& modeOut)
+{
+    if (strMode == "select") {
+        modeOut = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#if HAVE_SYS_EPOLL_H
+    if (strMode == "epoll") {
+        modeOut = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::string GetSocketEventsModeName(SocketEventsMode mode)
+{
+    switch (mode) {
+        case SOCKETEVENTS_SELECT: return "select";
+        case SOCKETEVENTS_EPOLL: return "epoll";
+    }
+    return "unknown";
+}
+
+std::string GetSupportedSocketEventsModes()
+{
+#if HAVE_SYS_EPOLL_H
+    return "select, epoll";
+#else
+    return "select";
+#endif
+}
+
+CSocketEvents::CSocketEvents(SocketEventsMode modeIn) : mode(modeIn)
+{
+#if HAVE_SYS_EPOLL_H
+    hEpoll = -1;
+    if (mode == SOCKETEVENTS_EPOLL) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("epoll_create1 failed: %s, falling back to select\n", NetworkErrorString(WSAGetLastError()));
+            mode = SOCKETEVENTS_SELECT;
+        }
+    }
+#else
+    mode = SOCKETEVENTS_SELECT;
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#if HAVE_SYS_EPOLL_H
+    if (hEpoll != -1)
+        close(hEpoll);
+#endif
+}
+
+#if HAVE_SYS_EPOLL_H
+bool CSocketEvents::UpdateEpoll(int nOp, SOCKET hSocket, int nEvents)
+{
+    struct epoll_event event;
+    event.events = 0;
+    if (nEvents & SOCKET_EVENT_RECV)
+        event.events |= EPOLLIN;
+    if (nEvents & SOCKET_EVENT_SEND)
+        event.events |= EPOLLOUT;
+    // EPOLLERR and EPOLLHUP are always reported
+    event.data.u64 = 0;
+    event.data.fd = hSocket;
+    return epoll_ctl(hEpoll, nOp, hSocket, &event) == 0;
+}
+#endif
+
+bool CSocketEvents::Add(SOCKET hSocket, int nEvents)
+{
+    if (hSocket == INVALID_SOCKET)
+        return false;
+#if HAVE_SYS_EPOLL_H
+    if (mode == SOCKETEVENTS_EPOLL)
+        return UpdateEpoll(EPOLL_CTL_ADD, hSocket, nEvents);
+#endif
+    if (!IsSelectableSocket(hSocket))
+        return false;
+    LOCK(cs);
+    mapSockets[hSocket] = nEvents;
+    return true;
+}
+
+bool CSocketEvents::Set(SOCKET hSocket, int nEvents)
+{
+#if HAVE_SYS_EPOLL_H
+    if (mode == SOCKETEVENTS_EPOLL)
+        return UpdateEpoll(EPOLL_CTL_MOD, hSocket, nEvents);
+#endif
+    LOCK(cs);
+    std::map<SOCKET, int>::iterator it = mapSockets.find(hSocket);
+    if (it == mapSockets.end())
+        return false;
+    it->second = nEvents;
+    return true;
+}
+
+void CSocketEvents::Remove(SOCKET hSocket)
+{
+#if HAVE_SYS_EPOLL_H
+    if (mode == SOCKETEVENTS_EPOLL) {
+        UpdateEpoll(EPOLL_CTL_DEL, hSocket, 0);
+        return;
+    }
+#endif
+    LOCK(cs);
+    mapSockets.erase(hSocket);
+}
+
+bool CSocketEvents::Wait(int64_t nTimeout, std::vector<std::pair<SOCKET, int> >& vReady)
+{
+    vReady.clear();
+#if HAVE_SYS_EPOLL_H
+    if (mode == SOCKETEVENTS_EPOLL)
+        return WaitEpoll(nTimeout, vReady);
+#endif
+    return WaitSelect(nTimeout, vReady);
+}
+
+bool CSocketEvents::WaitSelect(int64_t nTimeout, std::vector<std::pair<SOCKET, int> >& vReady)
+{
+    struct timeval timeout = MillisToTimeval(nTimeout);
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    std::vector<SOCKET> vSockets;
+
+    {
+        LOCK(cs);
+        vSockets.reserve(mapSockets.size());
+        for (std::map<SOCKET, int>::const_iterator it = mapSockets.begin(); it != mapSockets.end(); ++it) {
+            if (it->second & SOCKET_EVENT_RECV)
+                FD_SET(it->first, &fdsetRecv);
+            if (it->second & SOCKET_EVENT_SEND)
+                FD_SET(it->first, &fdsetSend);
+            if (it->second & SOCKET_EVENT_ERR)
+                FD_SET(it->first, &fdsetError);
+            hSocketMax = std::max(hSocketMax, it->first);
+            vSockets.push_back(it->first);
+        }
+    }
+
+    int nSelect = select(vSockets.empty() ? 0 : hSocketMax + 1,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR) {
+        for (size_t i = 0; i < vSockets.size(); i++)
+            vReady.push_back(std::make_pair(vSockets[i], (int)SOCKET_EVENT_RECV));
+        return false;
+    }
+
+    if (nSelect > 0) {
+        for (size_t i = 0; i < vSockets.size(); i++) {
+            SOCKET hSocket = vSockets[i];
+            int nEvents = 0;
+            if (FD_ISSET(hSocket, &fdsetRecv))
+                nEvents |= SOCKET_EVENT_RECV;
+            if (FD_ISSET(hSocket, &fdsetSend))
+                nEvents |= SOCKET_EVENT_SEND;
+            if (FD_ISSET(hSocket, &fdsetError))
+                nEvents |= SOCKET_EVENT_ERR;
+            if (nEvents)
+                vReady.push_back(std::make_pair(hSocket, nEvents));
+        }
+    }
+    return true;
+}
+
+#if HAVE_SYS_EPOLL_H
+bool CSocketEvents::WaitEpoll(int64_t nTimeout, std::vector<std::pair<SOCKET, int> >& vReady)
+{
+    struct epoll_event events[256];
+    int nReady = epoll_wait(hEpoll, events, ARRAYLEN(events), nTimeout);
+    if (nReady == SOCKET_ERROR)
+        return WSAGetLastError() == WSAEINTR;
+
+    vReady.reserve(nReady);
+    for (int i = 0; i < nReady; i++) {
+        int nEvents = 0;
+        if (events[i].events & EPOLLIN)
+            nEvents |= SOCKET_EVENT_RECV;
+        if (events[i].events & EPOLLOUT)
+            nEvents |= SOCKET_EVENT_SEND;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            nEvents |= SOCKET_EVENT_ERR;
+        vReady.push_back(std::make_pair((SOCKET)events[i].data.fd, nEvents));
+    }
+    return true;
+}
+#endif
@@ -11,7 +11,9 @@
 
 #include "compat.h"
 #include "serialize.h"
+#include "sync.h"
 
+#include <map>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -23,6 +25,12 @@ extern bool fNameLookup;
 static const int DEFAULT_CONNECT_TIMEOUT = 5000;
 //! -dns default
 static const int DEFAULT_NAME_LOOKUP = true;
+//! -socketevents default
+#if HAVE_SYS_EPOLL_H
+static const char DEFAULT_SOCKETEVENTS[] = "epoll";
+#else
+static const char DEFAULT_SOCKETEVENTS[] = "select";
+#endif
 
 #ifdef WIN32
 // In MSVC, this is defined as a macro, undefine it to prevent a compile and link error
@@ -223,4 +231,80 @@ bool SetSocketNonBlocking(SOCKET& hSocket, bool fNonBlocking);
  */
 struct timeval MillisToTimeval(int64_t nTimeout);
 
+/** Readiness flags reported by (and requested from) CSocketEvents */
+enum SocketEvent
+{
+    SOCKET_EVENT_RECV = (1U << 0),
+    SOCKET_EVENT_SEND = (1U << 1),
+    SOCKET_EVENT_ERR  = (1U << 2),
+};
+
+/** Backends for CSocketEvents, selected with -socketevents */
+enum SocketEventsMode
+{
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
+
+/** Parse a -socketevents value; fails for unknown modes and modes not supported by this build */
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& modeOut);
+std::string GetSocketEventsModeName(SocketEventsMode mode);
+/** Comma-separated list of the modes supported by this build, for the help message */
+std::string GetSupportedSocketEventsModes();
+
+/**
+ * Wait for readiness on a set of sockets.
+ *
+ * A socket is registered once with Add() when it is opened and removed with
+ * Remove() before it is closed; in between, Set() changes the events it is
+ * waited for. These may be called from any thread, also while another thread
+ * is in Wait(). The epoll backend keeps the registrations in the kernel, so a
+ * Wait() costs in proportion to the number of ready sockets. The select
+ * backend rebuilds its fd_sets from every registered socket on each Wait(),
+ * so its cost grows with the number of registered sockets, and it can only
+ * handle sockets below FD_SETSIZE.
+ */
+class CSocketEvents
+{
+public:
+    explicit CSocketEvents(SocketEventsMode modeIn);
+    ~CSocketEvents();
+
+    SocketEventsMode GetMode() const { return mode; }
+
+    /** Start waiting for nEvents on hSocket. Fails if the backend cannot handle the socket. */
+    bool Add(SOCKET hSocket, int nEvents);
+    /** Change the events waited for on a socket that was added */
+    bool Set(SOCKET hSocket, int nEvents);
+    /** Stop waiting on hSocket; must be called before the socket is closed */
+    void Remove(SOCKET hSocket);
+
+    /**
+     * Wait up to nTimeout milliseconds for any registered socket to become
+     * ready, and return the ready sockets with their events in vReady.
+     * Returns false on failure. The select backend then reports every
+     * registered socket as ready for receiving, so that broken sockets get
+     * noticed.
+     */
+    bool Wait(int64_t nTimeout, std::vector<std::pair<SOCKET, int> >& vReady);
+
+private:
+    SocketEventsMode mode;
+
+    /** Registered sockets and their events, for the select backend */
+    CCriticalSection cs;
+    std::map<SOCKET, int> mapSockets;
+
+#if HAVE_SYS_EPOLL_H
+    int hEpoll;
+    bool UpdateEpoll(int nOp, SOCKET hSocket, int nEvents);
+    bool WaitEpoll(int64_t nTimeout, std::vector<std::pair<SOCKET, int> >& vReady);
+#endif
+    bool WaitSelect(int64_t nTimeout, std::vector<std::pair<SOCKET, int> >& vReady);
+
+    // Disallow copies
+    CSocketEvents(const CSocketEvents&);
+    CSocketEvents& operator=(const CSocketEvents&);
+};
+
 #endif // BITCOIN_NETBASE_H
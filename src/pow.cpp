@@ -39,17 +39,14 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHead
     return CalculateNextWorkRequired(pindexLast, 0, params);
 }
 
-unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nFirstBlockTime, const Consensus::Params& params)
+static unsigned int ComputeNextWorkRequired(const CBlockIndex* pindexLast, const Consensus::Params& params)
 {
-    if (params.fPowNoRetargeting)
-        return pindexLast->nBits;
-
-    LogPrintf("CalculateNextWorkRequired: Height (before): %s\n", pindexLast->nHeight);
+    LogPrint("pow", "CalculateNextWorkRequired: Height (before): %s\n", pindexLast->nHeight);
 
     // find first block in averaging interval
     if (pindexLast->nHeight < params.DifficultyAdjustmentInterval())
     {
-        LogPrintf("CalculateNextWorkRequired: Use default POW Limit\n");
+        LogPrint("pow", "CalculateNextWorkRequired: Use default POW Limit\n");
         return UintToArith256(params.powLimit).GetCompact();
     }
 
@@ -68,7 +65,7 @@ unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nF
     int64_t nActualTimespan = pindexLast->GetMedianTimePast() - pindexFirst->GetMedianTimePast();
     nActualTimespan = params.nPowTargetTimespan + (nActualTimespan - params.nPowTargetTimespan)/4;
 
-    LogPrintf("CalculateNextWorkRequired: nActualTimespan = %d before bounds\n", nActualTimespan);
+    LogPrint("pow", "CalculateNextWorkRequired: nActualTimespan = %d before bounds\n", nActualTimespan);
 
     if (nActualTimespan < nMinActualTimespan)
         nActualTimespan = nMinActualTimespan;
@@ -84,20 +81,32 @@ unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nF
 
     if (bnNew > bnPowLimit)
     {
-        LogPrintf("CalculateNextWorkRequired: bnNew > bnPowLimit\n");
+        LogPrint("pow", "CalculateNextWorkRequired: bnNew > bnPowLimit\n");
         bnNew = bnPowLimit;
     }
 
-    LogPrintf("CalculateNextWorkRequired: Target timespan = %d; nActualTimespan = %d\n",
-              params.nPowTargetTimespan, nActualTimespan);
-    LogPrintf("CalculateNextWorkRequired: Before: %08x  %s\n",
-              pindexLast->nBits, arith_uint256().SetCompact(pindexLast->nBits).ToString());
-    LogPrintf("CalculateNextWorkRequired: After:  %08x  %s\n",
-              bnNew.GetCompact(), bnNew.ToString());
+    LogPrint("pow", "CalculateNextWorkRequired: Target timespan = %d; nActualTimespan = %d\n",
+             params.nPowTargetTimespan, nActualTimespan);
+    LogPrint("pow", "CalculateNextWorkRequired: Before: %08x  %s\n",
+             pindexLast->nBits, arith_uint256().SetCompact(pindexLast->nBits).ToString());
+    LogPrint("pow", "CalculateNextWorkRequired: After:  %08x  %s\n",
+             bnNew.GetCompact(), bnNew.ToString());
 
     return bnNew.GetCompact();
 }
 
+unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nFirstBlockTime, const Consensus::Params& params)
+{
+    if (params.fPowNoRetargeting)
+        return pindexLast->nBits;
+
+    // Retargeting happens every block, but the result only depends on
+    // pindexLast and its ancestors, so it is worked out once per block.
+    if (!pindexLast->nBitsNext)
+        pindexLast->nBitsNext = ComputeNextWorkRequired(pindexLast, params);
+    return pindexLast->nBitsNext;
+}
+
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params& params)
 {
     bool fNegative;
@@ -214,6 +214,7 @@ static bool rest_block(HTTPRequest* req,
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
     CBlock block;
+    CBlockFileSpan span;
     CBlockIndex* pblockindex = NULL;
     {
         LOCK(cs_main);
@@ -224,12 +225,18 @@ static bool rest_block(HTTPRequest* req,
         if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
 
-        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        // Binary and hex replies are the block as stored, unless witness data is to be stripped
+        bool fRaw = rf != RF_JSON && RPCSerializationFlags() == 0;
+        if (!(fRaw && ReadRawBlockFromDisk(span, pblockindex, Params().MessageStart())) &&
+            !ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
     }
 
     CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-    ssBlock << block;
+    if (!span.IsNull())
+        ssBlock << span;
+    else
+        ssBlock << block;
 
     switch (rf) {
     case RF_BINARY: {
@@ -15,6 +15,7 @@
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -80,7 +81,7 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     result.push_back(Pair("nonce", (uint64_t)blockindex->nNonce));
     result.push_back(Pair("bits", strprintf("%08x", blockindex->nBits)));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
+    result.push_back(Pair("chainwork", blockindex->GetChainWork().GetHex()));
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
@@ -124,7 +125,7 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("nonce", (uint64_t)block.nNonce));
     result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
+    result.push_back(Pair("chainwork", blockindex->GetChainWork().GetHex()));
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
@@ -602,6 +603,14 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
+    if (!fVerbose && RPCSerializationFlags() == 0)
+    {
+        // The block as stored on disk, without deserializing it
+        CBlockFileSpan span;
+        if (ReadRawBlockFromDisk(span, pblockindex, Params().MessageStart()))
+            return HexStr(span.begin(), span.end());
+    }
+
     if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -895,6 +904,14 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
             "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
             "  \"pruneheight\": xxxxxx,    (numeric) lowest-height complete block stored\n"
+            "  \"coinsflush\": {           (object) writes of the in-memory UTXO set to disk\n"
+            "     \"background\": xx,       (boolean) if writes happen in the background (-backgroundflush)\n"
+            "     \"inprogress\": xx,       (boolean) if a background write is running now\n"
+            "     \"count\": xx,            (numeric) number of writes since startup\n"
+            "     \"lastduration\": xx,     (numeric) duration of the last write in seconds\n"
+            "     \"lastbytes\": xx,        (numeric) serialized size of the last write\n"
+            "     \"lastchanged\": xx       (numeric) number of changed transactions in the last write\n"
+            "  },\n"
             "  \"softforks\": [            (array) status of softforks in progress\n"
             "     {\n"
             "        \"id\": \"xxxx\",        (string) name of softfork\n"
@@ -932,9 +949,19 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty",            (double)GetDifficulty()));
     obj.push_back(Pair("mediantime",            (int64_t)chainActive.Tip()->GetMedianTimePast()));
     obj.push_back(Pair("verificationprogress",  Checkpoints::GuessVerificationProgress(Params().Checkpoints(), chainActive.Tip())));
-    obj.push_back(Pair("chainwork",             chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("chainwork",             chainActive.Tip()->GetChainWork().GetHex()));
     obj.push_back(Pair("pruned",                fPruneMode));
 
+    CCoinsFlushStats flushStats = pcoinsdbview->GetFlushStats();
+    UniValue coinsflush(UniValue::VOBJ);
+    coinsflush.push_back(Pair("background",     flushStats.fBackground));
+    coinsflush.push_back(Pair("inprogress",     flushStats.fInProgress));
+    coinsflush.push_back(Pair("count",          (uint64_t)flushStats.nCount));
+    coinsflush.push_back(Pair("lastduration",   flushStats.nLastDuration * 0.000001));
+    coinsflush.push_back(Pair("lastbytes",      (uint64_t)flushStats.nLastBytes));
+    coinsflush.push_back(Pair("lastchanged",    (uint64_t)flushStats.nLastChanged));
+    obj.push_back(Pair("coinsflush",            coinsflush));
+
     const Consensus::Params& consensusParams = Params().GetConsensus();
     CBlockIndex* tip = chainActive.Tip();
     UniValue softforks(UniValue::VARR);
@@ -1085,6 +1112,15 @@ UniValue mempoolInfoToJSON()
     size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
     ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+    CMempoolLoadProgress progress = GetMempoolLoadProgress();
+    ret.push_back(Pair("loaded", progress.fDone));
+    if (!progress.fDone) {
+        UniValue load(UniValue::VOBJ);
+        load.push_back(Pair("total", progress.nTotal));
+        load.push_back(Pair("processed", progress.nProcessed));
+        load.push_back(Pair("accepted", progress.nAccepted));
+        ret.push_back(Pair("loading", load));
+    }
 
     return ret;
 }
@@ -1101,7 +1137,13 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "  \"bytes\": xxxxx,              (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx,              (numeric) Total memory usage for the mempool\n"
             "  \"maxmempool\": xxxxx,         (numeric) Maximum memory usage for the mempool\n"
-            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
+            "  \"mempoolminfee\": xxxxx,      (numeric) Minimum fee for tx to be accepted\n"
+            "  \"loaded\": true|false,        (boolean) Whether the mempool saved at the last shutdown has been loaded\n"
+            "  \"loading\": {                 (json object, only while loading) Progress of loading the saved mempool\n"
+            "    \"total\": xxxxx,            (numeric) Number of saved transactions\n"
+            "    \"processed\": xxxxx,        (numeric) Number of saved transactions checked so far\n"
+            "    \"accepted\": xxxxx          (numeric) Number of those that were accepted to the mempool\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
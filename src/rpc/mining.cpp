@@ -67,7 +67,7 @@ UniValue GetNetworkHashPS(int lookup, int height) {
     if (minTime == maxTime)
         return 0;
 
-    arith_uint256 workDiff = pb->nChainWork - pb0->nChainWork;
+    arith_uint256 workDiff = pb->GetChainWork() - pb0->GetChainWork();
     int64_t timeDiff = maxTime - minTime;
 
     return workDiff.getdouble() / timeDiff;
@@ -293,10 +293,21 @@ UniValue getmininginfo(const UniValue& params, bool fHelp)
             "  \"errors\": \"...\"            (string) Current errors\n"
             "  \"generate\": true|false     (boolean) If the generation is on or off (see getgenerate or setgenerate calls)\n"
             "  \"genproclimit\": n          (numeric) The processor limit for generation. -1 if no generation. (see getgenerate or setgenerate calls)\n"
+            "  \"hashespersec\": n          (numeric) The hashes per second of the internal miner over the last few seconds, 0 if not generating\n"
             "  \"networkhashps\": nnn,      (numeric) The network hashes per second\n"
             "  \"pooledtx\": n              (numeric) The size of the mempool\n"
             "  \"testnet\": true|false      (boolean) If using testnet or not\n"
             "  \"chain\": \"xxxx\",           (string) current network name as defined in BIP70 (main, test, regtest)\n"
+            "  \"templatelatency\": {         (json object) How long creating block templates took\n"
+            "    \"bounds\": [ n, ... ],      (array of numeric) Upper bounds of the buckets, in milliseconds\n"
+            "    \"counts\": [ n, ... ]       (array of numeric) Templates per bucket, the last one for those slower than all bounds\n"
+            "  },\n"
+            "  \"templatechecks\": {          (json object) Outcomes of the template checks\n"
+            "    \"valid\": n,                (numeric) Templates that passed a background check, see -asynctemplatecheck\n"
+            "    \"invalid\": n,              (numeric) Templates that failed a background check\n"
+            "    \"stale\": n,                (numeric) Templates whose previous block was no longer the tip when their check came\n"
+            "    \"skipped\": n               (numeric) Templates not checked again, being the same block as the last one that passed\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmininginfo", "")
@@ -314,11 +325,30 @@ UniValue getmininginfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty",       (double)GetDifficulty()));
     obj.push_back(Pair("errors",           GetWarnings("statusbar")));
     obj.push_back(Pair("genproclimit",     (int)GetArg("-genproclimit", DEFAULT_GENERATE_THREADS)));
+    obj.push_back(Pair("hashespersec",     GetMinerHashesPerSec()));
     obj.push_back(Pair("networkhashps",    getnetworkhashps(params, false)));
     obj.push_back(Pair("pooledtx",         (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",          Params().TestnetToBeDeprecatedFieldRPC()));
     obj.push_back(Pair("chain",            Params().NetworkIDString()));
     obj.push_back(Pair("generate",         getgenerate(params, false)));
+
+    CBlockTemplateStats stats = GetBlockTemplateStats();
+    UniValue latency(UniValue::VOBJ);
+    UniValue bounds(UniValue::VARR);
+    BOOST_FOREACH(int64_t nBound, stats.vLatencyBoundsMs)
+        bounds.push_back(nBound);
+    UniValue counts(UniValue::VARR);
+    BOOST_FOREACH(uint64_t nCount, stats.vLatencyCounts)
+        counts.push_back(nCount);
+    latency.push_back(Pair("bounds", bounds));
+    latency.push_back(Pair("counts", counts));
+    obj.push_back(Pair("templatelatency", latency));
+    UniValue checks(UniValue::VOBJ);
+    checks.push_back(Pair("valid",         stats.nChecksValid));
+    checks.push_back(Pair("invalid",       stats.nChecksInvalid));
+    checks.push_back(Pair("stale",         stats.nChecksStale));
+    checks.push_back(Pair("skipped",       stats.nChecksSkipped));
+    obj.push_back(Pair("templatechecks", checks));
     return obj;
 }
 
@@ -613,6 +643,14 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         // Need to update only after we know CreateNewBlock succeeded
         pindexPrev = pindexPrevNew;
     }
+    // With -asynctemplatecheck the template went out before it was checked,
+    // and one that failed is not handed out again
+    if (pblocktemplate->GetCheckState() == TEMPLATE_CHECK_INVALID) {
+        pindexPrev = NULL;
+        delete pblocktemplate;
+        pblocktemplate = NULL;
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block template failed its validity check, try again");
+    }
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
     const Consensus::Params& consensusParams = Params().GetConsensus();
 
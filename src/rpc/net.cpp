@@ -430,6 +430,14 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
             "  }\n"
             "  ,...\n"
             "  ]\n"
+            "  \"blockrelaycache\": {                  (json object) recent blocks kept serialized for relay to peers\n"
+            "    \"blocks\": xxx,                       (numeric) number of blocks cached\n"
+            "    \"maxblocks\": xxx,                    (numeric) maximum number of blocks cached (-blockrelaycache)\n"
+            "    \"bytes\": xxx,                        (numeric) memory used by the cached blocks\n"
+            "    \"maxbytes\": xxx,                     (numeric) memory the cached blocks may use, beyond the most recent one\n"
+            "    \"hits\": xxx,                         (numeric) block requests served from the cache\n"
+            "    \"misses\": xxx                        (numeric) block requests that had to read or serialize the block\n"
+            "  }\n"
             "  \"warnings\": \"...\"                    (string) any network warnings (such as alert messages) \n"
             "}\n"
             "\nExamples:\n"
@@ -462,6 +470,15 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
         }
     }
     obj.push_back(Pair("localaddresses", localAddresses));
+    CBlockRelayCache::Stats relayCacheStats = blockRelayCache.GetStats();
+    UniValue relayCache(UniValue::VOBJ);
+    relayCache.push_back(Pair("blocks", (uint64_t)relayCacheStats.nBlocks));
+    relayCache.push_back(Pair("maxblocks", (uint64_t)relayCacheStats.nMaxBlocks));
+    relayCache.push_back(Pair("bytes", (uint64_t)relayCacheStats.nBytes));
+    relayCache.push_back(Pair("maxbytes", (uint64_t)relayCacheStats.nMaxBytes));
+    relayCache.push_back(Pair("hits", relayCacheStats.nHits));
+    relayCache.push_back(Pair("misses", relayCacheStats.nMisses));
+    obj.push_back(Pair("blockrelaycache", relayCache));
     obj.push_back(Pair("warnings",       GetWarnings("statusbar")));
     return obj;
 }
@@ -0,0 +1,84 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+#include "chainparams.h"
+#include "main.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <stdio.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilemap_tests, TestingSetup)
+
+static void AppendToFile(const boost::filesystem::path& path, const std::string& str)
+{
+    FILE* file = fopen(path.string().c_str(), "ab");
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(str.data(), 1, str.size(), file), str.size());
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilemap_read)
+{
+    CBlockFileMapper mapper(2);
+    boost::filesystem::path path = pathTemp / "map_test";
+    CBlockFileSpan span;
+    BOOST_CHECK(!mapper.Read(0, path, 0, 1, span));
+    BOOST_CHECK(span.IsNull());
+
+    AppendToFile(path, "0123456789");
+    BOOST_CHECK(mapper.Read(0, path, 2, 5, span));
+    BOOST_CHECK_EQUAL(std::string(span.begin(), span.end()), "23456");
+    BOOST_CHECK(!mapper.Read(0, path, 8, 5, span));
+
+    // Growing the file makes the new data readable, while spans into the
+    // old mapping stay valid
+    CBlockFileSpan spanOld = span;
+    AppendToFile(path, "abcdef");
+    BOOST_CHECK(mapper.Read(0, path, 8, 5, span));
+    BOOST_CHECK_EQUAL(std::string(span.begin(), span.end()), "89abc");
+    BOOST_CHECK_EQUAL(std::string(spanOld.begin(), spanOld.end()), "23456");
+
+    // Spans outlive forgetting and deleting the file
+    mapper.Forget(0);
+    boost::filesystem::remove(path);
+    BOOST_CHECK_EQUAL(std::string(span.begin(), span.end()), "89abc");
+    BOOST_CHECK(!mapper.Read(0, path, 0, 1, span));
+
+    // No more than the configured number of files stay mapped
+    for (int i = 1; i <= 3; i++) {
+        AppendToFile(pathTemp / strprintf("map_test%d", i), "x");
+        BOOST_CHECK(mapper.Read(i, pathTemp / strprintf("map_test%d", i), 0, 1, span));
+    }
+    BOOST_CHECK(mapper.MappedCount() <= 2);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilemap_raw_block)
+{
+    // The raw block is exactly the serialization of the deserialized one
+    LOCK(cs_main);
+    CBlockIndex* pindex = chainActive.Tip();
+    CBlockFileSpan span;
+    BOOST_REQUIRE(ReadRawBlockFromDisk(span, pindex, Params().MessageStart()));
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, pindex, Params().GetConsensus()));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    BOOST_CHECK(std::string(span.begin(), span.end()) == ss.str());
+
+    CDataStream ssSpan(SER_NETWORK, PROTOCOL_VERSION);
+    ssSpan << span;
+    BOOST_CHECK(ssSpan.str() == ss.str());
+
+    // Wrong network magic is refused
+    CMessageHeader::MessageStartChars start;
+    memcpy(start, Params().MessageStart(), sizeof(start));
+    start[0] ^= 1;
+    BOOST_CHECK(!ReadRawBlockFromDisk(span, pindex, start));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
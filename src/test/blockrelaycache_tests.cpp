@@ -0,0 +1,120 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockrelaycache.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockrelaycache_tests, BasicTestingSetup)
+
+static CNetPayloadRef MakeTestPayload(int n)
+{
+    return MakeNetPayload(std::vector<int>(1, n));
+}
+
+BOOST_AUTO_TEST_CASE(blockrelaycache_forms)
+{
+    CBlockRelayCache cache(2);
+    uint256 hash = GetRandHash();
+    BOOST_CHECK(!cache.GetPayload(hash, CBlockRelayCache::FULL_WITNESS));
+    BOOST_CHECK(!cache.GetBlock(hash));
+
+    CNetPayloadRef payload = MakeTestPayload(1);
+    cache.AddPayload(hash, CBlockRelayCache::FULL_WITNESS, payload);
+    // Peers share the very same payload
+    BOOST_CHECK(cache.GetPayload(hash, CBlockRelayCache::FULL_WITNESS) == payload);
+    BOOST_CHECK(cache.GetPayload(hash, CBlockRelayCache::FULL_WITNESS) == payload);
+    // Each form is cached separately
+    BOOST_CHECK(!cache.GetPayload(hash, CBlockRelayCache::CMPCT_WITNESS));
+    BOOST_CHECK(!cache.GetBlock(hash));
+
+    std::shared_ptr<const CBlock> pblock = std::make_shared<CBlock>();
+    cache.AddBlock(hash, pblock);
+    BOOST_CHECK(cache.GetBlock(hash) == pblock);
+    BOOST_CHECK(cache.GetPayload(hash, CBlockRelayCache::FULL_WITNESS) == payload);
+
+    CBlockRelayCache::Stats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nBlocks, 1U);
+    BOOST_CHECK_EQUAL(stats.nMaxBlocks, 2U);
+    BOOST_CHECK_EQUAL(stats.nHits, 3U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 2U);
+
+    cache.Clear();
+    BOOST_CHECK(!cache.GetPayload(hash, CBlockRelayCache::FULL_WITNESS));
+    stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nBlocks, 0U);
+    BOOST_CHECK_EQUAL(stats.nHits, 0U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(blockrelaycache_lru)
+{
+    CBlockRelayCache cache(3);
+    std::vector<uint256> hashes;
+    for (int i = 0; i < 5; i++)
+        hashes.push_back(GetRandHash());
+
+    for (int i = 0; i < 3; i++)
+        cache.AddPayload(hashes[i], CBlockRelayCache::FULL_NO_WITNESS, MakeTestPayload(i));
+    // Using the oldest block keeps it over the next oldest
+    BOOST_CHECK(cache.GetPayload(hashes[0], CBlockRelayCache::FULL_NO_WITNESS));
+    cache.AddPayload(hashes[3], CBlockRelayCache::FULL_NO_WITNESS, MakeTestPayload(3));
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 3U);
+    BOOST_CHECK(cache.GetPayload(hashes[0], CBlockRelayCache::FULL_NO_WITNESS));
+    BOOST_CHECK(!cache.GetPayload(hashes[1], CBlockRelayCache::FULL_NO_WITNESS));
+    BOOST_CHECK(cache.GetPayload(hashes[2], CBlockRelayCache::FULL_NO_WITNESS));
+    BOOST_CHECK(cache.GetPayload(hashes[3], CBlockRelayCache::FULL_NO_WITNESS));
+
+    // Adding another form of a cached block evicts nothing
+    cache.AddPayload(hashes[2], CBlockRelayCache::CMPCT_NO_WITNESS, MakeTestPayload(2));
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 3U);
+
+    // Shrinking drops the least recently used blocks
+    cache.SetMaxBlocks(1);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 1U);
+    BOOST_CHECK(cache.GetPayload(hashes[2], CBlockRelayCache::CMPCT_NO_WITNESS));
+    cache.AddPayload(hashes[4], CBlockRelayCache::FULL_NO_WITNESS, MakeTestPayload(4));
+    BOOST_CHECK(!cache.GetPayload(hashes[2], CBlockRelayCache::CMPCT_NO_WITNESS));
+    BOOST_CHECK(cache.GetPayload(hashes[4], CBlockRelayCache::FULL_NO_WITNESS));
+
+    // At least one block is always kept
+    cache.SetMaxBlocks(0);
+    BOOST_CHECK_EQUAL(cache.GetStats().nMaxBlocks, 1U);
+    BOOST_CHECK(cache.GetPayload(hashes[4], CBlockRelayCache::FULL_NO_WITNESS));
+}
+
+BOOST_AUTO_TEST_CASE(blockrelaycache_bytes)
+{
+    CBlockRelayCache cache(10, 10000);
+    std::vector<uint256> hashes;
+    for (int i = 0; i < 3; i++)
+        hashes.push_back(GetRandHash());
+
+    // Payloads of 4004 bytes each: two fit, a third pushes the oldest out
+    CNetPayloadRef payload = MakeNetPayload(std::vector<int>(1000, 1));
+    cache.AddPayload(hashes[0], CBlockRelayCache::FULL_WITNESS, payload);
+    cache.AddPayload(hashes[1], CBlockRelayCache::FULL_WITNESS, payload);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBytes, 2 * payload->size());
+    cache.AddPayload(hashes[2], CBlockRelayCache::FULL_WITNESS, payload);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 2U);
+    BOOST_CHECK(!cache.GetPayload(hashes[0], CBlockRelayCache::FULL_WITNESS));
+
+    // More forms of one block count towards the limit as well
+    cache.AddPayload(hashes[2], CBlockRelayCache::FULL_NO_WITNESS, payload);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 1U);
+    BOOST_CHECK(cache.GetPayload(hashes[2], CBlockRelayCache::FULL_WITNESS));
+
+    // The most recent block is kept even when it is larger than the limit
+    cache.AddPayload(hashes[2], CBlockRelayCache::CMPCT_WITNESS, payload);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 1U);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBytes, 3 * payload->size());
+
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.GetStats().nBytes, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
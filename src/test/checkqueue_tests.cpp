@@ -0,0 +1,89 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "test/test_bitcoin.h"
+
+#include <atomic>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+static std::atomic<int> nChecksRun;
+
+struct CountingCheck
+{
+    bool fResult;
+
+    CountingCheck() : fResult(true) {}
+    explicit CountingCheck(bool fResultIn) : fResult(fResultIn) {}
+
+    bool operator()()
+    {
+        nChecksRun++;
+        return fResult;
+    }
+
+    void swap(CountingCheck& check) { std::swap(fResult, check.fResult); }
+};
+
+static void RunChecks(CCheckQueue<CountingCheck>& queue, int nChecks, int nFailAt, bool fExpected)
+{
+    nChecksRun = 0;
+    {
+        CCheckQueueControl<CountingCheck> control(&queue);
+        for (int i = 0; i < nChecks; ) {
+            // Vary the batch sizes, as transactions with different numbers of inputs would
+            std::vector<CountingCheck> vChecks;
+            for (int j = 0; j <= i % 7 && i < nChecks; j++, i++)
+                vChecks.push_back(CountingCheck(i != nFailAt));
+            control.Add(vChecks);
+        }
+        BOOST_CHECK_EQUAL(control.Wait(), fExpected);
+    }
+    if (fExpected)
+        BOOST_CHECK_EQUAL(nChecksRun, nChecks);
+    BOOST_CHECK(queue.IsIdle());
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_results)
+{
+    for (int nThreads = 0; nThreads <= 8; nThreads += 4) {
+        CCheckQueue<CountingCheck> queue(16, 4);
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<CountingCheck>::Thread, boost::ref(queue)));
+
+        // The queue can be reused, and one failure does not leak into the next round
+        for (int nRound = 0; nRound < 10; nRound++) {
+            RunChecks(queue, 1000, -1, true);
+            RunChecks(queue, 1000, nRound * 97, false);
+            RunChecks(queue, 1, -1, true);
+            RunChecks(queue, 0, -1, true);
+        }
+
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_worker_churn)
+{
+    // Workers coming and going must not strand any queued checks
+    CCheckQueue<CountingCheck> queue(16, 2);
+    for (int nRound = 0; nRound < 5; nRound++) {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nRound; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<CountingCheck>::Thread, boost::ref(queue)));
+        RunChecks(queue, 500, -1, true);
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+    RunChecks(queue, 500, -1, true);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
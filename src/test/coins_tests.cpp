@@ -9,6 +9,7 @@
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 #include "main.h"
+#include "txdb.h"
 #include "consensus/validation.h"
 
 #include <vector>
@@ -415,4 +416,162 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     }
 }
 
+BOOST_FIXTURE_TEST_CASE(ccoins_background_flush, TestingSetup)
+{
+    // Flushed entries stay visible while the background thread writes them,
+    // and after it is done.
+    pcoinsdbview->StartBackgroundFlush();
+    CCoinsViewCache cache(pcoinsdbview);
+    std::vector<uint256> txids;
+    for (int i = 0; i < 1000; i++) {
+        txids.push_back(GetRandHash());
+        CCoinsModifier coins = cache.ModifyNewCoins(txids.back(), false);
+        coins->vout.resize(1);
+        coins->vout[0].nValue = i;
+    }
+    uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(pcoinsdbview->GetBestBlock() == hashBlock);
+    for (int i = 0; i < 1000; i++) {
+        CCoins coins;
+        BOOST_CHECK(pcoinsdbview->GetCoins(txids[i], coins) && coins.vout[0].nValue == i);
+    }
+    BOOST_CHECK(pcoinsdbview->WaitForFlush());
+    CCoinsFlushStats stats = pcoinsdbview->GetFlushStats();
+    BOOST_CHECK(stats.fBackground && !stats.fInProgress);
+    BOOST_CHECK_EQUAL(stats.nLastChanged, 1000U);
+    BOOST_CHECK(stats.nLastBytes > 1000U * 32);
+
+    // Spends are visible in the same way
+    for (int i = 0; i < 500; i++)
+        cache.ModifyCoins(txids[i])->Clear();
+    hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+    for (int i = 0; i < 1000; i++)
+        BOOST_CHECK_EQUAL(pcoinsdbview->HaveCoins(txids[i]), i >= 500);
+    BOOST_CHECK(pcoinsdbview->WaitForFlush());
+    BOOST_CHECK(pcoinsdbview->GetBestBlock() == hashBlock);
+    for (int i = 0; i < 1000; i++)
+        BOOST_CHECK_EQUAL(pcoinsdbview->HaveCoins(txids[i]), i >= 500);
+    BOOST_CHECK_EQUAL(pcoinsdbview->GetFlushStats().nLastChanged, 500U);
+}
+
+/** Coin database that can also write the per-transaction records of older versions */
+class CCoinsViewDBLegacy : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBLegacy() : CCoinsViewDB(1 << 20, true, true) {}
+
+    void WriteLegacy(const uint256& txid, const CCoins& coins)
+    {
+        db.Write(std::make_pair('c', txid), coins);
+    }
+};
+
+static CCoins RandomCoins(unsigned int nOutputs)
+{
+    CCoins coins;
+    coins.nVersion = 1 + insecure_rand() % 2;
+    coins.nHeight = insecure_rand() % 100000;
+    coins.fCoinBase = insecure_rand() & 1;
+    coins.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        // Some outputs are spent already, but never the last one
+        if (i + 1 < nOutputs && insecure_rand() % 4 == 0)
+            continue;
+        coins.vout[i].nValue = insecure_rand();
+        coins.vout[i].scriptPubKey = CScript() << OP_DUP << ToByteVector(GetRandHash()) << OP_EQUAL;
+    }
+    return coins;
+}
+
+BOOST_FIXTURE_TEST_CASE(ccoins_db_per_output, TestingSetup)
+{
+    CCoinsViewDBLegacy view;
+    CCoinsViewCache cache(&view);
+    uint256 txid = GetRandHash();
+    {
+        CCoinsModifier coins = cache.ModifyNewCoins(txid, false);
+        coins->nVersion = 2;
+        coins->nHeight = 100;
+        coins->vout.resize(100);
+        for (unsigned int i = 0; i < 100; i++) {
+            coins->vout[i].nValue = i + 1;
+            coins->vout[i].scriptPubKey = CScript() << OP_TRUE;
+        }
+    }
+    BOOST_CHECK(cache.Flush());
+    size_t nBytesCreate = view.GetFlushStats().nLastBytes;
+
+    // Spending an output only removes its own record
+    BOOST_CHECK(cache.ModifyCoins(txid)->Spend(7));
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(view.GetFlushStats().nLastBytes * 50 < nBytesCreate);
+    CCoins coins;
+    BOOST_CHECK(view.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.nVersion, 2);
+    BOOST_CHECK_EQUAL(coins.nHeight, 100U);
+    BOOST_CHECK_EQUAL(coins.vout.size(), 100U);
+    BOOST_CHECK(coins.vout[7].IsNull());
+    BOOST_CHECK_EQUAL(coins.vout[8].nValue, 9);
+
+    // Restoring it, as disconnecting a block does, writes it again
+    {
+        CCoinsModifier modify = cache.ModifyCoins(txid);
+        modify->vout[7].nValue = 8;
+        modify->vout[7].scriptPubKey = CScript() << OP_TRUE;
+        modify->fOutputsChanged = true;
+    }
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(view.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.vout[7].nValue, 8);
+
+    for (unsigned int i = 50; i < 100; i++)
+        BOOST_CHECK(cache.ModifyCoins(txid)->Spend(i));
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(view.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.vout.size(), 50U);
+
+    for (unsigned int i = 0; i < 50; i++)
+        cache.ModifyCoins(txid)->Spend(i);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!view.HaveCoins(txid));
+    BOOST_CHECK(!view.GetCoins(txid, coins));
+}
+
+BOOST_FIXTURE_TEST_CASE(ccoins_db_upgrade, TestingSetup)
+{
+    seed_insecure_rand(true);
+    CCoinsViewDBLegacy view;
+    std::map<uint256, CCoins> mapExpected;
+    for (int i = 0; i < 300; i++) {
+        uint256 txid = GetRandHash();
+        mapExpected[txid] = RandomCoins(1 + insecure_rand() % 20);
+        view.WriteLegacy(txid, mapExpected[txid]);
+    }
+    BOOST_CHECK(!view.HaveCoins(mapExpected.begin()->first));
+
+    BOOST_CHECK(view.Upgrade());
+    for (std::map<uint256, CCoins>::const_iterator it = mapExpected.begin(); it != mapExpected.end(); ++it) {
+        CCoins coins;
+        BOOST_CHECK(view.GetCoins(it->first, coins) && coins == it->second);
+    }
+
+    // The cursor gathers the outputs of each transaction again
+    std::map<uint256, CCoins> mapFound;
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(view.Cursor());
+    for (; pcursor->Valid(); pcursor->Next()) {
+        uint256 txid;
+        CCoins coins;
+        BOOST_CHECK(pcursor->GetKey(txid) && pcursor->GetValue(coins));
+        mapFound[txid] = coins;
+    }
+    BOOST_CHECK(mapFound == mapExpected);
+
+    // Nothing is left to convert
+    BOOST_CHECK(view.Upgrade());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,125 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+typedef CCuckooCache<uint256, CSignatureCacheHasher> CTestCache;
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+static std::vector<uint256> RandomHashes(size_t n)
+{
+    std::vector<uint256> v(n);
+    for (size_t i = 0; i < n; i++) {
+        for (unsigned int* p = (unsigned int*)v[i].begin(); p < (unsigned int*)v[i].end(); p++)
+            *p = insecure_rand();
+    }
+    return v;
+}
+
+/** Fraction of v still present in the cache. */
+static double HitRate(const CTestCache& cache, const std::vector<uint256>& v, size_t nBegin, size_t nEnd)
+{
+    size_t nHits = 0;
+    for (size_t i = nBegin; i < nEnd; i++)
+        nHits += cache.Contains(v[i], false);
+    return (double)nHits / (nEnd - nBegin);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_empty)
+{
+    // An unsized cache (e.g. -maxsigcachesize=0) stores nothing
+    CTestCache cache;
+    uint256 h = GetRandHash();
+    cache.Insert(h);
+    BOOST_CHECK(!cache.Contains(h, false));
+    BOOST_CHECK_EQUAL(cache.SetupBytes(0), 0U);
+    cache.Insert(h);
+    BOOST_CHECK(!cache.Contains(h, false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_hits)
+{
+    seed_insecure_rand(true);
+    CTestCache cache;
+    uint32_t nSize = cache.SetupBytes(1 << 20);
+    BOOST_CHECK(nSize > 0 && nSize * sizeof(uint256) <= (1 << 20));
+
+    // Well below capacity everything fits, and nothing else is found
+    std::vector<uint256> v = RandomHashes(nSize);
+    for (size_t i = 0; i < nSize / 2; i++)
+        cache.Insert(v[i]);
+    BOOST_CHECK_EQUAL(HitRate(cache, v, 0, nSize / 2), 1.0);
+    BOOST_CHECK_EQUAL(HitRate(cache, v, nSize / 2, nSize), 0.0);
+
+    // Inserting twice the capacity keeps most of the recent entries
+    std::vector<uint256> v2 = RandomHashes(2 * nSize);
+    for (size_t i = 0; i < v2.size(); i++)
+        cache.Insert(v2[i]);
+    BOOST_CHECK(HitRate(cache, v2, v2.size() - nSize / 4, v2.size()) > 0.95);
+    BOOST_CHECK(HitRate(cache, v2, v2.size() - nSize / 2, v2.size()) > 0.80);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erase)
+{
+    seed_insecure_rand(true);
+    CTestCache cache;
+    uint32_t nSize = cache.Setup(1 << 14);
+    std::vector<uint256> v = RandomHashes(nSize / 2);
+    for (size_t i = 0; i < v.size(); i++)
+        cache.Insert(v[i]);
+
+    // Erasing only marks the slot: the entry stays until its slot is reused
+    for (size_t i = 0; i < v.size() / 2; i++)
+        BOOST_CHECK(cache.Contains(v[i], true));
+    BOOST_CHECK_EQUAL(HitRate(cache, v, 0, v.size()), 1.0);
+
+    // New entries reuse erased slots first, so the kept half survives better
+    std::vector<uint256> v2 = RandomHashes(nSize / 2);
+    for (size_t i = 0; i < v2.size(); i++)
+        cache.Insert(v2[i]);
+    double nErasedHits = HitRate(cache, v, 0, v.size() / 2);
+    double nKeptHits = HitRate(cache, v, v.size() / 2, v.size());
+    BOOST_CHECK(nKeptHits > 0.75);
+    BOOST_CHECK(nErasedHits < nKeptHits);
+}
+
+static void ReadLoop(const CTestCache* cache, const std::vector<uint256>* vAbsent, std::atomic<int>* nFalseHits, std::atomic<bool>* fDone)
+{
+    while (!*fDone) {
+        for (size_t i = 0; i < vAbsent->size(); i++)
+            *nFalseHits += cache->Contains((*vAbsent)[i], i & 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_concurrent_reads)
+{
+    // Readers racing with a writer may miss entries, but must never find
+    // something that was not inserted.
+    seed_insecure_rand(true);
+    CTestCache cache;
+    uint32_t nSize = cache.Setup(1 << 12);
+    std::vector<uint256> vAbsent = RandomHashes(256);
+    std::vector<uint256> vInsert = RandomHashes(8 * nSize);
+    std::atomic<int> nFalseHits(0);
+    std::atomic<bool> fDone(false);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 4; i++)
+        threadGroup.create_thread(boost::bind(&ReadLoop, &cache, &vAbsent, &nFalseHits, &fDone));
+    for (size_t i = 0; i < vInsert.size(); i++)
+        cache.Insert(vInsert[i]);
+    fDone = true;
+    threadGroup.join_all();
+    BOOST_CHECK_EQUAL(nFalseHits, 0);
+    BOOST_CHECK(HitRate(cache, vInsert, vInsert.size() - nSize / 4, vInsert.size()) > 0.95);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
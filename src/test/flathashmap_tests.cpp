@@ -0,0 +1,127 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "flathashmap.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <map>
+
+#include <boost/test/unit_test.hpp>
+
+/** Deliberately weak hash, so that probe sequences collide and wrap. */
+struct CCollidingHasher
+{
+    size_t operator()(uint32_t n) const { return n & 0xFF; }
+};
+
+typedef flathashmap<uint32_t, std::string, CCollidingHasher> CTestMap;
+
+BOOST_FIXTURE_TEST_SUITE(flathashmap_tests, BasicTestingSetup)
+
+static void CheckEqual(const CTestMap& map, const std::map<uint32_t, std::string>& ref)
+{
+    BOOST_CHECK_EQUAL(map.size(), ref.size());
+    BOOST_CHECK_EQUAL(map.empty(), ref.empty());
+    std::map<uint32_t, std::string> seen;
+    for (CTestMap::const_iterator it = map.begin(); it != map.end(); ++it)
+        BOOST_CHECK(seen.insert(*it).second);
+    BOOST_CHECK(seen == ref);
+    for (std::map<uint32_t, std::string>::const_iterator it = ref.begin(); it != ref.end(); ++it) {
+        CTestMap::const_iterator found = map.find(it->first);
+        BOOST_CHECK(found != map.end() && found->second == it->second);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_random)
+{
+    seed_insecure_rand(true);
+    CTestMap map;
+    std::map<uint32_t, std::string> ref;
+    for (int i = 0; i < 20000; i++) {
+        uint32_t key = insecure_rand() % 2000;
+        switch (insecure_rand() % 4) {
+        case 0:
+        case 1: {
+            std::string value = std::to_string(insecure_rand());
+            bool fNew = map.insert(std::make_pair(key, value)).second;
+            BOOST_CHECK_EQUAL(fNew, ref.insert(std::make_pair(key, value)).second);
+            break;
+        }
+        case 2:
+            BOOST_CHECK_EQUAL(map.erase(key), ref.erase(key));
+            break;
+        case 3:
+            map[key] += "x";
+            ref[key] += "x";
+            break;
+        }
+        BOOST_CHECK_EQUAL(map.count(key), ref.count(key));
+        if (i % 1000 == 0)
+            CheckEqual(map, ref);
+    }
+    CheckEqual(map, ref);
+    map.clear();
+    BOOST_CHECK(map.empty() && map.begin() == map.end());
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_stability)
+{
+    // Elements do not move when others are inserted or erased
+    CTestMap map;
+    std::vector<std::string*> vPtr;
+    for (uint32_t i = 0; i < 1000; i++)
+        vPtr.push_back(&map[i]);
+    for (uint32_t i = 0; i < 1000; i += 2)
+        map.erase(i);
+    for (uint32_t i = 1000; i < 5000; i++)
+        map[i] = "new";
+    for (uint32_t i = 1; i < 1000; i += 2)
+        BOOST_CHECK(&map.find(i)->second == vPtr[i]);
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_insert_existing)
+{
+    // A key that is present already does not grow the index, even when the
+    // map is at the load where a new key would
+    CTestMap map;
+    for (uint32_t i = 0; i < 12; i++)
+        map[i] = "value";
+    size_t nUsage = memusage::DynamicUsage(map);
+    for (uint32_t i = 0; i < 12; i++)
+        BOOST_CHECK(!map.insert(std::make_pair(i, std::string("other"))).second);
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), nUsage);
+    BOOST_CHECK_EQUAL(map.find(5)->second, "value");
+    map[12] = "value";
+    BOOST_CHECK(memusage::DynamicUsage(map) > nUsage);
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_erase_iterating)
+{
+    CTestMap map;
+    for (uint32_t i = 0; i < 1000; i++)
+        map[i] = "value";
+    size_t nErased = 0;
+    for (CTestMap::iterator it = map.begin(); it != map.end();) {
+        if (it->first % 3 == 0) {
+            map.erase(it++);
+            nErased++;
+        } else {
+            ++it;
+        }
+    }
+    BOOST_CHECK_EQUAL(nErased, 334U);
+    BOOST_CHECK_EQUAL(map.size(), 1000U - nErased);
+    for (uint32_t i = 0; i < 1000; i++)
+        BOOST_CHECK_EQUAL(map.count(i), i % 3 != 0);
+
+    // Freed nodes are reused before new memory is allocated
+    size_t nUsage = memusage::DynamicUsage(map);
+    for (uint32_t i = 0; i < 1000; i += 3)
+        map[i] = "again";
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), nUsage);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,11 +2,18 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
 #include "chainparams.h"
+#include "clientversion.h"
+#include "consensus/validation.h"
 #include "main.h"
+#include "pow.h"
+#include "streams.h"
+#include "txdb.h"
 
 #include "test/test_bitcoin.h"
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -72,4 +79,215 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_FIXTURE_TEST_CASE(block_index_upgrade, TestChain100Setup)
+{
+    // Rewrite the stored block index in the old layout, keyed by hash only
+    LOCK(cs_main);
+    FlushStateToDisk();
+    const int nHeight = chainActive.Height();
+    const size_t nEntries = mapBlockIndex.size();
+    CDBBatch batch(*pblocktree);
+    boost::scoped_ptr<CDBIterator> pcursor(pblocktree->NewIterator());
+    for (pcursor->Seek('h'); pcursor->Valid(); pcursor->Next()) {
+        std::pair<char, std::pair<uint32_t, uint256> > key;
+        if (!pcursor->GetKey(key) || key.first != 'h')
+            break;
+        batch.Erase(key);
+    }
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it)
+        batch.Write(std::make_pair('b', it->first), CDiskBlockIndex(it->second));
+    BOOST_CHECK(pblocktree->WriteBatch(batch));
+    pcursor.reset();
+
+    UnloadBlockIndex();
+    BOOST_CHECK(LoadBlockIndex());
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nEntries);
+    BOOST_CHECK_EQUAL(chainActive.Height(), nHeight);
+    for (int i = 1; i <= chainActive.Height(); i++)
+        BOOST_CHECK(chainActive[i]->pprev == chainActive[i - 1]);
+    BOOST_CHECK(!pblocktree->Exists(std::make_pair('b', chainActive.Tip()->GetBlockHash())));
+
+    // Loading again uses the new layout
+    UnloadBlockIndex();
+    BOOST_CHECK(LoadBlockIndex());
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nEntries);
+    BOOST_CHECK_EQUAL(chainActive.Height(), nHeight);
+}
+
+BOOST_AUTO_TEST_CASE(block_index_chain_work)
+{
+    // Chain work is kept in 128 bits, both halves of which have to survive
+    CBlockIndex index;
+    arith_uint256 work = (arith_uint256(0x0123456789abcdefULL) << 64) | arith_uint256(0xfedcba9876543210ULL);
+    index.SetChainWork(work);
+    BOOST_CHECK(index.GetChainWork() == work);
+    BOOST_CHECK_EQUAL(index.GetChainWork().GetHex(), "00000000000000000000000000000000" "0123456789abcdeffedcba9876543210");
+    index.SetChainWork(0);
+    BOOST_CHECK(index.GetChainWork() == 0);
+}
+
+static void CheckSameIndex(const std::map<uint256, std::pair<uint256, arith_uint256> >& mapExpected)
+{
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), mapExpected.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex) {
+        std::map<uint256, std::pair<uint256, arith_uint256> >::const_iterator it = mapExpected.find(item.first);
+        BOOST_CHECK(it != mapExpected.end() && item.second->GetChainWork() == it->second.second &&
+            (item.second->pskip ? item.second->pskip->GetBlockHash() : uint256()) == it->second.first);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(block_index_snapshot, TestChain100Setup)
+{
+    LOCK(cs_main);
+    FlushStateToDisk();
+    const int nHeight = chainActive.Height();
+    std::map<uint256, std::pair<uint256, arith_uint256> > mapExpected;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        mapExpected[item.first] = std::make_pair(item.second->pskip ? item.second->pskip->GetBlockHash() : uint256(), item.second->GetChainWork());
+
+    // The snapshot is used once
+    uint256 tag;
+    BOOST_CHECK(WriteBlockIndexSnapshot());
+    BOOST_CHECK(pblocktree->ReadSnapshotTag(tag));
+    UnloadBlockIndex();
+    BOOST_CHECK(LoadBlockIndex());
+    BOOST_CHECK(!pblocktree->ReadSnapshotTag(tag));
+    BOOST_CHECK_EQUAL(chainActive.Height(), nHeight);
+    CheckSameIndex(mapExpected);
+
+    // A damaged snapshot is ignored
+    BOOST_CHECK(WriteBlockIndexSnapshot());
+    boost::filesystem::path path = GetDataDir() / "blockindex.dat";
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    BOOST_REQUIRE(file);
+    fseek(file, 100, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, 100, SEEK_SET);
+    fputc(c ^ 1, file);
+    fclose(file);
+    UnloadBlockIndex();
+    BOOST_CHECK(LoadBlockIndex());
+    BOOST_CHECK_EQUAL(chainActive.Height(), nHeight);
+    CheckSameIndex(mapExpected);
+}
+
+/** A header building on hashPrev, with (regtest) proof of work or without. */
+static CBlockHeader MakeHeader(const uint256& hashPrev, uint32_t nTime, bool fValidPoW)
+{
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.hashPrevBlock = hashPrev;
+    header.nTime = nTime;
+    header.nBits = UintToArith256(Params().GetConsensus().powLimit).GetCompact();
+    while (CheckProofOfWork(header.GetHash(), header.nBits, Params().GetConsensus()) != fValidPoW)
+        header.nNonce++;
+    return header;
+}
+
+BOOST_FIXTURE_TEST_CASE(block_headers_batch, TestChain100Setup)
+{
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    std::vector<CBlockHeader> headers;
+    uint256 hashPrev = pindexTip->GetBlockHash();
+    for (int i = 0; i < 30; i++) {
+        // Header 15 fails its proof of work
+        headers.push_back(MakeHeader(hashPrev, pindexTip->nTime + 1 + i, i != 15));
+        hashPrev = headers.back().GetHash();
+    }
+
+    // A valid run is accepted in full
+    CValidationState state;
+    CBlockIndex* pindexLast = NULL;
+    BOOST_CHECK(ProcessNewBlockHeaders(std::vector<CBlockHeader>(headers.begin(), headers.begin() + 10), state, Params(), &pindexLast));
+    BOOST_REQUIRE(pindexLast);
+    BOOST_CHECK(pindexLast->GetBlockHash() == headers[9].GetHash());
+    BOOST_CHECK_EQUAL(pindexLast->nHeight, pindexTip->nHeight + 10);
+
+    // Headers before an invalid one are kept, the rest is dropped
+    BOOST_CHECK(!ProcessNewBlockHeaders(std::vector<CBlockHeader>(headers.begin() + 5, headers.end()), state, Params(), &pindexLast));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "high-hash");
+    BOOST_CHECK(pindexLast->GetBlockHash() == headers[14].GetHash());
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(mapBlockIndex.count(headers[14].GetHash()));
+        BOOST_CHECK(!mapBlockIndex.count(headers[15].GetHash()));
+        BOOST_CHECK(!mapBlockIndex.count(headers[16].GetHash()));
+    }
+
+    // So are headers after a gap in the sequence
+    std::vector<CBlockHeader> gap(headers.begin() + 10, headers.begin() + 15);
+    gap.push_back(headers[16]);
+    int nDoS = 0;
+    BOOST_CHECK(!ProcessNewBlockHeaders(gap, state, Params()));
+    BOOST_CHECK(state.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 20);
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-prevblk");
+}
+
+/** Forget the block index and chain state, as -reindex does before it reads the block files */
+static void ResetChainState()
+{
+    FlushStateToDisk();
+    UnloadBlockIndex();
+    delete pcoinsTip;
+    delete pcoinsdbview;
+    delete pblocktree;
+    pblocktree = new CBlockTreeDB(1 << 20, true);
+    pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+    pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+}
+
+BOOST_FIXTURE_TEST_CASE(reindex_out_of_order, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    std::vector<CBlock> vBlocks;
+    {
+        LOCK(cs_main);
+        for (int i = 0; i <= chainActive.Height(); i++) {
+            CBlock block;
+            BOOST_REQUIRE(ReadBlockFromDisk(block, chainActive[i], chainparams.GetConsensus()));
+            vBlocks.push_back(block);
+        }
+    }
+    ResetChainState();
+
+    // Rewrite the chain as three block files. The last third of the chain
+    // is in the first file, and every file is in reverse order, so all
+    // blocks but the genesis block are read before their parent and wait
+    // in mapBlocksUnknownParent.
+    const int nFiles = 3;
+    std::vector<boost::filesystem::path> vFiles;
+    std::vector<int> vBlockFile(vBlocks.size());
+    for (int nFile = 0; nFile < nFiles; nFile++) {
+        boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+        int nBegin = (nFiles - 1 - nFile) * vBlocks.size() / nFiles;
+        int nEnd = (nFiles - nFile) * vBlocks.size() / nFiles;
+        for (int i = nEnd - 1; i >= nBegin; i--) {
+            unsigned int nSize = fileout.GetSerializeSize(vBlocks[i]);
+            fileout << FLATDATA(chainparams.MessageStart()) << nSize << vBlocks[i];
+            vBlockFile[i] = nFile;
+        }
+        vFiles.push_back(path);
+    }
+
+    mapArgs["-importthreads"] = "3";
+    BOOST_CHECK(LoadExternalBlockFiles(chainparams, vFiles, true));
+    mapArgs.erase("-importthreads");
+
+    // The whole chain is connected, from where the files hold the blocks
+    LOCK(cs_main);
+    BOOST_REQUIRE_EQUAL(chainActive.Height(), (int)vBlocks.size() - 1);
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        CBlockIndex* pindex = chainActive[i];
+        BOOST_CHECK(pindex->GetBlockHash() == vBlocks[i].GetHash());
+        BOOST_CHECK_EQUAL(pindex->nFile, vBlockFile[i]);
+        CBlock block;
+        BOOST_CHECK(ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()));
+        BOOST_CHECK(block.GetHash() == vBlocks[i].GetHash());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
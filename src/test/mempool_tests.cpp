@@ -2,7 +2,11 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
 #include "policy/policy.h"
+#include "script/interpreter.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -578,4 +582,59 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_FIXTURE_TEST_CASE(MempoolPersistTest, TestChain100Setup)
+{
+    // Nothing saved yet
+    BOOST_CHECK(!LoadMempool());
+    BOOST_CHECK(GetMempoolLoadProgress().fDone);
+
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11 * CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+    CTransaction tx(spend);
+
+    int64_t nTime = GetTime() - 60 * 60;
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPoolWithTime(mempool, state, tx, false, NULL, nTime));
+    }
+    uint256 hashUnknown = GetRandHash();
+    mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), 1.0, 1000);
+    mempool.PrioritiseTransaction(hashUnknown, hashUnknown.ToString(), 0.0, -2000);
+
+    BOOST_CHECK(DumpMempool());
+    mempool.clear();
+    mempool.ClearPrioritisation(tx.GetHash());
+    mempool.ClearPrioritisation(hashUnknown);
+
+    BOOST_CHECK(LoadMempool());
+    CMempoolLoadProgress progress = GetMempoolLoadProgress();
+    BOOST_CHECK(progress.fDone);
+    BOOST_CHECK_EQUAL(progress.nTotal, 1);
+    BOOST_CHECK_EQUAL(progress.nProcessed, 1);
+    BOOST_CHECK_EQUAL(progress.nAccepted, 1);
+    {
+        LOCK(mempool.cs);
+        CTxMemPool::txiter it = mempool.mapTx.find(tx.GetHash());
+        BOOST_CHECK(it != mempool.mapTx.end());
+        BOOST_CHECK_EQUAL(it->GetTime(), nTime);
+        BOOST_CHECK_EQUAL(it->GetModifiedFee(), it->GetFee() + 1000);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas.size(), 2);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas[hashUnknown].second, -2000);
+    }
+    mempool.clear();
+    mempool.ClearPrioritisation(tx.GetHash());
+    mempool.ClearPrioritisation(hashUnknown);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -133,4 +133,29 @@ BOOST_AUTO_TEST_CASE(merkle_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(merkle_root_levels)
+{
+    // Sizes around the SIMD batch widths, where the odd-level padding and the
+    // 8-way/4-way/1-way split of each level interact.
+    for (int ntx = 0; ntx < 70; ntx++) {
+        std::vector<uint256> leaves(ntx);
+        for (int j = 0; j < ntx; j++) {
+            leaves[j] = GetRandHash();
+        }
+        bool mutated = true;
+        uint256 root = ComputeMerkleRoot(leaves, &mutated);
+        BOOST_CHECK(!mutated);
+        if (ntx > 0) {
+            // The branch code is a separate implementation; both must agree.
+            BOOST_CHECK(ComputeMerkleRootFromBranch(leaves[ntx - 1], ComputeMerkleBranch(leaves, ntx - 1), ntx - 1) == root);
+        }
+        // Identical siblings anywhere in a level, not just at its end, flag a mutation.
+        if (ntx >= 4) {
+            leaves[3] = leaves[2];
+            ComputeMerkleRoot(leaves, &mutated);
+            BOOST_CHECK(mutated);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -15,9 +15,11 @@
 #include "uint256.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "validationinterface.h"
 
 #include "test/test_bitcoin.h"
 
+#include <boost/make_shared.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(miner_tests, TestingSetup)
@@ -430,11 +432,17 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     BOOST_CHECK(CheckFinalTx(tx, flags)); // Locktime passes
     BOOST_CHECK(!TestSequenceLocks(tx, flags)); // Sequence locks fail
 
-    for (int i = 0; i < CBlockIndex::nMedianTimeSpan; i++)
-        chainActive.Tip()->GetAncestor(chainActive.Tip()->nHeight - i)->nTime += 512; //Trick the MedianTimePast
+    for (int i = 0; i < CBlockIndex::nMedianTimeSpan; i++) {
+        CBlockIndex* pindex = chainActive.Tip()->GetAncestor(chainActive.Tip()->nHeight - i);
+        pindex->nTime += 512; //Trick the MedianTimePast
+        pindex->nTimeMedianPast = 0; // and forget the memoized one
+    }
     BOOST_CHECK(SequenceLocks(tx, flags, &prevheights, CreateBlockIndex(chainActive.Tip()->nHeight + 1))); // Sequence locks pass 512 seconds later
-    for (int i = 0; i < CBlockIndex::nMedianTimeSpan; i++)
-        chainActive.Tip()->GetAncestor(chainActive.Tip()->nHeight - i)->nTime -= 512; //undo tricked MTP
+    for (int i = 0; i < CBlockIndex::nMedianTimeSpan; i++) {
+        CBlockIndex* pindex = chainActive.Tip()->GetAncestor(chainActive.Tip()->nHeight - i);
+        pindex->nTime -= 512; //undo tricked MTP
+        pindex->nTimeMedianPast = 0;
+    }
 
     // absolute height locked
     tx.vin[0].prevout.hash = txFirst[2]->GetHash();
@@ -502,4 +510,226 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+static TemplateCheckState WaitForTemplateCheck(const CBlockTemplate& blocktemplate)
+{
+    for (int i = 0; i < 1000 && blocktemplate.GetCheckState() == TEMPLATE_CHECK_PENDING; i++)
+        MilliSleep(10);
+    return blocktemplate.GetCheckState();
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_asynccheck)
+{
+    const CChainParams& chainparams = Params();
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    mapArgs["-asynctemplatecheck"] = "1";
+    boost::thread checkThread(&ThreadCheckBlockTemplates);
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(chainparams).CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(WaitForTemplateCheck(*pblocktemplate), TEMPLATE_CHECK_VALID);
+
+    // A transaction spending nothing makes the block invalid; the template
+    // is still returned, and found out later
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1000;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    mempool.addUnchecked(tx.GetHash(), entry.Fee(100000).Time(GetTime()).FromTx(tx));
+    pblocktemplate.reset(BlockAssembler(chainparams).CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK_EQUAL(WaitForTemplateCheck(*pblocktemplate), TEMPLATE_CHECK_INVALID);
+
+    // A template that another one follows before its check ran still gets a
+    // verdict; holding cs_main keeps the check from running in between
+    std::unique_ptr<CBlockTemplate> pblocktemplateNext;
+    {
+        LOCK(cs_main);
+        pblocktemplate.reset(BlockAssembler(chainparams).CreateNewBlock(scriptPubKey));
+        pblocktemplateNext.reset(BlockAssembler(chainparams).CreateNewBlock(CScript() << OP_2));
+        BOOST_CHECK_EQUAL(pblocktemplate->GetCheckState(), TEMPLATE_CHECK_PENDING);
+    }
+    BOOST_CHECK_EQUAL(WaitForTemplateCheck(*pblocktemplate), TEMPLATE_CHECK_INVALID);
+    BOOST_CHECK_EQUAL(WaitForTemplateCheck(*pblocktemplateNext), TEMPLATE_CHECK_INVALID);
+
+    CBlockTemplateStats stats = GetBlockTemplateStats();
+    BOOST_CHECK(stats.nChecksValid >= 1);
+    BOOST_CHECK(stats.nChecksInvalid >= 1);
+    BOOST_CHECK_EQUAL(stats.vLatencyCounts.size(), stats.vLatencyBoundsMs.size() + 1);
+
+    checkThread.interrupt();
+    checkThread.join();
+    mapArgs.erase("-asynctemplatecheck");
+    mempool.clear();
+}
+
+// A spend of the first coinbase of the test chain, with a second output of
+// nValueOut anyone can spend
+static CMutableTransaction SpendFirstCoinbase(TestChain100Setup& setup, CAmount nValueOut)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(setup.coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(setup.coinbaseTxns[0].GetHash(), 0);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = setup.coinbaseTxns[0].vout[0].nValue - nValueOut - 100000;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    tx.vout[1].nValue = nValueOut;
+    tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(setup.coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+BOOST_FIXTURE_TEST_CASE(CreateNewBlock_skipcheck, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    TestMemPoolEntryHelper entry;
+
+    // Asking again with nothing changed gives the same block, which is not
+    // checked again
+    std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(chainparams).CreateNewBlock(scriptPubKey));
+    uint64_t nSkipped = GetBlockTemplateStats().nChecksSkipped;
+    pblocktemplate.reset(BlockAssembler(chainparams).CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(GetBlockTemplateStats().nChecksSkipped, nSkipped + 1);
+
+    // Another coinbase or another transaction makes it a different block
+    pblocktemplate.reset(BlockAssembler(chainparams).CreateNewBlock(CScript() << OP_2));
+    BOOST_CHECK_EQUAL(GetBlockTemplateStats().nChecksSkipped, nSkipped + 1);
+    CMutableTransaction tx = SpendFirstCoinbase(*this, 0);
+    mempool.addUnchecked(tx.GetHash(), entry.Fee(100000).Time(GetTime()).FromTx(tx));
+    pblocktemplate.reset(BlockAssembler(chainparams).CreateNewBlock(CScript() << OP_2));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK_EQUAL(GetBlockTemplateStats().nChecksSkipped, nSkipped + 1);
+    pblocktemplate.reset(BlockAssembler(chainparams).CreateNewBlock(CScript() << OP_2));
+    BOOST_CHECK_EQUAL(GetBlockTemplateStats().nChecksSkipped, nSkipped + 2);
+
+    // In the background the same block is known valid at once, without
+    // waiting for the check thread; holding cs_main keeps it from running
+    mapArgs["-asynctemplatecheck"] = "1";
+    boost::thread checkThread(&ThreadCheckBlockTemplates);
+    {
+        LOCK(cs_main);
+        pblocktemplate.reset(BlockAssembler(chainparams).CreateNewBlock(CScript() << OP_2));
+        BOOST_CHECK_EQUAL(pblocktemplate->GetCheckState(), TEMPLATE_CHECK_VALID);
+        BOOST_CHECK_EQUAL(GetBlockTemplateStats().nChecksSkipped, nSkipped + 3);
+        pblocktemplate.reset(BlockAssembler(chainparams).CreateNewBlock(scriptPubKey));
+        BOOST_CHECK_EQUAL(pblocktemplate->GetCheckState(), TEMPLATE_CHECK_PENDING);
+    }
+    BOOST_CHECK_EQUAL(WaitForTemplateCheck(*pblocktemplate), TEMPLATE_CHECK_VALID);
+
+    checkThread.interrupt();
+    checkThread.join();
+    mapArgs.erase("-asynctemplatecheck");
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(CreateNewBlock_fullblock, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    TestMemPoolEntryHelper entry;
+
+    // Room for one small transaction besides the 4000 weight kept for the
+    // coinbase; once it is in, the block is within 4000 weight of full
+    mapArgs["-blockmaxweight"] = "8000";
+
+    CMutableTransaction txParent = SpendFirstCoinbase(*this, 10000);
+    mempool.addUnchecked(txParent.GetHash(), entry.Fee(100000).Time(GetTime()).FromTx(txParent));
+
+    // A small child with the lowest fee rate, looked at last
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 1);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 8000;
+    txChild.vout[0].scriptPubKey = scriptPubKey;
+    mempool.addUnchecked(txChild.GetHash(), entry.Fee(2000).Time(GetTime()).FromTx(txChild));
+
+    // Transactions too large for what is left, paying more than the child;
+    // they are never mined, so spend nothing real
+    CMutableTransaction txLarge;
+    txLarge.vin.resize(1);
+    txLarge.vin[0].scriptSig = CScript() << std::vector<unsigned char>(1000, 0);
+    txLarge.vout.resize(1);
+    txLarge.vout[0].nValue = 1000;
+    txLarge.vout[0].scriptPubKey = scriptPubKey;
+    for (int i = 0; i < 1000; i++) {
+        txLarge.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        mempool.addUnchecked(txLarge.GetHash(), entry.Fee(100000).Time(GetTime()).FromTx(txLarge));
+    }
+
+    // 1000 packages in a row that do not fit are still looked past
+    std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(chainparams).CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == txParent.GetHash());
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == txChild.GetHash());
+
+    // One more and selection stops with the block nearly full, leaving the
+    // child out; the block is still valid
+    txLarge.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mempool.addUnchecked(txLarge.GetHash(), entry.Fee(100000).Time(GetTime()).FromTx(txLarge));
+    pblocktemplate.reset(BlockAssembler(chainparams).CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == txParent.GetHash());
+    BOOST_CHECK(nLastBlockWeight > 8000 - 4000);
+
+    mapArgs.erase("-blockmaxweight");
+    mempool.clear();
+}
+
+// Pays the coinbase of mined blocks to OP_TRUE, standing in for a wallet
+class CMiningScriptProvider : public CValidationInterface
+{
+protected:
+    void GetScriptForMining(boost::shared_ptr<CReserveScript>& script)
+    {
+        script = boost::make_shared<CReserveScript>();
+        script->reserveScript = CScript() << OP_TRUE;
+    }
+};
+
+static int ChainHeight()
+{
+    LOCK(cs_main);
+    return chainActive.Height();
+}
+
+BOOST_FIXTURE_TEST_CASE(GenerateBitcoins_threads, TestChain100Setup)
+{
+    CMiningScriptProvider scriptProvider;
+    RegisterValidationInterface(&scriptProvider);
+    int nHeightStart = ChainHeight();
+
+    // In regtest each thread stops after its first block, so start them
+    // again for each round; at least one block is found per round
+    for (int i = 0; i < 3; i++) {
+        int nHeight = ChainHeight();
+        GenerateBitcoins(true, 4, Params());
+        for (int j = 0; j < 6000 && ChainHeight() == nHeight; j++)
+            MilliSleep(10);
+        BOOST_CHECK(ChainHeight() > nHeight);
+    }
+    GenerateBitcoins(false, 0, Params());
+    BOOST_CHECK_EQUAL(GetMinerHashesPerSec(), 0);
+
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(chainActive.Height() >= nHeightStart + 3);
+        for (int nHeight = nHeightStart + 1; nHeight <= chainActive.Height(); nHeight++) {
+            CBlock block;
+            BOOST_CHECK(ReadBlockFromDisk(block, chainActive[nHeight], Params().GetConsensus()));
+            BOOST_CHECK(block.vtx[0].vout[0].scriptPubKey == CScript() << OP_TRUE);
+        }
+    }
+
+    UnregisterValidationInterface(&scriptProvider);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,220 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include "chainparams.h"
+#include "hash.h"
+#include "main.h"
+#include "net.h"
+#include "protocol.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+// Started by StartNode, next to the message handler
+void StartSocketEvents();
+void AddConnectedNode(CNode* pnode);
+void ThreadSocketHandler();
+
+namespace {
+/** A complete network message with its header */
+std::vector<char> MakeMessage(const char* pszCommand, const CDataStream& payload)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    hdr.nChecksum = ReadLE32(hash.begin());
+    CDataStream msg(SER_NETWORK, PROTOCOL_VERSION);
+    msg << hdr;
+    std::vector<char> ret(msg.begin(), msg.end());
+    ret.insert(ret.end(), payload.begin(), payload.end());
+    return ret;
+}
+
+/** The far end of a peer's connection, as the test drives it */
+struct TestPeer
+{
+    NodeId id;
+    SOCKET hSocket;
+    std::vector<char> vBuffer;
+    std::vector<uint64_t> vPongs;
+    int64_t nSentTime;
+
+    /** Read what the node sent, keeping the nonces of its pongs. Returns false on EOF. */
+    bool Receive()
+    {
+        char pch[0x10000];
+        while (true) {
+            ssize_t nBytes = recv(hSocket, pch, sizeof(pch), MSG_DONTWAIT);
+            if (nBytes == 0)
+                return false;
+            if (nBytes < 0)
+                break;
+            vBuffer.insert(vBuffer.end(), pch, pch + nBytes);
+        }
+        while (vBuffer.size() >= CMessageHeader::HEADER_SIZE) {
+            const char* pchMsg = &vBuffer[0];
+            CDataStream ssHeader(pchMsg, pchMsg + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION);
+            CMessageHeader hdr(Params().MessageStart());
+            ssHeader >> hdr;
+            size_t nSize = CMessageHeader::HEADER_SIZE + hdr.nMessageSize;
+            if (vBuffer.size() < nSize)
+                break;
+            if (hdr.GetCommand() == NetMsgType::PONG) {
+                CDataStream ssPayload(pchMsg + CMessageHeader::HEADER_SIZE, pchMsg + nSize, SER_NETWORK, PROTOCOL_VERSION);
+                uint64_t nonce;
+                ssPayload >> nonce;
+                vPongs.push_back(nonce);
+            }
+            vBuffer.erase(vBuffer.begin(), vBuffer.begin() + nSize);
+        }
+        return true;
+    }
+};
+} // anon namespace
+#endif
+
+BOOST_FIXTURE_TEST_SUITE(msghand_tests, TestingSetup)
+
+#ifndef WIN32
+// 500 inbound peers on loopback socket pairs, served by the socket handler
+// and the message handler threads. Every round, each peer sends a burst of
+// pings in one write and waits for the pongs, which have to come back in
+// order; the round trip of each burst is one latency sample.
+BOOST_AUTO_TEST_CASE(msghand_loopback_stress)
+{
+    SocketEventsMode modePrev = nSocketEventsMode;
+#if HAVE_SYS_EPOLL_H
+    nSocketEventsMode = SOCKETEVENTS_EPOLL;
+    const int nPeers = 500;
+#else
+    // Two descriptors per peer have to stay below FD_SETSIZE
+    const int nPeers = 200;
+#endif
+    const int nRounds = 10;
+    const int nBurst = 4;
+    BOOST_REQUIRE(RaiseFileDescriptorLimit(2 * nPeers + 100) >= 2 * nPeers + 100);
+    StartSocketEvents();
+
+    std::vector<TestPeer> vPeers(nPeers);
+    for (int i = 0; i < nPeers; i++) {
+        int fds[2];
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+
+        in_addr ipv4Addr;
+        ipv4Addr.s_addr = htonl(0x0a000001 + i);
+        CNode* pnode = new CNode(fds[0], CAddress(CService(ipv4Addr, 7777), NODE_NETWORK), "", true);
+        // Skip the version handshake
+        pnode->nVersion = PROTOCOL_VERSION;
+        pnode->fSuccessfullyConnected = true;
+        pnode->AddRef();
+        AddConnectedNode(pnode);
+        vPeers[i].id = pnode->GetId();
+        vPeers[i].hSocket = fds[1];
+    }
+
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(&ThreadSocketHandler);
+    StartMessageHandler(threadGroup, DEFAULT_MSGHAND_THREADS);
+
+    std::vector<int64_t> vLatencies;
+    bool fInOrder = true;
+    for (int nRound = 0; nRound < nRounds; nRound++) {
+        for (int i = 0; i < nPeers; i++) {
+            std::vector<char> vBurst;
+            for (int j = 0; j < nBurst; j++) {
+                CDataStream payload(SER_NETWORK, PROTOCOL_VERSION);
+                payload << (uint64_t)((uint64_t)i << 32 | (nRound * nBurst + j + 1));
+                std::vector<char> vMsg = MakeMessage(NetMsgType::PING, payload);
+                vBurst.insert(vBurst.end(), vMsg.begin(), vMsg.end());
+            }
+            vPeers[i].nSentTime = GetTimeMicros();
+            BOOST_REQUIRE(send(vPeers[i].hSocket, &vBurst[0], vBurst.size(), MSG_NOSIGNAL) == (ssize_t)vBurst.size());
+        }
+
+        // Collect the pongs of this round
+        const size_t nExpected = (nRound + 1) * nBurst;
+        int nWaiting = nPeers;
+        int64_t nDeadline = GetTimeMillis() + 60 * 1000;
+        std::vector<pollfd> vPoll(nPeers);
+        while (nWaiting > 0 && GetTimeMillis() < nDeadline) {
+            for (int i = 0; i < nPeers; i++) {
+                vPoll[i].fd = vPeers[i].hSocket;
+                vPoll[i].events = vPeers[i].vPongs.size() < nExpected ? POLLIN : 0;
+                vPoll[i].revents = 0;
+            }
+            if (poll(&vPoll[0], vPoll.size(), 100) <= 0)
+                continue;
+            for (int i = 0; i < nPeers; i++) {
+                if (!(vPoll[i].revents & (POLLIN | POLLHUP)))
+                    continue;
+                TestPeer& peer = vPeers[i];
+                BOOST_REQUIRE(peer.Receive());
+                if (peer.vPongs.size() >= nExpected && vPoll[i].events) {
+                    vLatencies.push_back(GetTimeMicros() - peer.nSentTime);
+                    nWaiting--;
+                }
+            }
+        }
+        BOOST_REQUIRE_MESSAGE(nWaiting == 0, strprintf("%d peers got no answer in round %d", nWaiting, nRound));
+    }
+
+    for (int i = 0; i < nPeers; i++) {
+        BOOST_CHECK_EQUAL(vPeers[i].vPongs.size(), (size_t)(nRounds * nBurst));
+        for (size_t j = 0; j < vPeers[i].vPongs.size(); j++)
+            fInOrder = fInOrder && vPeers[i].vPongs[j] == ((uint64_t)i << 32 | (j + 1));
+    }
+    BOOST_CHECK(fInOrder);
+
+    std::sort(vLatencies.begin(), vLatencies.end());
+    BOOST_TEST_MESSAGE(strprintf("%d peers, %d rounds of %d pings: round trip median %.2fms, 99th percentile %.2fms, max %.2fms",
+        nPeers, nRounds, nBurst, vLatencies[vLatencies.size() / 2] / 1000.0,
+        vLatencies[vLatencies.size() * 99 / 100] / 1000.0, vLatencies.back() / 1000.0));
+
+    // Let the socket handler disconnect and delete the nodes, which releases
+    // the message handler's references to them, before stopping the threads
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            pnode->fDisconnect = true;
+    }
+    int64_t nDeadline = GetTimeMillis() + 10 * 1000;
+    for (int i = 0; i < nPeers && GetTimeMillis() < nDeadline; ) {
+        CNodeStateStats stats;
+        bool fAlive;
+        {
+            LOCK(cs_main);
+            fAlive = GetNodeStateStats(vPeers[i].id, stats);
+        }
+        if (fAlive)
+            MilliSleep(10);
+        else
+            i++;
+    }
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+
+    for (int i = 0; i < nPeers; i++)
+        CloseSocket(vPeers[i].hSocket);
+    nSocketEventsMode = modePrev;
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
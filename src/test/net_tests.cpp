@@ -11,6 +11,11 @@
 #include "net.h"
 #include "chainparams.h"
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#endif
+
 using namespace std;
 
 class CAddrManSerializationMock : public CAddrMan
@@ -164,4 +169,74 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+#ifndef WIN32
+// Queue owned and shared messages faster than the socket takes them and
+// check the far end gets exactly what each message serializes to.
+BOOST_AUTO_TEST_CASE(socket_send_batched)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CNode* pnode = new CNode(fds[0], CAddress(CService(ipv4Addr, 7777), NODE_NETWORK), "", true);
+
+    std::vector<unsigned char> vLarge(300000);
+    for (size_t i = 0; i < vLarge.size(); i++)
+        vLarge[i] = i * 7;
+    CNetPayloadRef payload = MakeNetPayload(vLarge);
+
+    CDataStream ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    for (uint64_t i = 0; i < 200; i++) {
+        if (i % 20 == 10) {
+            pnode->PushSharedMessage("large", payload);
+            CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+            ssPayload << vLarge;
+            CMessageHeader hdr(Params().MessageStart(), "large", ssPayload.size());
+            uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+            hdr.nChecksum = ReadLE32(hash.begin());
+            BOOST_CHECK_EQUAL(ReadLE32(hash.begin()), payload->GetChecksum());
+            ssExpected << hdr;
+            ssExpected.write(&ssPayload[0], ssPayload.size());
+        } else {
+            pnode->PushMessage("ping", i);
+            CMessageHeader hdr(Params().MessageStart(), "ping", sizeof(i));
+            CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+            ssPayload << i;
+            uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+            hdr.nChecksum = ReadLE32(hash.begin());
+            ssExpected << hdr << i;
+        }
+    }
+    {
+        LOCK(pnode->cs_vSend);
+        BOOST_CHECK(!pnode->vSendMsg.empty());
+    }
+
+    std::vector<char> vReceived;
+    char pch[0x10000];
+    for (int nTries = 0; vReceived.size() < ssExpected.size() && nTries < 100000; nTries++) {
+        ssize_t nBytes = recv(fds[1], pch, sizeof(pch), MSG_DONTWAIT);
+        if (nBytes > 0)
+            vReceived.insert(vReceived.end(), pch, pch + nBytes);
+        LOCK(pnode->cs_vSend);
+        SocketSendData(pnode);
+    }
+    {
+        LOCK(pnode->cs_vSend);
+        BOOST_CHECK(pnode->vSendMsg.empty());
+        BOOST_CHECK_EQUAL(pnode->nSendSize, 0U);
+        BOOST_CHECK_EQUAL(pnode->nSendBytes, ssExpected.size());
+    }
+    BOOST_CHECK(vReceived == std::vector<char>(ssExpected.begin(), ssExpected.end()));
+
+    pnode->CloseSocketDisconnect();
+    delete pnode;
+    SOCKET hRemote = fds[1];
+    CloseSocket(hRemote);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -251,4 +251,71 @@ BOOST_AUTO_TEST_CASE(netbase_getgroup)
     BOOST_CHECK(CNetAddr("2001:2001:9999:9999:9999:9999:9999:9999").GetGroup() == boost::assign::list_of((unsigned char)NET_IPV6)(32)(1)(32)(1)); //IPv6
 }
 
+#ifndef WIN32
+static int ReadyEvents(CSocketEvents& events, SOCKET hSocket, int64_t nTimeout)
+{
+    std::vector<std::pair<SOCKET, int> > vReady;
+    BOOST_CHECK(events.Wait(nTimeout, vReady));
+    int nEvents = 0;
+    for (size_t i = 0; i < vReady.size(); i++) {
+        BOOST_CHECK(vReady[i].first == hSocket);
+        nEvents |= vReady[i].second;
+    }
+    return nEvents;
+}
+
+static void CheckSocketEvents(SocketEventsMode mode)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    SOCKET hLocal = fds[0], hRemote = fds[1];
+    CSocketEvents events(mode);
+    BOOST_CHECK(events.GetMode() == mode);
+
+    // Nothing to read yet
+    BOOST_CHECK(events.Add(hLocal, SOCKET_EVENT_RECV | SOCKET_EVENT_ERR));
+    BOOST_CHECK_EQUAL(ReadyEvents(events, hLocal, 0), 0);
+
+    // Readable once the peer writes, until the data is read
+    char ch = 'x';
+    BOOST_CHECK_EQUAL(send(hRemote, &ch, 1, 0), 1);
+    BOOST_CHECK_EQUAL(ReadyEvents(events, hLocal, 1000), SOCKET_EVENT_RECV);
+    BOOST_CHECK_EQUAL(recv(hLocal, &ch, 1, 0), 1);
+    BOOST_CHECK_EQUAL(ReadyEvents(events, hLocal, 0), 0);
+
+    // Writable, but only reported while asked for
+    BOOST_CHECK(events.Set(hLocal, SOCKET_EVENT_SEND | SOCKET_EVENT_ERR));
+    BOOST_CHECK_EQUAL(ReadyEvents(events, hLocal, 1000), SOCKET_EVENT_SEND);
+    BOOST_CHECK(events.Set(hLocal, SOCKET_EVENT_ERR));
+    BOOST_CHECK_EQUAL(ReadyEvents(events, hLocal, 0), 0);
+
+    // A hangup by the peer is reported; epoll reports it as an error
+    BOOST_CHECK(events.Set(hLocal, SOCKET_EVENT_RECV | SOCKET_EVENT_ERR));
+    CloseSocket(hRemote);
+    int nEvents = ReadyEvents(events, hLocal, 1000);
+    BOOST_CHECK(nEvents & SOCKET_EVENT_RECV);
+    if (mode == SOCKETEVENTS_EPOLL)
+        BOOST_CHECK(nEvents & SOCKET_EVENT_ERR);
+    BOOST_CHECK_EQUAL(recv(hLocal, &ch, 1, 0), 0);
+
+    // Removed sockets are no longer reported
+    events.Remove(hLocal);
+    BOOST_CHECK_EQUAL(ReadyEvents(events, hLocal, 0), 0);
+    BOOST_CHECK(!events.Set(hLocal, SOCKET_EVENT_RECV));
+    CloseSocket(hLocal);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_select)
+{
+    CheckSocketEvents(SOCKETEVENTS_SELECT);
+}
+
+#if HAVE_SYS_EPOLL_H
+BOOST_AUTO_TEST_CASE(socketevents_epoll)
+{
+    CheckSocketEvents(SOCKETEVENTS_EPOLL);
+}
+#endif
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
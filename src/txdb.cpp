@@ -6,67 +6,370 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "compressor.h"
+#include "crypto/common.h"
 #include "hash.h"
+#include "init.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
+#include "utiltime.h"
 
+#include <algorithm>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
-static const char DB_COINS = 'c';
+static const char DB_COIN = 'C';
+static const char DB_COIN_OUTPUTS = 'O'; // Number of outputs of a transaction with unspent ones
+static const char DB_COINS = 'c'; // Per-transaction records, before the upgrade to DB_COIN
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
-static const char DB_BLOCK_INDEX = 'b';
+static const char DB_BLOCK_INDEX_HEIGHT = 'h';
+static const char DB_BLOCK_INDEX = 'b'; // Keyed by hash only, before the upgrade to DB_BLOCK_INDEX_HEIGHT
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_INDEX_SNAPSHOT = 's';
 
+namespace {
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+/** Database key of one unspent output */
+struct CoinKey
 {
+    char key;
+    uint256 hash;
+    uint32_t n;
+
+    CoinKey() : key(DB_COIN), n(0) {}
+    CoinKey(const uint256& hashIn, uint32_t nIn) : key(DB_COIN), hash(hashIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(key);
+        READWRITE(hash);
+        READWRITE(VARINT(n));
+    }
+};
+
+/** Database value of one unspent output: the output, and the metadata of the
+ *  transaction it belongs to (see CCoins) */
+struct CoinValue
+{
+    int nTxVersion;
+    unsigned int nHeight;
+    bool fCoinBase;
+    CTxOut out;
+
+    CoinValue() : nTxVersion(0), nHeight(0), fCoinBase(false) {}
+    CoinValue(const CCoins& coins, unsigned int n) : nTxVersion(coins.nVersion), nHeight(coins.nHeight), fCoinBase(coins.fCoinBase), out(coins.vout[n]) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nTxVersion));
+        READWRITE(VARINT(nCode));
+        READWRITE(REF(CTxOutCompressor(out)));
+        if (ser_action.ForRead()) {
+            nHeight = nCode / 2;
+            fCoinBase = nCode & 1;
+        }
+    }
+};
+
+/** Database key of a block index entry. The height is stored big-endian
+ *  first, so that iterating the database visits parents before children. */
+struct BlockIndexKey
+{
+    char key;
+    int nHeight;
+    uint256 hash;
+
+    BlockIndexKey() : key(DB_BLOCK_INDEX_HEIGHT), nHeight(0) {}
+    BlockIndexKey(int nHeightIn, const uint256& hashIn) : key(DB_BLOCK_INDEX_HEIGHT), nHeight(nHeightIn), hash(hashIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        unsigned char height[4];
+        WriteBE32(height, nHeight);
+        READWRITE(key);
+        READWRITE(FLATDATA(height));
+        READWRITE(hash);
+        if (ser_action.ForRead())
+            nHeight = ReadBE32(height);
+    }
+};
+
+/** Gather the outputs of the transaction at the cursor into coins, and move
+ *  the cursor past them. Returns false if the cursor is not at an output. */
+bool ReadCoins(CDBIterator* pcursor, uint256& txid, CCoins& coins, unsigned int* pnSize)
+{
+    CoinKey key;
+    if (!pcursor->Valid() || !pcursor->GetKey(key) || key.key != DB_COIN)
+        return false;
+    txid = key.hash;
+    coins.Clear();
+    unsigned int nSize = 0;
+    do {
+        CoinValue value;
+        if (!pcursor->GetValue(value))
+            return false;
+        if (coins.vout.size() <= key.n)
+            coins.vout.resize(key.n + 1);
+        coins.vout[key.n] = value.out;
+        coins.nVersion = value.nTxVersion;
+        coins.nHeight = value.nHeight;
+        coins.fCoinBase = value.fCoinBase;
+        nSize += pcursor->GetValueSize();
+        pcursor->Next();
+    } while (pcursor->Valid() && pcursor->GetKey(key) && key.key == DB_COIN && key.hash == txid);
+    if (pnSize)
+        *pnSize = nSize;
+    return true;
+}
+
+//! Above this many outputs, one seek reads a transaction faster than point reads
+static const unsigned int MAX_COIN_POINT_READS = 16;
+
+/** Read the outputs of a transaction with nOutputs outputs. */
+bool ReadCoinsOutputs(const CDBWrapper& db, const uint256& txid, unsigned int nOutputs, CCoins& coins)
+{
+    if (nOutputs > MAX_COIN_POINT_READS) {
+        boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper&>(db).NewIterator());
+        pcursor->Seek(CoinKey(txid, 0));
+        uint256 txidFound;
+        if (!ReadCoins(pcursor.get(), txidFound, coins, NULL) || txidFound != txid)
+            return false;
+    } else {
+        coins.Clear();
+        for (unsigned int i = 0; i < nOutputs; i++) {
+            CoinValue value;
+            if (!db.Read(CoinKey(txid, i), value))
+                continue;
+            coins.vout.resize(i + 1);
+            coins.vout[i] = value.out;
+            coins.nVersion = value.nTxVersion;
+            coins.nHeight = value.nHeight;
+            coins.fCoinBase = value.fCoinBase;
+        }
+    }
+    coins.nStoredOutputs = std::max<size_t>(nOutputs, coins.vout.size());
+    coins.fOutputsChanged = false;
+    return !coins.vout.empty();
+}
+
+/**
+ * Add the writes bringing the records of a transaction in line with coins.
+ * The coins tell which records can exist (see CCoins::nStoredOutputs), so
+ * nothing is read: outputs spent since then are erased, and unspent ones are
+ * only written if they are new. Outputs that were already spent when the
+ * coins were read are erased again, which is harmless.
+ */
+size_t WriteCoinsRecords(CDBBatch& batch, const uint256& txid, const CCoins& coins, bool fFresh)
+{
+    size_t nStored = fFresh ? 0 : coins.nStoredOutputs;
+    size_t nWrites = 0;
+    for (unsigned int i = 0; i < std::max(nStored, coins.vout.size()); i++) {
+        bool fUnspent = i < coins.vout.size() && !coins.vout[i].IsNull();
+        if (fUnspent && (i >= nStored || coins.fOutputsChanged)) {
+            batch.Write(CoinKey(txid, i), CoinValue(coins, i));
+            nWrites++;
+        } else if (!fUnspent && i < nStored) {
+            batch.Erase(CoinKey(txid, i));
+            nWrites++;
+        }
+    }
+    if (coins.vout.size() != nStored || coins.fOutputsChanged) {
+        if (coins.vout.empty())
+            batch.Erase(std::make_pair(DB_COIN_OUTPUTS, txid));
+        else
+            batch.Write(std::make_pair(DB_COIN_OUTPUTS, txid), (uint32_t)coins.vout.size());
+    }
+    return nWrites;
+}
+
+} // namespace
+
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true), fPending(false), fFlushFailed(false), fStopFlush(false), fBackgroundFlush(false)
+{
+}
+
+CCoinsViewDB::~CCoinsViewDB()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        fStopFlush = true;
+        condFlush.notify_all();
+    }
+    // Lets a pending write finish first
+    if (flushThread.joinable())
+        flushThread.join();
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        CCoinsMap::const_iterator it = mapPending.find(txid);
+        if (it != mapPending.end()) {
+            // Once written, exactly these outputs have records
+            coins = it->second.coins;
+            coins.nStoredOutputs = coins.vout.size();
+            coins.fOutputsChanged = false;
+            return true;
+        }
+    }
+    uint32_t nOutputs;
+    if (!db.Read(std::make_pair(DB_COIN_OUTPUTS, txid), nOutputs))
+        return false;
+    return ReadCoinsOutputs(db, txid, nOutputs, coins);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        CCoinsMap::const_iterator it = mapPending.find(txid);
+        if (it != mapPending.end())
+            return !it->second.coins.IsPruned();
+    }
+    return db.Exists(std::make_pair(DB_COIN_OUTPUTS, txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        if ((fPending || fFlushFailed) && !hashPending.IsNull())
+            return hashPending;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::WriteCoins(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase) {
+    int64_t nTimeStart = GetTimeMicros();
     CDBBatch batch(db);
+    // Outputs are stored separately, so only those that changed are written.
     size_t count = 0;
     size_t changed = 0;
+    size_t nRecords = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
-            else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+            nRecords += WriteCoinsRecords(batch, it->first, it->second.coins, it->second.flags & CCoinsCacheEntry::FRESH);
             changed++;
         }
         count++;
         CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase)
+            mapCoins.erase(itOld);
     }
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Committing %u changed transactions (%u outputs, out of %u transactions) to coin database...\n", (unsigned int)changed, (unsigned int)nRecords, (unsigned int)count);
+    bool ret = db.WriteBatch(batch);
+    int64_t nDuration = GetTimeMicros() - nTimeStart;
+    LogPrint("coindb", "Wrote %u bytes to coin database in %.2fms\n", (unsigned int)batch.SizeEstimate(), nDuration * 0.001);
+
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    flushStats.nCount++;
+    flushStats.nLastDuration = nDuration;
+    flushStats.nLastBytes = batch.SizeEstimate();
+    flushStats.nLastChanged = changed;
+    return ret;
+}
+
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    if (!fBackgroundFlush)
+        return WriteCoins(mapCoins, hashBlock, true);
+
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (fPending)
+        condFlush.wait(lock);
+    if (fFlushFailed)
+        return false;
+    // Take over the entries in constant time; the caller is left with the
+    // (empty) previous map.
+    mapPending.swap(mapCoins);
+    hashPending = hashBlock;
+    fPending = true;
+    condFlush.notify_all();
+    return true;
+}
+
+void CCoinsViewDB::ThreadFlush()
+{
+    RenameThread("bitcoin-coinsflush");
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (true) {
+        while (!fPending && !fStopFlush)
+            condFlush.wait(lock);
+        if (!fPending)
+            return;
+        bool fOk = false;
+        {
+            // Nothing else modifies mapPending while fPending is set, so it
+            // can be read without the lock, concurrently with lookups.
+            lock.unlock();
+            try {
+                fOk = WriteCoins(mapPending, hashPending, false);
+            } catch (const std::runtime_error& e) {
+                LogPrintf("%s: %s\n", __func__, e.what());
+            }
+            lock.lock();
+        }
+        if (fOk) {
+            // Free the entries outside the lock
+            CCoinsMap mapDone;
+            mapDone.swap(mapPending);
+            lock.unlock();
+            mapDone.clear();
+            lock.lock();
+        } else {
+            // Keep serving the entries; further writes are refused and the
+            // node shuts down when it next flushes.
+            LogPrintf("%s: failed to write to coin database\n", __func__);
+            fFlushFailed = true;
+        }
+        fPending = false;
+        condFlush.notify_all();
+    }
+}
+
+void CCoinsViewDB::StartBackgroundFlush()
+{
+    fBackgroundFlush = true;
+    flushThread = boost::thread(boost::bind(&CCoinsViewDB::ThreadFlush, this));
+}
+
+bool CCoinsViewDB::WaitForFlush() const
+{
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (fPending)
+        condFlush.wait(lock);
+    return !fFlushFailed;
+}
+
+CCoinsFlushStats CCoinsViewDB::GetFlushStats() const
+{
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    CCoinsFlushStats stats = flushStats;
+    stats.fBackground = fBackgroundFlush;
+    stats.fInProgress = fPending;
+    return stats;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
@@ -94,46 +397,97 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
+    // The cursor only sees what has been written
+    WaitForFlush();
     CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(), GetBestBlock());
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
-    // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    i->pcursor->Seek(DB_COIN);
+    // Gather the first transaction
+    i->Next();
     return i;
 }
 
-bool CCoinsViewDBCursor::GetKey(uint256 &key) const
+bool CCoinsViewDB::Upgrade()
 {
-    // Return cached key
-    if (keyTmp.first == DB_COINS) {
-        key = keyTmp.second;
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid())
         return true;
+
+    LogPrintf("Upgrading UTXO database to per-output records: [0%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    // Each batch converts whole transactions, so an interrupted upgrade
+    // resumes where it stopped.
+    static const size_t nBatchSize = 1 << 24;
+    CDBBatch batch(db);
+    size_t nTransactions = 0;
+    size_t nOutputs = 0;
+    int nReportDone = 0;
+    std::pair<char, uint256> key;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        if (!pcursor->GetKey(key) || key.first != DB_COINS)
+            break;
+        if (nTransactions++ % 256 == 0) {
+            // Keys are random, so the leading txid bytes tell the progress
+            uint32_t nHigh = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+            int nPercentageDone = (int)(nHigh * 100.0 / 65536.0 + 0.5);
+            uiInterface.ShowProgress(_("Upgrading UTXO database"), nPercentageDone);
+            if (nReportDone < nPercentageDone / 10) {
+                LogPrintf("[%d%%]...", nPercentageDone);
+                nReportDone = nPercentageDone / 10;
+            }
+        }
+        CCoins coins;
+        if (!pcursor->GetValue(coins))
+            return error("%s: cannot parse CCoins record", __func__);
+        nOutputs += WriteCoinsRecords(batch, key.second, coins, true);
+        batch.Erase(key);
+        if (batch.SizeEstimate() > nBatchSize) {
+            db.WriteBatch(batch);
+            batch.Clear();
+        }
+        pcursor->Next();
     }
-    return false;
+    db.WriteBatch(batch);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s]. Converted %u transactions into %u outputs.\n", ShutdownRequested() ? "CANCELLED" : "DONE", (unsigned int)nTransactions, (unsigned int)nOutputs);
+    return !ShutdownRequested();
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
+bool CCoinsViewDBCursor::GetKey(uint256 &key) const
 {
-    return pcursor->GetValue(coins);
+    if (!fValid)
+        return false;
+    key = txid;
+    return true;
+}
+
+bool CCoinsViewDBCursor::GetValue(CCoins &coinsOut) const
+{
+    if (!fValid)
+        return false;
+    coinsOut = coins;
+    return true;
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
 {
-    return pcursor->GetValueSize();
+    return nValueSize;
 }
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return fValid;
 }
 
 void CCoinsViewDBCursor::Next()
 {
-    pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
-        keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    fValid = ReadCoins(pcursor.get(), txid, coins, &nValueSize);
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -143,7 +497,7 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     }
     batch.Write(DB_LAST_BLOCK, nLastFile);
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
-        batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
+        batch.Write(BlockIndexKey((*it)->nHeight, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
     }
     return WriteBatch(batch, true);
 }
@@ -171,17 +525,67 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::WriteSnapshotTag(const uint256 &tag) {
+    return Write(DB_INDEX_SNAPSHOT, tag, true);
+}
+
+bool CBlockTreeDB::ReadSnapshotTag(uint256 &tag) {
+    return Read(DB_INDEX_SNAPSHOT, tag);
+}
+
+bool CBlockTreeDB::EraseSnapshotTag() {
+    return Erase(DB_INDEX_SNAPSHOT, true);
+}
+
+bool CBlockTreeDB::UpgradeBlockIndex()
+{
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
+    if (!pcursor->Valid())
+        return true;
+
+    LogPrintf("Upgrading block index database to height order...\n");
+    // A record's write and erase always share a batch, so an interrupted
+    // upgrade resumes where it stopped.
+    static const size_t nBatchSize = 1 << 24;
+    CDBBatch batch(*this);
+    size_t nEntries = 0;
+    std::pair<char, uint256> key;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (!pcursor->GetKey(key) || key.first != DB_BLOCK_INDEX)
+            break;
+        CDiskBlockIndex diskindex;
+        if (!pcursor->GetValue(diskindex))
+            return error("%s: failed to read value", __func__);
+        batch.Write(BlockIndexKey(diskindex.nHeight, key.second), diskindex);
+        batch.Erase(key);
+        if (batch.SizeEstimate() > nBatchSize) {
+            WriteBatch(batch);
+            batch.Clear();
+        }
+        nEntries++;
+        pcursor->Next();
+    }
+    WriteBatch(batch);
+    LogPrintf("Moved %u block index entries.\n", (unsigned int)nEntries);
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
 {
+    if (!UpgradeBlockIndex())
+        return false;
+
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
-    pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
+    pcursor->Seek(BlockIndexKey());
 
     // Load mapBlockIndex
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
+        BlockIndexKey key;
+        if (pcursor->GetKey(key) && key.key == DB_BLOCK_INDEX_HEIGHT) {
             CDiskBlockIndex diskindex;
             if (pcursor->GetValue(diskindex)) {
                 // Construct block index object
@@ -16,6 +16,9 @@
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
@@ -35,6 +38,8 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! -backgroundflush default
+static const bool DEFAULT_BACKGROUND_FLUSH = false;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -61,19 +66,79 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/** Statistics about writes to the coin database */
+struct CCoinsFlushStats
+{
+    //! Number of completed writes
+    uint64_t nCount;
+    //! Duration of the last write, in microseconds
+    int64_t nLastDuration;
+    //! Serialized size of the last write
+    size_t nLastBytes;
+    //! Changed entries in the last write
+    size_t nLastChanged;
+    //! Whether writes happen in the background
+    bool fBackground;
+    //! Whether a write is running in the background
+    bool fInProgress;
+
+    CCoinsFlushStats() : nCount(0), nLastDuration(0), nLastBytes(0), nLastChanged(0), fBackground(false), fInProgress(false) {}
+};
+
+/** CCoinsView backed by the coin database (chainstate/)
+ *
+ * Every unspent output is a separate record keyed by its outpoint, so
+ * spending some outputs of a transaction does not rewrite the others. A
+ * record per transaction holds its number of outputs, so lookups are point
+ * reads, and writes know which records exist from the cached coins alone.
+ *
+ * With StartBackgroundFlush(), BatchWrite() only takes over the flushed
+ * entries and returns; a background thread writes them while they keep
+ * being served to readers from memory. Each write is a single batch that
+ * includes the best block marker, so the database on disk always matches
+ * some block that was completely connected. Only one write is in flight
+ * at a time: a further BatchWrite() waits for the previous one.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+
+    //! Protects the members below
+    mutable boost::mutex csFlush;
+    mutable boost::condition_variable condFlush;
+    //! Entries handed to the background thread and not written yet
+    CCoinsMap mapPending;
+    uint256 hashPending;
+    bool fPending;
+    bool fFlushFailed;
+    bool fStopFlush;
+    CCoinsFlushStats flushStats;
+
+    bool fBackgroundFlush;
+    boost::thread flushThread;
+
+    bool WriteCoins(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase);
+    void ThreadFlush();
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     CCoinsViewCursor *Cursor() const;
+
+    //! Convert per-transaction records of older versions to per-output ones
+    bool Upgrade();
+
+    //! Write flushed entries from a background thread from now on
+    void StartBackgroundFlush();
+    //! Wait until no background write is in flight. Returns false if one failed.
+    bool WaitForFlush() const;
+    CCoinsFlushStats GetFlushStats() const;
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -91,9 +156,14 @@ public:
 
 private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
-        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
+        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn), nValueSize(0), fValid(false) {}
     boost::scoped_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    //! The transaction at the cursor, gathered from its output records
+    uint256 txid;
+    CCoins coins;
+    //! Total size of those records
+    unsigned int nValueSize;
+    bool fValid;
 
     friend class CCoinsViewDB;
 };
@@ -116,7 +186,13 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    //! Identify the block index snapshot that matches the database contents
+    bool WriteSnapshotTag(const uint256 &tag);
+    bool ReadSnapshotTag(uint256 &tag);
+    bool EraseSnapshotTag();
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    //! Move entries stored in the old hash-ordered layout to the height-ordered one
+    bool UpgradeBlockIndex();
 };
 
 #endif // BITCOIN_TXDB_H